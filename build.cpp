@@ -23,6 +23,18 @@ int main(int argc, char** argv)
             nob::CLFlags.set(nob::CLArgument::Clean);
             break;
         }
+        else if (i == "-bench")
+        {
+            nob::DefaultCompileCommand = nob::DefaultCompileCommand + nob::MacroDefinition{ "RUN_BENCHMARKS", "1" };
+            nob::CLFlags.set(nob::CLArgument::Clean);
+            break;
+        }
+        else if (i == "-trace")
+        {
+            nob::DefaultCompileCommand = nob::DefaultCompileCommand + nob::MacroDefinition{ "PARSER_TRACING", "1" };
+            nob::CLFlags.set(nob::CLArgument::Clean);
+            break;
+        }
         else
         {
             nob::Log("Argument ignored: " + i);
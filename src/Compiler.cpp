@@ -1,5 +1,7 @@
 #include "Compiler.h"
 #include <fstream>
+#include <charconv>
+#include <algorithm>
 #define _USE_MATH_DEFINES
 #include <math.h>
 #include <iostream>
@@ -52,7 +54,9 @@ float CalculateMath(StringStream& code, ParseContext& vars)
     else
     {
         next = code.str.find_first_of("*/+%^sctpea ,)", code.place);
-        ret = std::stoi(code.str.substr(code.place, next - code.place));
+        int value = 0;
+        std::from_chars(code.str.data() + code.place, code.str.data() + std::min(next, code.str.size()), value);
+        ret = value;
     }
 
     code.place = next;
@@ -0,0 +1,515 @@
+#include "Bytecode.h"
+#include "Parser.h"
+#include "Incremental.h"
+#include "Module.h"
+#include "ThreadPool.h"
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Micro benchmarks for the compiler front end. Build with -bench, numbers are only comparable between runs on the same machine.
+
+namespace
+{
+    // Best of several runs, in seconds.
+    template<typename F>
+    double TimeBest(F&& f, int runs = 5)
+    {
+        double best = 1e30;
+        for (int i = 0; i < runs; i++)
+        {
+            auto begin = std::chrono::steady_clock::now();
+            f();
+            std::chrono::duration<double> d = std::chrono::steady_clock::now() - begin;
+            if (d.count() < best) best = d.count();
+        }
+        return best;
+    }
+
+    std::string Repeat(const std::string& unit, size_t bytes)
+    {
+        std::string ret;
+        ret.reserve(bytes + unit.size());
+        while (ret.size() < bytes) ret += unit;
+        return ret;
+    }
+}
+
+#ifdef RUN_BENCHMARKS
+
+// Every allocation of the benchmark binary is counted, so that benchmarks can report how many a piece of work made.
+std::atomic<uint64_t> allocations = 0;
+
+void* operator new(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+// GCC takes what operator delete is given to have come from operator new and warns about freeing it, but the one above used malloc.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+#endif
+
+std::vector<std::pair<std::string, std::string>> LoadGoldenTests(std::string filename);  // in Tests.cpp
+
+void BenchmarkLexer()
+{
+    const size_t size = 16 << 20;
+    const std::vector<std::pair<std::string, std::string>> inputs = {
+        { "mixed", "    point_a12 = lambda (x: double, y: double) { return x * 2.5 + y / 3; };  // helper\n    label = \"line\\tthrough\" + name_of_thing;\n" },
+        { "identifiers", "first_identifier secondIdentifier42 another_rather_long_identifier_name x y z " },
+        { "whitespace", "{\n                \n\t\t\t\t    a\n                                        b;\n}\n" },
+        { "comments", "// a comment that goes on for quite a while, as comments in generated code tend to do\nx;\n" },
+        { "strings", "\"a reasonably long string literal without any escapes\" \"and one with\\nan escape\"\n" },
+        { "numbers", "12345678 3.14159265 .5 42 1000000.0001 7\n" },
+    };
+
+    std::cout << "Lexer throughput (" << (size >> 20) << " MB inputs):\n";
+    for (auto& i : inputs)
+    {
+        std::string src = Repeat(i.second, size);
+        size_t tokens = 0;
+        double serial = TimeBest([&]() { SymbolTable symbols; tokens = Tokenize(src, symbols, 1).Size(); });
+        double parallel = TimeBest([&]() { SymbolTable symbols; Tokenize(src, symbols).Size(); });
+        std::cout << "  " << i.first << ": " << (src.size() / serial) / (1 << 20) << " MB/s, " << (src.size() / parallel) / (1 << 20)
+                  << " MB/s on " << ThreadPool::Global().Size() << " threads, " << tokens << " tokens\n";
+    }
+}
+
+void BenchmarkStreamingLexer()
+{
+    std::string src = Repeat("    point_a12 = lambda (x: double, y: double) { return x * 2.5 + y / 3; };  // helper\n    label = \"line\\tthrough\" + name_of_thing;\n", 64 << 20);
+
+    int tokens = 0;
+    double t = TimeBest([&]()
+    {
+        std::istringstream in(src);
+        SymbolTable symbols;
+        TokenStream stream = TokenizeLazily(in, symbols, 1024);
+        for (tokens = 0; stream[tokens].type != TokenType::EndOfFile; tokens++);
+    }, 3);
+    std::cout << "Streaming lexer (" << (src.size() >> 20) << " MB input, 1024 token window): " << (src.size() / t) / (1 << 20) << " MB/s, " << tokens << " tokens\n";
+}
+
+// Parses many short statements, which is mostly the cost of getting from a statement down to its primary expressions, and one
+// long chain of additions, which is where the cost of copying expressions on every level shows up.
+void BenchmarkParser()
+{
+    {
+        std::string src = "{ a = 1;";
+        for (int i = 0; i < 5000; i++) src += " a = (a + 2) * 3 - a / 4 % 5;";
+        src += " }";
+
+        SymbolTable symbols;
+        TokenStream tokens = Tokenize(src, symbols);
+        double t = TimeBest([&]()
+        {
+            AstArena arena;
+            ParsingContext pc;
+            Statement s = SingleStatement{ { LiteralExpression{ AtomicType::Error, { tokens, 0 } } } }; int consumed = 0;
+            ParseStatement({ tokens, 0 }, pc, s, consumed);
+        }, 3);
+        std::cout << "Parser, 5000 short statements: " << t * 1000 << " ms, " << t * 1e9 / tokens.Size() << " ns per token\n";
+    }
+
+    // Every statement here starts with a possible variable definition, which used to mean copying the whole parsing context.
+    std::cout << "Parser, one scope defining n variables:\n";
+    for (int n : { 1000, 2000, 4000, 8000 })
+    {
+        std::string src = "{";
+        for (int i = 0; i < n; i++) src += " v" + std::to_string(i) + " = " + std::to_string(i) + " + 1;";
+        src += " }";
+
+        SymbolTable symbols;
+        TokenStream tokens = Tokenize(src, symbols);
+        double t = TimeBest([&]()
+        {
+            AstArena arena;
+            ParsingContext pc;
+            Statement s = SingleStatement{ { LiteralExpression{ AtomicType::Error, { tokens, 0 } } } }; int consumed = 0;
+            ParseStatement({ tokens, 0 }, pc, s, consumed);
+        }, 3);
+        std::cout << "  n = " << n << ": " << t * 1000 << " ms, " << t * 1e9 / tokens.Size() << " ns per token\n";
+    }
+
+    // Ten new variables per scope, each read from the outermost scope, which a search from the top of the stack reaches last.
+    std::cout << "Parser, n variables in nested scopes:\n";
+    for (int n : { 1000, 2000, 4000, 8000 })
+    {
+        std::string src;
+        for (int i = 0; i < n; i++) src += (i % 10 == 0 ? "{ v" : " v") + std::to_string(i) + " = v" + std::to_string(i % 10) + " + 1;";
+        for (int i = 0; i < n; i += 10) src += " }";
+
+        SymbolTable symbols;
+        TokenStream tokens = Tokenize(src, symbols);
+        double t = TimeBest([&]()
+        {
+            AstArena arena;
+            ParsingContext pc;
+            for (int i = 0; i < 10; i++) pc.varStack.push_back({ symbols.Intern("v" + std::to_string(i)), AtomicType::Integer });
+            Statement s = SingleStatement{ { LiteralExpression{ AtomicType::Error, { tokens, 0 } } } }; int consumed = 0;
+            ParseStatement({ tokens, 0 }, pc, s, consumed);
+        }, 3);
+        std::cout << "  n = " << n << ": " << t * 1000 << " ms, " << t * 1e9 / tokens.Size() << " ns per token\n";
+    }
+
+    // Each operator wraps the tree built so far, so these only scale linearly if that tree is moved rather than copied.
+    std::cout << "Parser, one statement of n additions:\n";
+    for (int n : { 1000, 2000, 4000, 8000, 16000 })
+    {
+        std::string src = "x = 1";
+        for (int i = 0; i < n; i++) src += " + " + std::to_string(i);
+        src += ";";
+
+        SymbolTable symbols;
+        TokenStream tokens = Tokenize(src, symbols);
+        double t = TimeBest([&]()
+        {
+            AstArena arena;
+            ParsingContext pc = { { { symbols.Intern("x"), AtomicType::Integer } } };
+            Statement s = SingleStatement{ { LiteralExpression{ AtomicType::Error, { tokens, 0 } } } }; int consumed = 0;
+            ParseStatement({ tokens, 0 }, pc, s, consumed);
+        }, 3);
+        std::cout << "  n = " << n << ": " << t * 1000 << " ms, " << t * 1e9 / tokens.Size() << " ns per token\n";
+    }
+
+    // Only ten of the helpers are called, so in lazy mode the rest are just skimmed.
+    std::cout << "Parser, n helper lambdas of which 10 are called, eager and lazy:\n";
+    for (int n : { 100, 1000, 4000 })
+    {
+        std::string src = "{";
+        for (int i = 0; i < n; i++) src += " h" + std::to_string(i) + " = lambda (x: int) { y = x * 2 + 1; z = y - x; if (z > y) { return z; } return y + z; };";
+        for (int i = 0; i < 10; i++) src += " r" + std::to_string(i) + " = h" + std::to_string(i * n / 10) + "(" + std::to_string(i) + ");";
+        src += " }";
+
+        SymbolTable symbols;
+        TokenStream tokens = Tokenize(src, symbols);
+        double times[2];
+        for (bool lazy : { false, true })
+        {
+            times[lazy] = TimeBest([&]()
+            {
+                AstArena arena;
+                ParsingContext pc;
+                pc.lazyLambdas = lazy;
+                Statement s = SingleStatement{ { LiteralExpression{ AtomicType::Error, { tokens, 0 } } } }; int consumed = 0;
+                ParseStatement({ tokens, 0 }, pc, s, consumed);
+            }, 3);
+        }
+        std::cout << "  n = " << n << ": " << times[0] * 1000 << " ms eager, " << times[1] * 1000 << " ms lazy\n";
+    }
+}
+
+// Variables of wide record and union types, declared, passed to a lambda, compared and cast, so that most of the work is building,
+// copying and comparing those types rather than parsing.
+void BenchmarkTypeChecking()
+{
+    const std::string w = "((int | string | (int, double, bool) | (double -> int)), ((int, double) | bool), string, (((int, int) | (double, double)), bool))";
+    std::cout << "Type checking, n groups of statements on record and union types:\n";
+    for (int n : { 500, 1000, 2000 })
+    {
+        std::string src = "{ v0: " + w + " = v0; f = lambda (a: " + w + ") { return a; };";
+        for (int i = 1; i <= n; i++)
+        {
+            std::string v = "v" + std::to_string(i), prev = "v" + std::to_string(i - 1);
+            src += " " + v + ": " + w + " = " + prev + "; " + v + "f = f(" + v + "); " + v + "p = (" + v + ", " + v + "f, " + std::to_string(i) + ");";
+            src += " " + v + "q: (" + w + ", " + w + ", int) = " + v + "p; " + v + "e = " + v + "q == " + v + "p;";
+            src += " " + v + "c = " + v + "q : (" + w + ", (" + w + " | bool), double);";
+        }
+        src += " }";
+
+        SymbolTable symbols;
+        TokenStream tokens = Tokenize(src, symbols);
+        double t = TimeBest([&]()
+        {
+            AstArena arena;
+            ParsingContext pc;
+            Statement s = SingleStatement{ { LiteralExpression{ AtomicType::Error, { tokens, 0 } } } }; int consumed = 0;
+            ParseStatement({ tokens, 0 }, pc, s, consumed);
+        }, 3);
+        std::cout << "  n = " << n << ": " << t * 1000 << " ms, " << t * 1e9 / tokens.Size() << " ns per token\n";
+    }
+    CastCacheStats casts = GetCastCacheStats();
+    std::cout << "  Cast cache: " << casts.hits << " hits, " << casts.misses << " misses\n";
+
+    // A union of n distinct records, written in opposite orders, cast into a union of twice as many.
+    std::cout << "Type checking, unions of n members:\n";
+    for (int n : { 250, 500, 1000 })
+    {
+        auto member = [](int i)
+        {
+            std::string t = "(";
+            for (int bit = 0; bit < 12; bit++) t += std::string(bit ? ", " : "") + ((i >> bit) & 1 ? "double" : "int");
+            return t + ")";
+        };
+        std::string u, reversed, wide;
+        for (int i = 0; i < n; i++) u += (i ? " | " : "") + member(i);
+        for (int i = n - 1; i >= 0; i--) reversed += (i < n - 1 ? " | " : "") + member(i);
+        for (int i = 2 * n - 1; i >= 0; i--) wide += (i < 2 * n - 1 ? " | " : "") + member(i);
+        std::string src = "{ a = (1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1) : (" + u + "); b: (" + reversed + ") = a; c = b : (" + wide + "); }";
+
+        SymbolTable symbols;
+        TokenStream tokens = Tokenize(src, symbols);
+        double t = TimeBest([&]()
+        {
+            AstArena arena;
+            ParsingContext pc;
+            Statement s = SingleStatement{ { LiteralExpression{ AtomicType::Error, { tokens, 0 } } } }; int consumed = 0;
+            ParseStatement({ tokens, 0 }, pc, s, consumed);
+        }, 3);
+        std::cout << "  n = " << n << ": " << t * 1000 << " ms, " << t * 1e9 / tokens.Size() << " ns per token\n";
+    }
+
+    // A few generic helpers, each called many times with the same handful of argument types.
+    std::cout << "Type checking, n calls of template lambdas:\n";
+    for (int n : { 500, 1000, 2000 })
+    {
+        std::string src = "{ dbl = lambda (a) { return a + a; }; twice = lambda (x) { y = dbl(x); return dbl(y); };";
+        for (int i = 0; i < n; i++)
+        {
+            std::string v = std::to_string(i);
+            src += " i" + v + " = twice(" + v + "); d" + v + " = dbl(" + v + ".5); s" + v + " = twice(\"" + v + "\");";
+        }
+        src += " }";
+
+        SymbolTable symbols;
+        TokenStream tokens = Tokenize(src, symbols);
+        double t = TimeBest([&]()
+        {
+            AstArena arena;
+            ParsingContext pc;
+            Statement s = SingleStatement{ { LiteralExpression{ AtomicType::Error, { tokens, 0 } } } }; int consumed = 0;
+            ParseStatement({ tokens, 0 }, pc, s, consumed);
+        }, 3);
+        std::cout << "  n = " << n << ": " << t * 1000 << " ms, " << t * 1e9 / tokens.Size() << " ns per token\n";
+    }
+
+    // Every template lambda keeps the context it was defined in, so defining them after many variables must not copy those.
+    std::cout << "Type checking, 500 template lambdas defined after n variables:\n";
+    for (int n : { 1000, 4000, 16000 })
+    {
+        std::string src = "{";
+        for (int i = 0; i < n; i++) src += " v" + std::to_string(i) + " = " + std::to_string(i) + ";";
+        for (int i = 0; i < 500; i++)
+        {
+            std::string v = std::to_string(i);
+            src += " f" + v + " = lambda (a) { return a + v" + std::to_string(i % n) + "; }; r" + v + " = f" + v + "(" + v + ");";
+        }
+        src += " }";
+
+        SymbolTable symbols;
+        TokenStream tokens = Tokenize(src, symbols);
+        double t = TimeBest([&]()
+        {
+            AstArena arena;
+            ParsingContext pc;
+            Statement s = SingleStatement{ { LiteralExpression{ AtomicType::Error, { tokens, 0 } } } }; int consumed = 0;
+            ParseStatement({ tokens, 0 }, pc, s, consumed);
+        }, 3);
+        std::cout << "  n = " << n << ": " << t * 1000 << " ms, " << t * 1e9 / tokens.Size() << " ns per token\n";
+    }
+}
+
+// Allocations made parsing each input of the golden tests, which are small programs of the kind people write by hand.
+#ifdef RUN_BENCHMARKS
+void BenchmarkAllocations()
+{
+    uint64_t total = 0;
+    size_t tokenCount = 0;
+    for (const std::pair<std::string, std::string>& test : LoadGoldenTests("golden_tests.txt"))
+    {
+        SymbolTable symbols;
+        TokenStream tokens = Tokenize(test.first, symbols);
+        AstArena arena;
+        ParsingContext pc = { { { symbols.Intern("func1"), LambdaType{ { AtomicType::Integer }, { AtomicType::String } } } } };
+        Statement s = SingleStatement{ { LiteralExpression{ AtomicType::Error, { tokens, 0 } } } }; int consumed = 0;
+        uint64_t before = allocations.load();
+        ParseStatement({ tokens, 0 }, pc, s, consumed);
+        total += allocations.load() - before;
+        tokenCount += tokens.Size();
+    }
+    std::cout << "Allocations parsing the golden tests: " << total << ", " << (double)total / tokenCount << " per token\n";
+}
+#endif
+
+// Single character edits to a large file, against parsing all of it again.
+void BenchmarkIncremental()
+{
+    const int lines = 100000;
+    std::string src = "v0 = 0;\n";
+    for (int i = 1; i < lines; i++) src += "v" + std::to_string(i) + " = v" + std::to_string(i - 1) + " + " + std::to_string(i % 10) + ";\n";
+
+    SymbolTable symbols;
+    AstArena arena;
+    double full = TimeBest([&]() { Document doc(src, symbols); }, 3);
+    std::cout << "Incremental parsing, " << lines << " lines:\n";
+    std::cout << "  parsing from scratch: " << full * 1000 << " ms\n";
+
+    Document doc(src, symbols);
+    std::mt19937 rng(1);
+    std::vector<size_t> lineStarts = { 0 };
+    for (size_t i = 0; i + 1 < src.size(); i++) if (src[i] == '\n') lineStarts.push_back(i + 1);
+
+    // Changing the number added keeps every type the same, a new line moves everything after it.
+    for (bool newline : { false, true })
+    {
+        int edits = 0;
+        size_t lexed = 0; long parsed = 0, reused = 0;
+        auto edit = [&](size_t offset, size_t removed, std::string_view inserted)
+        {
+            doc.Edit(offset, removed, inserted);
+            edits++;
+            lexed += doc.LastEdit().bytesLexed;
+            parsed += doc.LastEdit().statementsParsed;
+            reused += doc.LastEdit().statementsReused;
+        };
+
+        auto begin = std::chrono::steady_clock::now();
+        for (int i = 0; i < 500; i++)
+        {
+            size_t line = 1 + rng() % (lines - 1);
+            size_t digit = (line + 1 < lineStarts.size() ? lineStarts[line + 1] : src.size()) - 3;  // before ";\n"
+            if (newline)
+            {
+                edit(lineStarts[line], 0, "\n");
+                edit(lineStarts[line], 1, "");
+            }
+            else edit(digit, 1, std::to_string(rng() % 10));
+        }
+        std::chrono::duration<double> d = std::chrono::steady_clock::now() - begin;
+        std::cout << "  " << (newline ? "inserting or removing a line" : "changing a digit") << ": " << d.count() * 1000 / edits << " ms per edit, "
+            << lexed / edits << " bytes lexed, " << parsed / edits << " statements parsed, " << reused / edits << " reused\n";
+    }
+}
+
+// Independent figures, each with a constant, a helper lambda and a call to it, parsed one after the other and on pools of threads.
+void BenchmarkParallelParser()
+{
+    const int figures = 5000;
+    std::string src;
+    for (int i = 0; i < figures; i++)
+    {
+        std::string n = std::to_string(i);
+        src += "c" + n + " = " + std::to_string(i % 10) + ";\n";
+        src += "f" + n + " = lambda (x: int) { y = x * c" + n + "; for (j = 0; j < 3; j = j + 1) { y = y + j; } return y; };\n";
+        src += "r" + n + " = func1(f" + n + "(c" + n + "));\n";
+    }
+
+    SymbolTable symbols;
+    ParsingContext pc = { { { symbols.Intern("func1"), LambdaType{ { AtomicType::Integer }, { AtomicType::String } } } } };
+    std::cout << "Parallel parsing, " << figures * 3 << " statements in " << figures << " groups:\n";
+    double serial = TimeBest([&]() { AstArena arena; ParseModule(src, symbols, pc); }, 3);
+    std::cout << "  serial: " << serial * 1000 << " ms\n";
+    for (int threads : { 2, 4, 8 })
+    {
+        ThreadPool pool(threads);
+        double t = TimeBest([&]() { AstArena arena; ParseModule(src, symbols, pc, nullptr, &pool); }, 3);
+        double forced = TimeBest([&]() { AstArena arena; ParseModule(src, symbols, pc, nullptr, &pool, 0); }, 3);
+        std::cout << "  " << threads << " threads: " << t * 1000 << " ms, " << forced * 1000 << " ms without the threshold\n";
+    }
+    std::cout << "  (" << std::thread::hardware_concurrency() << " hardware threads)\n";
+}
+
+// Loading a large file twice, compiling it and writing the cache the first time, and loading only the cache the second.
+void BenchmarkModuleCache()
+{
+    const int lines = 100000;
+    std::string src = "v0 = 0;\n";
+    for (int i = 1; i < lines; i++)
+    {
+        std::string v = "v" + std::to_string(i), previous = "v" + std::to_string(i - 1);
+        if (i % 10 == 0) src += v + " = lambda (x: int) { return x * 2; }(" + previous + ");\n";
+        else if (i % 10 == 5) src += v + " = " + previous + "; s" + std::to_string(i) + " = \"line " + std::to_string(i) + "\";\n";
+        else src += v + " = " + previous + " + " + std::to_string(i % 10) + ";\n";
+    }
+
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / "module_cache_benchmark";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    std::filesystem::path path = dir / "module.txt";
+    std::ofstream(path, std::ios::binary) << src;
+
+    std::cout << "Module cache, " << lines << " lines:\n";
+    for (const char* run : { "first load", "second load" })
+    {
+        AstArena arena;
+        ModuleTiming timing;
+        std::unique_ptr<Module> m = LoadModule(path, {}, {}, dir / "cache", &timing);
+        std::cout << "  " << run << ": ";
+        WriteModuleTiming(std::cout, timing);
+    }
+    std::cout << "  cache size: " << std::filesystem::file_size(std::filesystem::directory_iterator(dir / "cache")->path()) << " bytes for "
+        << src.size() << " bytes of source\n";
+
+    std::filesystem::remove_all(dir);
+}
+
+// Programs that spend their time in loops and in calls, run on the bytecode interpreter.
+void BenchmarkBytecode()
+{
+    const std::vector<std::pair<std::string, std::string>> programs = {
+        { "integer loop", "{ s = 0; i = 0; while (i < 3000000) { s = s + i * i % 7; i = i + 1; } return s; }" },
+        { "double loop", "{ x = 0.; for (i = 0; i < 3000000; i = i + 1) { x = x * .5 + (i : double); if (x > 1000.) x = x - 1000.; } return x : int; }" },
+        { "nested loops", "{ n = 0; for (i = 0; i < 2000; i = i + 1) for (j = 0; j < 1500; j = j + 1) if (i % 3 == 0 || j % 5 == 0) n = n + 1; return n; }" },
+        { "calls", "{ sq = lambda (x: int) { return x * x; }; add = lambda (a: int, b: int) { return a + b; }; s = 0; for (i = 0; i < 1000000; i = i + 1) s = add(s, sq(i) % 1000); return s; }" },
+        { "nested calls", "{ inc = lambda (x: int) { return x + 1; }; twice = lambda (x: int) { return inc(inc(x)); }; four = lambda (x: int) { return twice(twice(x)); }; s = 0; for (i = 0; i < 300000; i = i + 1) s = four(s) % 1000000; return s; }" },
+    };
+
+    std::cout << "Bytecode interpreter:\n";
+    for (const std::pair<std::string, std::string>& p : programs)
+    {
+        SymbolTable symbols;
+        TokenStream tokens = Tokenize(p.second, symbols);
+        AstArena arena;
+        ParsingContext pc;
+        Statement s = SingleStatement{ { LiteralExpression{ AtomicType::Error, { tokens, 0 } } } }; int consumed = 0;
+        InstructionSet code;
+        if (!ParseStatement({ tokens, 0 }, pc, s, consumed) || !pc.errors.empty() || !GenerateBytecode(s, code))
+        {
+            std::cout << "  " << p.first << ": could not be compiled to bytecode\n";
+            continue;
+        }
+
+        BytecodeResult result = {};
+        double t = TimeBest([&]() { result = RunBytecode(code); }, 3);
+        std::cout << "  " << p.first << ": " << t * 1000 << " ms, " << result.instructions / t / 1e6 << " million instructions per second ("
+            << result.instructions << " instructions, returned " << result.value.i << ")\n";
+    }
+}
+
+#ifdef RUN_BENCHMARKS
+
+int main()
+{
+    BenchmarkLexer();
+    BenchmarkStreamingLexer();
+    BenchmarkParser();
+    BenchmarkTypeChecking();
+    BenchmarkAllocations();
+    BenchmarkIncremental();
+    BenchmarkModuleCache();
+    BenchmarkParallelParser();
+    BenchmarkBytecode();
+
+    return 0;
+}
+
+#endif
@@ -1,56 +1,620 @@
 #include "Bytecode.h"
+#include <algorithm>
+#include <cmath>
 
-void GenerateBytecode(const Expression& e, InstructionSet& out)
+namespace
 {
-    if (std::holds_alternative<LiteralExpression>(e))
+    bool IsAtomic(const Type& t, AtomicType a) { return std::holds_alternative<AtomicType>(t) && std::get<AtomicType>(t) == a; }
+
+    // Whether a value of type t is held in one register, which everything the bytecode can express is.
+    bool FitsRegister(const Type& t)
+    {
+        if (std::holds_alternative<LambdaType>(t)) return !std::get<LambdaType>(t).temp.has_value();
+        return IsAtomic(t, AtomicType::Integer) || IsAtomic(t, AtomicType::Double) || IsAtomic(t, AtomicType::Boolean);
+    }
+
+    // Whether evaluating e can change a variable, which it can only by assigning to it or calling a lambda that does.
+    bool MayWrite(const Expression& e)
     {
-        switch (std::get<AtomicType>(std::get<LiteralExpression>(e).type))
+        if (std::holds_alternative<MultiExpression>(e))
         {
-        case AtomicType::Integer:
-            out.body.push_back(PushLiteralInstruction{ AtomicType::Integer, AtomicInstance{ std::stoi(std::get<LiteralExpression>(e).vec[0].value) } });
-            break;
-        case AtomicType::Double:
-            out.body.push_back(PushLiteralInstruction{ AtomicType::Double, AtomicInstance{ std::stod(std::get<LiteralExpression>(e).vec[0].value) } });
-            break;
-        case AtomicType::String:
-            out.body.push_back(PushLiteralInstruction{ AtomicType::String, AtomicInstance{ std::get<LiteralExpression>(e).vec[0].value } });
-            break;
-        default: break;
+            for (const AstRef<Expression>& i : std::get<MultiExpression>(e).elements) if (MayWrite(i.Get())) return true;
+            return false;
         }
+        if (std::holds_alternative<BinaryExpression>(e))
+        {
+            const BinaryExpression& b = std::get<BinaryExpression>(e);
+            return b.exprType == BinaryExpressionType::Assignment || b.exprType == BinaryExpressionType::FunctionCall || MayWrite(b.a.Get()) || MayWrite(b.b.Get());
+        }
+        if (std::holds_alternative<UnaryExpression>(e)) return MayWrite(std::get<UnaryExpression>(e).a.Get());
+        return false;
     }
-    else if (std::holds_alternative<VariableExpression>(e))
+
+    // The highest stack index of the variables in the body of a function, not counting the lambdas defined in it, whose variables
+    // are in frames of their own.
+    void MaxVariable(const Expression& e, int& max)
     {
-        out.body.push_back(PushVariableInstruction{ std::get<VariableExpression>(e).stackIndex });
+        if (std::holds_alternative<VariableExpression>(e)) max = std::max(max, std::get<VariableExpression>(e).stackIndex);
+        else if (std::holds_alternative<MultiExpression>(e))
+        {
+            for (const AstRef<Expression>& i : std::get<MultiExpression>(e).elements) MaxVariable(i.Get(), max);
+        }
+        else if (std::holds_alternative<BinaryExpression>(e))
+        {
+            MaxVariable(std::get<BinaryExpression>(e).a.Get(), max);
+            MaxVariable(std::get<BinaryExpression>(e).b.Get(), max);
+        }
+        else if (std::holds_alternative<UnaryExpression>(e)) MaxVariable(std::get<UnaryExpression>(e).a.Get(), max);
     }
-    else if (std::holds_alternative<LambdaExpression>(e))
+
+    void MaxVariable(const Statement& s, int& max)
     {
-        
+        if (std::holds_alternative<SingleStatement>(s)) MaxVariable(std::get<SingleStatement>(s).expr.Get(), max);
+        else if (std::holds_alternative<ScopeStatement>(s))
+        {
+            max = std::max(max, std::get<ScopeStatement>(s).stackEnd - 1);
+            for (const AstRef<Statement>& i : std::get<ScopeStatement>(s).vec) MaxVariable(i.Get(), max);
+        }
+        else if (std::holds_alternative<ForStatement>(s))
+        {
+            const ForStatement& f = std::get<ForStatement>(s);
+            MaxVariable(f.cond1.Get(), max);
+            MaxVariable(f.cond2.Get(), max);
+            MaxVariable(f.cond3.Get(), max);
+            MaxVariable(f.contents.Get(), max);
+        }
+        else if (std::holds_alternative<WhileStatement>(s))
+        {
+            MaxVariable(std::get<WhileStatement>(s).condition.Get(), max);
+            MaxVariable(std::get<WhileStatement>(s).contents.Get(), max);
+        }
+        else if (std::holds_alternative<IfStatement>(s))
+        {
+            MaxVariable(std::get<IfStatement>(s).condition.Get(), max);
+            MaxVariable(std::get<IfStatement>(s).contents.Get(), max);
+        }
+        else MaxVariable(std::get<ReturnStatement>(s).expr.Get(), max);
     }
-    else if (std::holds_alternative<MultiExpression>(e))
+
+    // A function being generated. Its registers start at the variable with stack index base, and its temporaries come after its
+    // variables, handed out and given back in the order of a stack, as expressions are nested.
+    struct FunctionState
     {
-    }
-    else if (std::holds_alternative<BinaryExpression>(e))
+        int index;  // in InstructionSet::functions
+        int base;
+        int first;  // the stack index of its first variable, which is base except for the program, as the context held some before it
+        int variables;
+        int temps = 0;
+        int maxTemps = 0;
+        std::vector<Instruction> code;  // jumps in it are to indices in it until it is appended to the instruction set
+    };
+
+    class Generator
     {
-    }
-    else  // assumed std::holds_alternative<UnaryExpression>(e)
+        InstructionSet& out;
+        std::vector<FunctionState> functions;  // the program first, and the one being generated last
+
+        FunctionState& Current() { return functions.back(); }
+
+        int Emit(Opcode op, int a = 0, int b = 0, int c = 0)
+        {
+            Current().code.push_back({ op, a, b, c });
+            return (int)Current().code.size() - 1;
+        }
+        int Here() { return (int)Current().code.size(); }
+
+        int Temp()
+        {
+            FunctionState& f = Current();
+            f.maxTemps = std::max(f.maxTemps, ++f.temps);
+            return f.variables + f.temps - 1;
+        }
+        bool IsTemp(int reg) { return reg >= Current().variables; }
+
+        // The register of the variable with stackIndex in the current function, or -1 if it is not one of its variables.
+        int Local(int stackIndex) { return stackIndex >= Current().first ? stackIndex - Current().base : -1; }
+
+        // Whether a variable a lambda uses from outside is one of the program's, which are the only ones always still around.
+        bool IsGlobal(int stackIndex) { return functions.size() > 1 && stackIndex >= functions[0].first && stackIndex < functions[1].base; }
+
+        // The register holding the value of e: its own if it is a variable of this function, or otherwise a new temporary. Only
+        // pass the variable's own register if nothing evaluated after e but before the register is read can change it.
+        bool Operand(const Expression& e, int& reg, bool readNow = true)
+        {
+            if (readNow && std::holds_alternative<VariableExpression>(e) && FitsRegister(GetExpressionType(e)))
+            {
+                int index = std::get<VariableExpression>(e).stackIndex;
+                if (index >= 0 && Local(index) >= 0)
+                {
+                    reg = Local(index);
+                    return true;
+                }
+            }
+            reg = Temp();
+            return GenerateExpression(e, reg);
+        }
+
+        // Puts the value of e in register dst, with nothing written to dst before the value is complete, so that e can read what dst
+        // held. A dst of -1 drops the value, which only assignments and calls are worth evaluating for.
+        bool GenerateExpression(const Expression& e, int dst)
+        {
+            int mark = Current().temps;
+            bool ok = GenerateInto(e, dst);
+            Current().temps = mark;
+            return ok;
+        }
+
+        bool GenerateInto(const Expression& e, int dst)
+        {
+            const Type& type = GetExpressionType(e);
+            bool isAssignment = std::holds_alternative<BinaryExpression>(e) && std::get<BinaryExpression>(e).exprType == BinaryExpressionType::Assignment;
+            bool isCall = std::holds_alternative<BinaryExpression>(e) && std::get<BinaryExpression>(e).exprType == BinaryExpressionType::FunctionCall;
+            if (!(dst == -1 && isCall) && !FitsRegister(type)) return false;
+            if (dst == -1 && !isAssignment) dst = Temp();
+
+            if (std::holds_alternative<LiteralExpression>(e))
+            {
+                const LiteralExpression& l = std::get<LiteralExpression>(e);
+                if (IsAtomic(type, AtomicType::Integer)) Emit(Opcode::LoadInt, dst, l.vec.Integer(0));
+                else if (IsAtomic(type, AtomicType::Boolean)) Emit(Opcode::LoadInt, dst, l.vec[0].symbol == (SymbolId)Keyword::True);
+                else
+                {
+                    Value v;
+                    v.d = l.vec.Decimal(0);
+                    out.constants.push_back(v);
+                    Emit(Opcode::LoadConst, dst, (int)out.constants.size() - 1);
+                }
+                return true;
+            }
+            else if (std::holds_alternative<VariableExpression>(e))
+            {
+                int index = std::get<VariableExpression>(e).stackIndex;
+                if (index < 0) return false;
+                int reg = Local(index);
+                if (reg >= 0)
+                {
+                    if (reg != dst) Emit(Opcode::Move, dst, reg);
+                    return true;
+                }
+                if (!IsGlobal(index)) return false;
+                Emit(Opcode::LoadGlobal, dst, index);
+                return true;
+            }
+            else if (std::holds_alternative<LambdaExpression>(e))
+            {
+                int index = 0;
+                if (!GenerateLambda(std::get<LambdaExpression>(e), index)) return false;
+                Emit(Opcode::LoadInt, dst, index);
+                return true;
+            }
+            else if (std::holds_alternative<MultiExpression>(e))
+            {
+                return false;
+            }
+            else if (std::holds_alternative<BinaryExpression>(e))
+            {
+                return GenerateBinary(std::get<BinaryExpression>(e), dst);
+            }
+            else  // assumed std::holds_alternative<UnaryExpression>(e)
+            {
+                return GenerateUnary(std::get<UnaryExpression>(e), dst);
+            }
+        }
+
+        bool GenerateBinary(const BinaryExpression& b, int dst)
+        {
+            if (b.exprType == BinaryExpressionType::Assignment) return GenerateAssignment(b, dst);
+            if (b.exprType == BinaryExpressionType::FunctionCall) return GenerateCall(b, dst);
+            if (b.exprType == BinaryExpressionType::BooleanOr || b.exprType == BinaryExpressionType::BooleanAnd)
+            {
+                // The second operand is only evaluated if the first does not decide the result already.
+                int r = IsTemp(dst) ? dst : Temp();
+                if (!GenerateExpression(b.a.Get(), r)) return false;
+                int skip = Emit(b.exprType == BinaryExpressionType::BooleanOr ? Opcode::JumpIfTrue : Opcode::JumpIfFalse, r);
+                if (!GenerateExpression(b.b.Get(), r)) return false;
+                Current().code[skip].b = Here();
+                if (r != dst) Emit(Opcode::Move, dst, r);
+                return true;
+            }
+
+            const Type& operands = GetExpressionType(b.a.Get());
+            if (!std::holds_alternative<AtomicType>(operands)) return false;
+            bool d = IsAtomic(operands, AtomicType::Double);
+
+            Opcode op;
+            bool swap = false;  // Greater and GEq are Less and LEq the other way around
+            switch (b.exprType)
+            {
+            case BinaryExpressionType::NotEquals: op = d ? Opcode::NotEqualsDouble : Opcode::NotEqualsInt; break;
+            case BinaryExpressionType::Equals: op = d ? Opcode::EqualsDouble : Opcode::EqualsInt; break;
+            case BinaryExpressionType::Less: op = d ? Opcode::LessDouble : Opcode::LessInt; break;
+            case BinaryExpressionType::Greater: op = d ? Opcode::LessDouble : Opcode::LessInt; swap = true; break;
+            case BinaryExpressionType::LEq: op = d ? Opcode::LEqDouble : Opcode::LEqInt; break;
+            case BinaryExpressionType::GEq: op = d ? Opcode::LEqDouble : Opcode::LEqInt; swap = true; break;
+            case BinaryExpressionType::Add: op = d ? Opcode::AddDouble : Opcode::AddInt; break;
+            case BinaryExpressionType::Subtract: op = d ? Opcode::SubtractDouble : Opcode::SubtractInt; break;
+            case BinaryExpressionType::Multiply: op = d ? Opcode::MultiplyDouble : Opcode::MultiplyInt; break;
+            case BinaryExpressionType::Divide: op = d ? Opcode::DivideDouble : Opcode::DivideInt; break;
+            case BinaryExpressionType::Modulus: op = d ? Opcode::ModulusDouble : Opcode::ModulusInt; break;
+            case BinaryExpressionType::Exponentiate: op = d ? Opcode::ExponentiateDouble : Opcode::ExponentiateInt; break;
+            default: return false;
+            }
+
+            int l = 0, r = 0;
+            if (!Operand(b.a.Get(), l, !MayWrite(b.b.Get())) || !Operand(b.b.Get(), r)) return false;
+            Emit(op, dst, swap ? r : l, swap ? l : r);
+            return true;
+        }
+
+        bool GenerateAssignment(const BinaryExpression& b, int dst)
+        {
+            if (!std::holds_alternative<VariableExpression>(b.a.Get())) return false;
+            const VariableExpression& v = std::get<VariableExpression>(b.a.Get());
+            if (v.stackIndex < 0 || !FitsRegister(v.type)) return false;
+
+            int reg = Local(v.stackIndex);
+            if (reg >= 0)
+            {
+                if (!GenerateExpression(b.b.Get(), reg)) return false;
+                if (dst != -1 && dst != reg) Emit(Opcode::Move, dst, reg);
+                return true;
+            }
+            if (!IsGlobal(v.stackIndex)) return false;
+            int r = dst != -1 ? dst : Temp();
+            if (!GenerateExpression(b.b.Get(), r)) return false;
+            Emit(Opcode::StoreGlobal, v.stackIndex, r);
+            return true;
+        }
+
+        bool GenerateCall(const BinaryExpression& b, int dst)
+        {
+            const Type& lambda = GetExpressionType(b.a.Get());
+            if (!FitsRegister(lambda) || !std::holds_alternative<LambdaType>(lambda)) return false;
+
+            // Several arguments are passed as a record, which is written out in the call.
+            std::vector<const Expression*> args;
+            if (std::holds_alternative<RecordType>(std::get<LambdaType>(lambda).arg.Get()))
+            {
+                const Expression& record = b.b.Get();
+                if (!std::holds_alternative<MultiExpression>(record) || std::get<MultiExpression>(record).exprType != MultiExpressionType::Record) return false;
+                for (const AstRef<Expression>& i : std::get<MultiExpression>(record).elements) args.push_back(&i.Get());
+            }
+            else args.push_back(&b.b.Get());
+
+            int callee = 0;
+            if (!Operand(b.a.Get(), callee, std::none_of(args.begin(), args.end(), [](const Expression* a) { return MayWrite(*a); }))) return false;
+
+            int first = Current().variables + Current().temps;  // the arguments go in consecutive temporaries, to be copied into the new frame
+            for (size_t i = 0; i < args.size(); i++) Temp();
+            for (size_t i = 0; i < args.size(); i++)
+            {
+                if (!GenerateExpression(*args[i], first + (int)i)) return false;
+            }
+            Emit(Opcode::Call, dst, callee, first);
+            return true;
+        }
+
+        bool GenerateUnary(const UnaryExpression& u, int dst)
+        {
+            const Type& from = GetExpressionType(u.a.Get());
+            const Type& to = u.type;
+            int x = 0;
+            if (!Operand(u.a.Get(), x)) return false;
+
+            switch (u.exprType)
+            {
+            case UnaryExpressionType::Not: Emit(Opcode::Not, dst, x); return true;
+            case UnaryExpressionType::Minus: Emit(IsAtomic(to, AtomicType::Double) ? Opcode::NegateDouble : Opcode::NegateInt, dst, x); return true;
+            case UnaryExpressionType::Plus: if (x != dst) Emit(Opcode::Move, dst, x); return true;
+            default: break;  // Cast
+            }
+
+            // Booleans are already the integers 0 and 1, so casting one to an integer changes nothing.
+            if (from == to || (IsAtomic(from, AtomicType::Boolean) && IsAtomic(to, AtomicType::Integer)))
+            {
+                if (x != dst) Emit(Opcode::Move, dst, x);
+            }
+            else if (IsAtomic(to, AtomicType::Double) && !IsAtomic(from, AtomicType::Double)) Emit(Opcode::IntToDouble, dst, x);
+            else if (IsAtomic(to, AtomicType::Integer) && IsAtomic(from, AtomicType::Double)) Emit(Opcode::DoubleToInt, dst, x);
+            else if (IsAtomic(to, AtomicType::Boolean) && IsAtomic(from, AtomicType::Integer)) Emit(Opcode::IntToBool, dst, x);
+            else if (IsAtomic(to, AtomicType::Boolean) && IsAtomic(from, AtomicType::Double)) Emit(Opcode::DoubleToBool, dst, x);
+            else return false;
+            return true;
+        }
+
+        // Jumps past whatever comes next if e is false. The jump's target is set by the caller once it is known.
+        bool GenerateCondition(const Expression& e, int& jump)
+        {
+            if (!IsAtomic(GetExpressionType(e), AtomicType::Boolean)) return false;
+            int mark = Current().temps;
+            int r = 0;
+            bool ok = Operand(e, r);
+            Current().temps = mark;
+            if (ok) jump = Emit(Opcode::JumpIfFalse, r);
+            return ok;
+        }
+
+        bool GenerateStatement(const Statement& s)
+        {
+            if (std::holds_alternative<SingleStatement>(s))
+            {
+                return GenerateExpression(std::get<SingleStatement>(s).expr.Get(), -1);
+            }
+            else if (std::holds_alternative<ScopeStatement>(s))
+            {
+                for (const AstRef<Statement>& i : std::get<ScopeStatement>(s).vec)
+                {
+                    if (!GenerateStatement(i.Get())) return false;
+                }
+                return true;
+            }
+            else if (std::holds_alternative<ForStatement>(s))
+            {
+                const ForStatement& f = std::get<ForStatement>(s);
+                if (!GenerateExpression(f.cond1.Get(), -1)) return false;
+                int top = Here(), exit = 0;
+                if (!GenerateCondition(f.cond2.Get(), exit) || !GenerateStatement(f.contents.Get()) || !GenerateExpression(f.cond3.Get(), -1)) return false;
+                Emit(Opcode::Jump, top);
+                Current().code[exit].b = Here();
+                return true;
+            }
+            else if (std::holds_alternative<WhileStatement>(s))
+            {
+                const WhileStatement& w = std::get<WhileStatement>(s);
+                int top = Here(), exit = 0;
+                if (!GenerateCondition(w.condition.Get(), exit) || !GenerateStatement(w.contents.Get())) return false;
+                Emit(Opcode::Jump, top);
+                Current().code[exit].b = Here();
+                return true;
+            }
+            else if (std::holds_alternative<IfStatement>(s))
+            {
+                const IfStatement& i = std::get<IfStatement>(s);
+                int exit = 0;
+                if (!GenerateCondition(i.condition.Get(), exit) || !GenerateStatement(i.contents.Get())) return false;
+                Current().code[exit].b = Here();
+                return true;
+            }
+            else  // assumed std::holds_alternative<ReturnStatement>(s)
+            {
+                int mark = Current().temps;
+                int r = 0;
+                bool ok = Operand(std::get<ReturnStatement>(s).expr.Get(), r);
+                Current().temps = mark;
+                if (ok) Emit(Opcode::Return, r);
+                return ok;
+            }
+        }
+
+        bool GenerateLambda(const LambdaExpression& l, int& index)
+        {
+            if (!std::holds_alternative<LambdaType>(l.type) || std::get<LambdaType>(l.type).temp.has_value()) return false;
+            const LambdaType& type = std::get<LambdaType>(l.type);
+
+            std::vector<const Expression*> args;
+            if (std::holds_alternative<MultiExpression>(l.args.Get()))
+            {
+                for (const AstRef<Expression>& i : std::get<MultiExpression>(l.args.Get()).elements) args.push_back(&i.Get());
+            }
+            else args.push_back(&l.args.Get());
+            if (args.empty() || !std::holds_alternative<VariableExpression>(*args[0])) return false;
+            int base = std::get<VariableExpression>(*args[0]).stackIndex;
+            for (size_t i = 0; i < args.size(); i++)
+            {
+                if (!std::holds_alternative<VariableExpression>(*args[i]) || std::get<VariableExpression>(*args[i]).stackIndex != base + (int)i) return false;
+                if (!FitsRegister(GetExpressionType(*args[i]))) return false;
+            }
+
+            // The body of a lazy lambda is parsed with the same stack indices it would have had.
+            const Statement* body = &l.body.Get();
+            if (type.lazy)
+            {
+                type.lazy->Parse();
+                if (!type.lazy->body.has_value()) return false;
+                body = &type.lazy->body.value().Get();
+            }
+            return GenerateFunction(*body, base, base, (int)args.size(), index);
+        }
+
+    public:
+        explicit Generator(InstructionSet& o) : out(o) {}
+
+        bool GenerateFunction(const Statement& body, int base, int first, int argCount, int& index)
+        {
+            int max = base + argCount - 1;
+            MaxVariable(body, max);
+            index = (int)out.functions.size();
+            out.functions.push_back({ 0, argCount, 0 });
+            functions.push_back({ index, base, first, std::max(0, max + 1 - base), 0, 0, {} });
+
+            bool ok = GenerateStatement(body);
+            if (ok)
+            {
+                int zero = Temp();  // for ending without returning
+                Emit(Opcode::LoadInt, zero, 0);
+                Emit(Opcode::Return, zero);
+
+                FunctionState& f = Current();
+                int entry = (int)out.code.size();
+                for (Instruction i : f.code)
+                {
+                    if (i.op == Opcode::Jump) i.a += entry;
+                    else if (i.op == Opcode::JumpIfFalse || i.op == Opcode::JumpIfTrue) i.b += entry;
+                    out.code.push_back(i);
+                }
+                out.functions[index] = { entry, argCount, f.variables + f.maxTemps };
+            }
+            functions.pop_back();
+            return ok;
+        }
+    };
+
+    inline int64_t Wrap(uint64_t v) { return (int64_t)v; }  // integers wrap around on overflow rather than being undefined
+
+    int64_t PowInt(int64_t base, int64_t exp)
     {
+        if (exp < 0) return base == 1 ? 1 : base == -1 ? (exp % 2 ? -1 : 1) : 0;  // 1 / base ^ -exp, rounded toward 0 like division
+        uint64_t result = 1, b = (uint64_t)base;
+        for (; exp > 0; exp >>= 1)
+        {
+            if (exp & 1) result *= b;
+            b *= b;
+        }
+        return Wrap(result);
     }
 }
 
-void GenerateBytecode(const Statement& s, InstructionSet& out)
+bool GenerateBytecode(const Statement& s, InstructionSet& out)
 {
-
+    out = InstructionSet();
+    int first = std::holds_alternative<ScopeStatement>(s) ? std::get<ScopeStatement>(s).stackBegin : 0;
+    int index = 0;
+    return Generator(out).GenerateFunction(s, 0, first, 0, index);
 }
 
-std::vector<Instruction> FuseInstructionSet(const InstructionSet& out)
-{
-    std::vector<Instruction> ret = { GotoIfInstruction{ out.header.size() + 1, GotoIfType::Static } };
-    ret.insert(ret.end(), out.header.begin(), out.header.end());
-    ret.insert(ret.end(), out.body.begin(), out.body.end());
-    return ret;
-}
+// Jumping straight from each instruction to the code of the next through a table of label addresses, which is a GNU extension, gives
+// every opcode an indirect jump of its own for the branch predictor to learn. Other compilers, or defining BYTECODE_SWITCH_DISPATCH,
+// use a switch instead.
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(BYTECODE_SWITCH_DISPATCH)
+#define BYTECODE_COMPUTED_GOTO 1
+#else
+#define BYTECODE_COMPUTED_GOTO 0
+#endif
 
-void RunBytecode(const std::vector<Instruction>& code)
+BytecodeResult RunBytecode(const InstructionSet& set)
 {
+    struct CallFrame
+    {
+        const Instruction* ret;
+        size_t fp;
+        int frameSize;
+        int dst;
+    };
+
+    const Instruction* code = set.code.data();
+    const Value* constants = set.constants.data();
+    const BytecodeFunction* functions = set.functions.data();
+
+    // Frames are laid out one after the other, the program's first, so its variables are always at the start.
+    std::vector<Value> registers(std::max(set.functions[0].frameSize, 1024));
+    std::vector<CallFrame> calls;
+    size_t fp = 0;
+    int frameSize = set.functions[0].frameSize;
+    Value* r = registers.data();
+    const Instruction* ip = code + set.functions[0].entry;
+    const Instruction* in = ip;
+    uint64_t count = 0;
+    const char* error = nullptr;
+
+#if BYTECODE_COMPUTED_GOTO
+#define BYTECODE_LABEL(name) &&op_##name,
+    static const void* const labels[] = { BYTECODE_OPCODES(BYTECODE_LABEL) };
+#undef BYTECODE_LABEL
+#define OP(name) op_##name
+#define NEXT() do { in = ip++; count++; goto *labels[(size_t)in->op]; } while (false)
+    NEXT();
+#else
+#define OP(name) case Opcode::name
+#define NEXT() continue
+    for (;;)
+    {
+    in = ip++;
+    count++;
+    switch (in->op)
+    {
+#endif
+
+    OP(LoadInt): r[in->a].i = in->b; NEXT();
+    OP(LoadConst): r[in->a] = constants[in->b]; NEXT();
+    OP(Move): r[in->a] = r[in->b]; NEXT();
+    OP(LoadGlobal): r[in->a] = registers[in->b]; NEXT();
+    OP(StoreGlobal): registers[in->a] = r[in->b]; NEXT();
+
+    OP(AddInt): r[in->a].i = Wrap((uint64_t)r[in->b].i + (uint64_t)r[in->c].i); NEXT();
+    OP(SubtractInt): r[in->a].i = Wrap((uint64_t)r[in->b].i - (uint64_t)r[in->c].i); NEXT();
+    OP(MultiplyInt): r[in->a].i = Wrap((uint64_t)r[in->b].i * (uint64_t)r[in->c].i); NEXT();
+    OP(DivideInt):
+        if (r[in->c].i == 0) { error = "division by zero"; goto failed; }
+        r[in->a].i = r[in->c].i == -1 ? Wrap(0 - (uint64_t)r[in->b].i) : r[in->b].i / r[in->c].i;
+        NEXT();
+    OP(ModulusInt):
+        if (r[in->c].i == 0) { error = "division by zero"; goto failed; }
+        r[in->a].i = r[in->c].i == -1 ? 0 : r[in->b].i % r[in->c].i;
+        NEXT();
+    OP(ExponentiateInt): r[in->a].i = PowInt(r[in->b].i, r[in->c].i); NEXT();
+
+    OP(AddDouble): r[in->a].d = r[in->b].d + r[in->c].d; NEXT();
+    OP(SubtractDouble): r[in->a].d = r[in->b].d - r[in->c].d; NEXT();
+    OP(MultiplyDouble): r[in->a].d = r[in->b].d * r[in->c].d; NEXT();
+    OP(DivideDouble): r[in->a].d = r[in->b].d / r[in->c].d; NEXT();
+    OP(ModulusDouble): r[in->a].d = std::fmod(r[in->b].d, r[in->c].d); NEXT();
+    OP(ExponentiateDouble): r[in->a].d = std::pow(r[in->b].d, r[in->c].d); NEXT();
+
+    OP(EqualsInt): r[in->a].i = r[in->b].i == r[in->c].i; NEXT();
+    OP(NotEqualsInt): r[in->a].i = r[in->b].i != r[in->c].i; NEXT();
+    OP(LessInt): r[in->a].i = r[in->b].i < r[in->c].i; NEXT();
+    OP(LEqInt): r[in->a].i = r[in->b].i <= r[in->c].i; NEXT();
+    OP(EqualsDouble): r[in->a].i = r[in->b].d == r[in->c].d; NEXT();
+    OP(NotEqualsDouble): r[in->a].i = r[in->b].d != r[in->c].d; NEXT();
+    OP(LessDouble): r[in->a].i = r[in->b].d < r[in->c].d; NEXT();
+    OP(LEqDouble): r[in->a].i = r[in->b].d <= r[in->c].d; NEXT();
+
+    OP(Not): r[in->a].i = !r[in->b].i; NEXT();
+    OP(NegateInt): r[in->a].i = Wrap(0 - (uint64_t)r[in->b].i); NEXT();
+    OP(NegateDouble): r[in->a].d = -r[in->b].d; NEXT();
+    OP(IntToDouble): r[in->a].d = (double)r[in->b].i; NEXT();
+    OP(DoubleToInt):
+        // Converting a double that is not a number or is out of range is undefined, so it is an error rather than a guess.
+        if (!(r[in->b].d >= -9223372036854775808.0 && r[in->b].d < 9223372036854775808.0)) { error = "double out of the range of integers"; goto failed; }
+        r[in->a].i = (int64_t)r[in->b].d;
+        NEXT();
+    OP(IntToBool): r[in->a].i = r[in->b].i != 0; NEXT();
+    OP(DoubleToBool): r[in->a].i = r[in->b].d != 0; NEXT();
+
+    OP(Jump): ip = code + in->a; NEXT();
+    OP(JumpIfFalse): if (!r[in->a].i) ip = code + in->b; NEXT();
+    OP(JumpIfTrue): if (r[in->a].i) ip = code + in->b; NEXT();
+
+    OP(Call):
+    {
+        const BytecodeFunction& f = functions[r[in->b].i];
+        size_t callee = fp + frameSize;
+        if (calls.size() >= MAX_CALL_DEPTH || callee + f.frameSize > MAX_REGISTERS) { error = "stack overflow"; goto failed; }
+        if (callee + f.frameSize > registers.size())
+        {
+            registers.resize(std::min(std::max(registers.size() * 2, callee + f.frameSize), MAX_REGISTERS));
+            r = registers.data() + fp;
+        }
+        Value* args = registers.data() + callee;
+        for (int i = 0; i < f.argCount; i++) args[i] = r[in->c + i];
+        calls.push_back({ ip, fp, frameSize, in->a });
+        fp = callee;
+        frameSize = f.frameSize;
+        r = args;
+        ip = code + f.entry;
+        NEXT();
+    }
+    OP(Return):
+    {
+        Value v = r[in->a];
+        if (calls.empty()) return { v, count };
+        const CallFrame& c = calls.back();
+        ip = c.ret;
+        fp = c.fp;
+        frameSize = c.frameSize;
+        r = registers.data() + fp;
+        r[c.dst] = v;
+        calls.pop_back();
+        NEXT();
+    }
+
+#if !BYTECODE_COMPUTED_GOTO
+    }
+    }
+#endif
+#undef OP
+#undef NEXT
 
+failed:
+    return { Value{}, count, true, error };
 }
@@ -1,98 +1,80 @@
 #pragma once
 #include "Type.h"
 #include "Parser.h"
+#include <cstdint>
+#include <string>
+#include <vector>
 
-struct TypeInstance;
+// The bytecode runs on registers rather than a stack: every instruction names the registers it reads and the one it writes, which
+// are slots of the frame of the function it is in. A function's variables are its first registers, in the order of their stack
+// indices, and the temporaries its expressions need come after them, so the size of each frame is known before it runs.
 
-struct AtomicInstance
+// One register. Integers are 64 bits wide at run time, booleans are integers that are 0 or 1, and lambdas are the index of their
+// function.
+union Value
 {
-    std::variant<int, double, std::string> val;
+    int64_t i;
+    double d;
 };
 
-struct RecordInstance
-{
-    std::vector<HeapAlloc<TypeInstance>> vals;
-};
+// Every opcode, in the order of the Opcode enum, so that the table of labels the interpreter jumps through can be made from it.
+#define BYTECODE_OPCODES(X) \
+    X(LoadInt) X(LoadConst) X(Move) X(LoadGlobal) X(StoreGlobal) \
+    X(AddInt) X(SubtractInt) X(MultiplyInt) X(DivideInt) X(ModulusInt) X(ExponentiateInt) \
+    X(AddDouble) X(SubtractDouble) X(MultiplyDouble) X(DivideDouble) X(ModulusDouble) X(ExponentiateDouble) \
+    X(EqualsInt) X(NotEqualsInt) X(LessInt) X(LEqInt) \
+    X(EqualsDouble) X(NotEqualsDouble) X(LessDouble) X(LEqDouble) \
+    X(Not) X(NegateInt) X(NegateDouble) X(IntToDouble) X(DoubleToInt) X(IntToBool) X(DoubleToBool) \
+    X(Jump) X(JumpIfFalse) X(JumpIfTrue) X(Call) X(Return)
 
-struct OverloadInstance
+#define BYTECODE_OPCODE_ENUM(name) name,
+enum class Opcode : uint8_t
 {
-    std::vector<HeapAlloc<TypeInstance>> vals;
+    BYTECODE_OPCODES(BYTECODE_OPCODE_ENUM)
 };
-
-struct LambdaInstance
-{
-    VectorView loc;
+#undef BYTECODE_OPCODE_ENUM
+
+// What a, b and c mean depends on the opcode. Most write register a from registers b and c; LoadInt writes the number b, LoadConst
+// constant b, and LoadGlobal register b of the program's frame, which StoreGlobal writes from register b instead. Jumps go to
+// instruction a, or b when they test register a. Call writes the result of calling the lambda in register b on the arguments from
+// register c on into register a, and Return returns register a.
+struct Instruction
+{
+    Opcode op;
+    int32_t a;
+    int32_t b;
+    int32_t c;
 };
 
-struct UnionInstance
+struct BytecodeFunction
 {
-    int ty;
-    HeapAlloc<TypeInstance> val;
+    int entry;  // the index of its first instruction
+    int argCount;  // passed in its first registers
+    int frameSize;  // registers for its arguments, variables and temporaries
 };
 
-struct TypeInstance
-{
-    Type type;
-    std::variant<AtomicInstance, RecordInstance, OverloadInstance, LambdaInstance, UnionInstance> val;
-};
-
-
-
-struct PushLiteralInstruction
-{
-    TypeInstance val;  // TODO: extract this to an index in an array
-};
-
-struct PushVariableInstruction
-{
-    int vStackIndex;
-};
-
-struct RunBuiltinInstruction
-{
-    int id;
-};
-
-struct WriteStackInstruction
-{
-    int index;
-};
-
-enum class GotoIfType
-{
-    Static, LocationStatic, Dynamic, RelativeStatic, Relative,
-};
-
-struct GotoIfInstruction
-{
-    int pos;
-    GotoIfType ty;
-};
-
-struct CastInstruction
-{
-    Type from;
-    Type to;
-};
-
-enum class CombineType
-{
-    Union, Record, Overload
-}
-struct CombineInstruction
+struct InstructionSet
 {
-    int count;
+    std::vector<Instruction> code;
+    std::vector<Value> constants;
+    std::vector<BytecodeFunction> functions;  // the program itself first, then every lambda in it
 };
 
-typedef std::variant<PushLiteralInstruction, PushVariableInstruction, RunBuiltinInstruction, WriteStackInstruction, GotoIfInstruction, CastInstruction, CombineInstruction> Instruction;
+// Returns false if s uses something the bytecode cannot express yet: strings, records, unions, overloads, template lambdas, and
+// variables of another lambda than the one using them or the program.
+bool GenerateBytecode(const Statement& s, InstructionSet& out);
 
-struct InstructionSet
+struct BytecodeResult
 {
-    std::vector<Instruction> body;
-    std::vector<Instruction> header;  // contains lambda code
+    Value value;  // that the program returned, or 0 if it ended without returning or failed
+    uint64_t instructions;  // run to get it
+    bool failed = false;  // if an instruction could not be carried out, such as dividing by zero, which stops the program
+    std::string error;  // why, if it failed
 };
 
-void GenerateBytecode(const Statement& s, InstructionSet& out);
-std::vector<Instruction> FuseInstructionSet(const InstructionSet& out);
+// Lambdas can call themselves through variables, so the calls a program makes are bounded by these rather than by memory. Going
+// past either fails with a stack overflow.
+constexpr size_t MAX_CALL_DEPTH = 1 << 16;
+constexpr size_t MAX_REGISTERS = 1 << 22;  // over every frame, so 32 MB
 
-void RunBytecode(const std::vector<Instruction>& code);
+BytecodeResult RunBytecode(const InstructionSet& code);
@@ -0,0 +1,346 @@
+#include "Incremental.h"
+#include <algorithm>
+
+struct Document::Segment
+{
+    std::string text;  // starts at the start of a line, and so ends with a newline unless it is the last one
+    TokenStream tokens;
+    int firstLine = 1;
+
+    std::vector<AstRef<Statement>> statements;
+    bool failed = false;  // the statement after the last one did not parse, or the text did not lex
+    std::string lexError;
+    TextPosition lexErrorPos = { -1, -1 };
+
+    // The context before the segment, and what parsing it did to that, so that it can be done again without parsing.
+    ParsingCheckpoint before;
+    std::vector<std::pair<SymbolId, Type>> added;
+    std::vector<std::pair<int, Type>> retyped;  // older variables the segment gave a type to, and the type
+    std::vector<ErrorOutput> errors;
+    std::vector<std::shared_ptr<LazyLambda>> reported;  // whose errors are among those
+    int definiteReturns = 0;  // statements up to the end of the segment that always return, up to 2
+
+    int Lines() const { return (int)tokens.lineStarts.size(); }
+};
+
+namespace
+{
+    // Whether the statements after a variable could tell these types apart. Template and lazy lambdas also have to come from the
+    // same tokens, as their bodies are parsed from them later, and the tokens of a segment go away when it is replaced.
+    bool SameType(const Type& a, const Type& b)
+    {
+        if (a != b) return false;
+
+        const TypeList* av = nullptr, * bv = nullptr;
+        if (std::holds_alternative<UnionType>(a)) { av = &std::get<UnionType>(a).values; bv = &std::get<UnionType>(b).values; }
+        else if (std::holds_alternative<OverloadType>(a)) { av = &std::get<OverloadType>(a).values; bv = &std::get<OverloadType>(b).values; }
+        else if (std::holds_alternative<RecordType>(a)) { av = &std::get<RecordType>(a).values; bv = &std::get<RecordType>(b).values; }
+        else if (std::holds_alternative<LambdaType>(a))
+        {
+            const LambdaType& al = std::get<LambdaType>(a);
+            const LambdaType& bl = std::get<LambdaType>(b);
+            if (al.temp.has_value() != bl.temp.has_value() || al.lazy != bl.lazy) return false;
+            if (al.temp.has_value())
+            {
+                const auto& ad = al.temp.value().definitions;
+                const auto& bd = bl.temp.value().definitions;
+                if (ad.size() != bd.size()) return false;
+                for (int i = 0; i < ad.size(); i++) if (!(ad[i].first == bd[i].first)) return false;
+            }
+            return SameType(al.arg.Get(), bl.arg.Get()) && SameType(al.Ret(), bl.Ret());
+        }
+
+        if (av) for (int i = 0; i < av->size(); i++) if (!SameType((*av)[i].Get(), (*bv)[i].Get())) return false;
+        return true;
+    }
+}
+
+// What a run of segments did to the variables that were there before it, and the ones it left behind.
+struct Document::Effects
+{
+    size_t stackSize;
+    std::vector<std::pair<SymbolId, Type>> added;
+    std::vector<std::pair<int, Type>> retyped;
+
+    Effects(size_t stackSize) : stackSize(stackSize) {}
+
+    void Add(const Segment& seg)
+    {
+        added.insert(added.end(), seg.added.begin(), seg.added.end());
+        for (const std::pair<int, Type>& r : seg.retyped)
+        {
+            if (r.first >= stackSize)
+            {
+                added[r.first - stackSize].second = r.second;
+                continue;
+            }
+            auto found = std::find_if(retyped.begin(), retyped.end(), [&](const std::pair<int, Type>& o) { return o.first == r.first; });
+            if (found != retyped.end()) found->second = r.second;
+            else retyped.push_back(r);
+        }
+    }
+
+    bool Same(const Effects& other) const
+    {
+        if (added.size() != other.added.size() || retyped.size() != other.retyped.size()) return false;
+        for (int i = 0; i < added.size(); i++)
+        {
+            if (added[i].first != other.added[i].first || !SameType(added[i].second, other.added[i].second)) return false;
+        }
+        for (const std::pair<int, Type>& r : retyped)
+        {
+            auto found = std::find_if(other.retyped.begin(), other.retyped.end(), [&](const std::pair<int, Type>& o) { return o.first == r.first; });
+            if (found == other.retyped.end() || !SameType(found->second, r.second)) return false;
+        }
+        return true;
+    }
+};
+
+
+Document::Document(std::string_view text, SymbolTable& symbols, const ParsingContext& ctx, size_t segmentSize)
+    : symbols(symbols), arena(&AstArena::Current()), ctx(ctx), base(this->ctx.Checkpoint()), segmentSize(segmentSize)
+{
+    segments.push_back(std::make_unique<Segment>());
+    segments[0]->before = Mark();
+    Reparse(0, 1, std::string(text));
+}
+
+Document::~Document() = default;
+
+void Document::Edit(size_t offset, size_t removed, std::string_view inserted)
+{
+    Assert(&AstArena::Current() == arena, "Documents can only be edited with the AstArena they were made in active.");
+    stats = {};
+
+    // The segments holding the first and last edited bytes, where an edit at the very start of a segment counts as part of it.
+    size_t first = 0, firstStart = 0;
+    while (first + 1 < segments.size() && firstStart + segments[first]->text.size() <= offset) firstStart += segments[first++]->text.size();
+    size_t last = first, lastStart = firstStart;
+    while (last + 1 < segments.size() && lastStart + segments[last]->text.size() <= offset + removed) lastStart += segments[last++]->text.size();
+    Assert(offset + removed <= lastStart + segments[last]->text.size(), "Edited past the end of the document.");
+
+    std::string text;
+    for (size_t i = first; i <= last; i++) text += segments[i]->text;
+    text.replace(offset - firstStart, removed, inserted);
+    Reparse(first, last + 1, std::move(text));
+}
+
+std::string Document::Text() const
+{
+    std::string ret;
+    for (const std::unique_ptr<Segment>& seg : segments) ret += seg->text;
+    return ret;
+}
+
+std::vector<AstRef<Statement>> Document::Statements() const
+{
+    std::vector<AstRef<Statement>> ret;
+    for (const std::unique_ptr<Segment>& seg : segments) ret.insert(ret.end(), seg->statements.begin(), seg->statements.end());
+    return ret;
+}
+
+bool Document::Parsed() const
+{
+    return !segments.back()->failed;  // only the last segment can fail, as a failure takes in every segment after it
+}
+
+// A checkpoint to restore to later. It is closed straight away, which is fine as base stays open.
+ParsingCheckpoint Document::Mark()
+{
+    ParsingCheckpoint cp = ctx.Checkpoint();
+    ctx.Commit(cp);
+    return cp;
+}
+
+// Cuts text at the start of a line where a statement starts, whenever the segment so far has reached segmentSize. A statement is
+// taken to start after a ; or } outside of any brackets. Where that is wrong, the statement before the cut fails to parse, and
+// Reparse joins the segments again.
+std::vector<std::unique_ptr<Document::Segment>> Document::Split(const std::string& text, int firstLine)
+{
+    std::vector<size_t> cuts = { 0 };
+    TokenStream tokens;
+    std::string error; TextPosition errorPos;
+    if (text.size() > segmentSize && TryTokenize(text, symbols, tokens, error, errorPos))
+    {
+        stats.bytesLexed += text.size();
+        int depth = 0;
+        for (int i = 0; i + 2 < tokens.Size(); i++)  // not before the end of file token
+        {
+            Token t = tokens[i];
+            if (t.type != TokenType::Symbol || t.value.size() != 1) continue;
+            switch (t.value[0])
+            {
+            case '(': case '[': case '{': depth++; break;
+            case ')': case ']': case '}': depth--; break;
+            }
+            if (depth != 0 || (t.value[0] != ';' && t.value[0] != '}')) continue;
+
+            // the newline before the next token, if there is one after this token
+            auto newline = std::lower_bound(tokens.lineStarts.begin(), tokens.lineStarts.end(), tokens.offsets[i + 1]);
+            if (newline == tokens.lineStarts.begin() || *(newline - 1) < t.offset) continue;
+            size_t cut = *(newline - 1) + 1;
+            if (cut - cuts.back() >= segmentSize) cuts.push_back(cut);
+        }
+    }
+    cuts.push_back(text.size());
+
+    std::vector<std::unique_ptr<Segment>> ret;
+    for (int i = 0; i + 1 < cuts.size(); i++)
+    {
+        ret.push_back(std::make_unique<Segment>());
+        ret.back()->text = text.substr(cuts[i], cuts[i + 1] - cuts[i]);
+        ret.back()->firstLine = firstLine + (int)(std::lower_bound(tokens.lineStarts.begin(), tokens.lineStarts.end(), cuts[i]) - tokens.lineStarts.begin());
+    }
+    return ret;
+}
+
+// Lexes and parses the segment from the current context, recording what it did to the context.
+bool Document::Parse(Segment& seg, int& definiteReturns)
+{
+    seg.before = Mark();
+    seg.statements.clear();
+    seg.failed = false;
+    seg.lexError.clear();
+
+    stats.bytesLexed += seg.text.size();
+    if (!TryTokenize(seg.text, symbols, seg.tokens, seg.lexError, seg.lexErrorPos))
+    {
+        seg.lexErrorPos.line += seg.firstLine - 1;
+        seg.failed = true;
+        return false;
+    }
+    seg.tokens.firstLine = seg.firstLine;
+
+    int i = 0;
+    while (seg.tokens[i].type != TokenType::EndOfFile)
+    {
+        if (definiteReturns == 1)
+        {
+            ctx.errors.push_back({ "Unreachable code (already returned).", seg.tokens.GetPosition(i) });
+        }
+
+        Statement s = SingleStatement{ { LiteralExpression{ AtomicType::Error, { seg.tokens, i } } } };
+        int consumed = 0;
+        if (!ParseStatement({ seg.tokens, i }, ctx, s, consumed))
+        {
+            seg.failed = true;
+            break;
+        }
+        stats.statementsParsed++;
+        if (!GetStatementType(s).isOptional && definiteReturns < 2) definiteReturns++;  // only whether it is 1 matters
+        seg.statements.push_back(std::move(s));
+        i += consumed;
+    }
+
+    seg.added.clear();
+    for (size_t v = seg.before.varStackSize; v < ctx.varStack.size(); v++) seg.added.push_back(ctx.varStack[v]);
+    seg.retyped.clear();
+    for (size_t u = seg.before.undoSize; u < ctx.varStackUndo.size(); u++)
+    {
+        int index = ctx.varStackUndo[u].first;
+        if (index >= seg.before.varStackSize) continue;
+        if (std::none_of(seg.retyped.begin(), seg.retyped.end(), [&](const std::pair<int, Type>& r) { return r.first == index; }))
+        {
+            seg.retyped.push_back({ index, ctx.varStack[index].second });
+        }
+    }
+    seg.errors.assign(ctx.errors.begin() + seg.before.errorCount, ctx.errors.end());
+    seg.reported.assign(ctx.reportedUndo.begin() + seg.before.reportedCount, ctx.reportedUndo.end());
+    seg.definiteReturns = definiteReturns;
+    return !seg.failed;
+}
+
+// Replaces segments [first, last) with text, parses it, and then redoes what the segments after it did to the context.
+void Document::Reparse(size_t first, size_t last, std::string text)
+{
+    int firstLine = segments[first]->firstLine;
+    ParsingCheckpoint start = segments[first]->before;
+
+    while (true)
+    {
+        ctx.Restore(start);
+        int definiteReturns = first > 0 ? segments[first - 1]->definiteReturns : 0;
+
+        std::vector<std::unique_ptr<Segment>> pieces = Split(text, firstLine);
+        bool parsed = true;
+        for (size_t i = 0, step = 1; i < pieces.size();)
+        {
+            int returnsBefore = definiteReturns;
+            if (Parse(*pieces[i], definiteReturns))
+            {
+                i++;
+                step = 1;
+                continue;
+            }
+            if (i + 1 == pieces.size())
+            {
+                parsed = false;
+                break;
+            }
+
+            // The failed statement may go on into the next piece, so join them and try again, twice as many each time.
+            size_t end = std::min(pieces.size(), i + 1 + step);
+            for (size_t j = i + 1; j < end; j++) pieces[i]->text += pieces[j]->text;
+            pieces.erase(pieces.begin() + i + 1, pieces.begin() + end);
+            step *= 2;
+            ctx.Restore(pieces[i]->before);
+            definiteReturns = returnsBefore;
+        }
+
+        if (last < segments.size())
+        {
+            // The segments after can only be reused if the ones before them leave the context as it was.
+            bool same = parsed && pieces.back()->definiteReturns == segments[last - 1]->definiteReturns;
+            if (same)
+            {
+                Effects before(start.varStackSize), after(start.varStackSize);
+                for (size_t i = first; i < last; i++) before.Add(*segments[i]);
+                for (std::unique_ptr<Segment>& p : pieces) after.Add(*p);
+                same = before.Same(after);
+            }
+            if (!same)
+            {
+                size_t end = std::min(segments.size(), last + std::max<size_t>(1, last - first));
+                for (size_t j = last; j < end; j++) text += segments[j]->text;
+                last = end;
+                continue;
+            }
+        }
+        else if (!pieces.back()->lexError.empty())
+        {
+            Assert(false, pieces.back()->lexError, pieces.back()->lexErrorPos);  // as lexing the whole file would
+        }
+
+        int oldLines = 0, newLines = 0;
+        for (size_t i = first; i < last; i++) oldLines += segments[i]->Lines();
+        for (std::unique_ptr<Segment>& p : pieces) newLines += p->Lines();
+        int shift = newLines - oldLines;
+        int oldEnd = firstLine + oldLines;  // the first line after the replaced segments, before the edit
+
+        segments.erase(segments.begin() + first, segments.begin() + last);
+        segments.insert(segments.begin() + first, std::make_move_iterator(pieces.begin()), std::make_move_iterator(pieces.end()));
+
+        for (size_t i = first + pieces.size(); i < segments.size(); i++)
+        {
+            Segment& seg = *segments[i];
+            seg.firstLine += shift;
+            seg.tokens.firstLine += shift;
+
+            seg.before = Mark();
+            for (std::pair<SymbolId, Type>& v : seg.added) ctx.AddVariable(v.first, v.second);
+            for (std::pair<int, Type>& r : seg.retyped) ctx.SetVariableType(r.first, r.second);
+            for (ErrorOutput& e : seg.errors)
+            {
+                if (e.pos.line >= oldEnd) e.pos.line += shift;
+                ctx.errors.push_back(e);
+            }
+            for (std::shared_ptr<LazyLambda>& l : seg.reported)
+            {
+                l->reported = true;
+                ctx.reportedUndo.push_back(l);
+            }
+            stats.statementsReused += (int)seg.statements.size();
+        }
+        return;
+    }
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include "Parser.h"
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// A source file of top level statements, parsed like the inside of a scope, that stays parsed as it is edited. The text is split
+// into segments at the start of a line between two statements, and each segment is lexed on its own, so an edit only lexes and
+// parses the segments it touches again. The segments after those are reused as they are, as long as the new statements leave the
+// same variables behind. Otherwise the following segments are parsed again as well, until the variables agree once more.
+//
+// Statements go into the AstArena that is active when the document is made, which has to be active for every edit as well. The
+// statements an edit replaces stay in the arena until it is destroyed.
+class Document
+{
+public:
+    // Segments are cut once they are at least segmentSize bytes long.
+    Document(std::string_view text, SymbolTable& symbols, const ParsingContext& ctx = {}, size_t segmentSize = 4096);
+    ~Document();
+
+    // Replaces removed bytes at offset with inserted.
+    void Edit(size_t offset, size_t removed, std::string_view inserted);
+
+    std::string Text() const;
+    std::vector<AstRef<Statement>> Statements() const;
+    bool Parsed() const;  // false if a statement failed to parse, in which case Statements ends before it
+    const std::vector<ErrorOutput>& Errors() const { return ctx.errors; }
+
+    // How much work the last edit (or making the document) took.
+    struct EditStats
+    {
+        size_t bytesLexed = 0;
+        int statementsParsed = 0;
+        int statementsReused = 0;
+    };
+    const EditStats& LastEdit() const { return stats; }
+
+private:
+    struct Segment;
+    struct Effects;
+
+    SymbolTable& symbols;
+    AstArena* arena;
+    ParsingContext ctx;
+    ParsingCheckpoint base;  // kept open, so that the context can be restored to the start of any segment
+    size_t segmentSize;
+    std::vector<std::unique_ptr<Segment>> segments;
+    EditStats stats;
+
+    ParsingCheckpoint Mark();
+    std::vector<std::unique_ptr<Segment>> Split(const std::string& text, int firstLine);
+    bool Parse(Segment& seg, int& definiteReturns);
+    void Reparse(size_t first, size_t last, std::string text);
+};
@@ -1,106 +1,619 @@
 #include "Lexer.h"
 #include "Assertion.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <istream>
 
-std::vector<Token> Tokenize(std::string str)
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LEXER_SSE2 1
+#include <emmintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+#endif
+
+namespace
 {
-    str += " ";
-    std::vector<Token> ret;
-    int pos = 0;
-    int line = 1; int lineStart = -1;  // will give weird results if carridge returns or other invisible characters are present, but oh well
+    // Character classes, as bit flags so that a single table load answers every question the lexer asks about a byte.
+    enum CharClass : uint8_t
+    {
+        Space = 1 << 0,  // what std::isspace accepts, newline included
+        Alpha = 1 << 1,  // can start an identifier
+        Digit = 1 << 2,
+        Ident = 1 << 3,  // can continue an identifier
+        Operator = 1 << 4,  // may be followed by =
+        Doubled = 1 << 5,  // may be doubled, eg && and ||
+        Punctuation = 1 << 6,  // always a single character
+    };
+
+    constexpr std::array<uint8_t, 256> MakeCharClasses()
+    {
+        std::array<uint8_t, 256> ret = {};
+        for (char c : std::string_view(" \t\n\v\f\r")) ret[(unsigned char)c] |= Space;
+        for (int c = 'a'; c <= 'z'; c++) ret[c] |= Alpha | Ident;
+        for (int c = 'A'; c <= 'Z'; c++) ret[c] |= Alpha | Ident;
+        for (int c = '0'; c <= '9'; c++) ret[c] |= Digit | Ident;
+        ret['_'] |= Ident;
+        for (char c : std::string_view("+-*/%^=!><")) ret[(unsigned char)c] |= Operator;
+        for (char c : std::string_view("&|")) ret[(unsigned char)c] |= Doubled;
+        for (char c : std::string_view(",()[]{}_:;")) ret[(unsigned char)c] |= Punctuation;
+        return ret;
+    }
+
+    constexpr std::array<uint8_t, 256> CHAR_CLASSES = MakeCharClasses();
+
+    inline bool Is(char c, uint8_t cls) { return CHAR_CLASSES[(unsigned char)c] & cls; }
+
+#ifdef LEXER_SSE2
+#if defined(_MSC_VER) && !defined(__clang__)
+    inline int CountTrailingZeros(uint32_t v) { unsigned long i; _BitScanForward(&i, v); return (int)i; }
+#else
+    inline int CountTrailingZeros(uint32_t v) { return __builtin_ctz(v); }
+#endif
+
+    // Bytes in [lo, hi]. SSE2 only has signed comparisons, which is fine while both bounds are ASCII, as bytes >= 0x80 compare as negative.
+    inline __m128i InRange(__m128i v, char lo, char hi)
+    {
+        return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)), _mm_cmpgt_epi8(_mm_set1_epi8(hi + 1), v));
+    }
 
-    while (pos < str.size())
+    inline __m128i SpaceMask(__m128i v)
     {
-        if (std::isspace(str[pos]))
+        return _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), InRange(v, '\t', '\r'));
+    }
+
+    inline __m128i IdentMask(__m128i v)
+    {
+        __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));  // folds A-Z onto a-z, and leaves no other byte in a-z
+        __m128i ret = _mm_or_si128(InRange(lower, 'a', 'z'), InRange(v, '0', '9'));
+        return _mm_or_si128(ret, _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+    }
+#endif
+
+    // Each of these returns the first position at or after pos that does not continue the run (or str.size()).
+
+    size_t SkipSpaces(std::string_view str, size_t pos, std::vector<uint32_t>& lineStarts)
+    {
+#ifdef LEXER_SSE2
+        for (; pos + 16 <= str.size(); pos += 16)
         {
-            if (str[pos] == '\n')
-            {
-                line += 1; lineStart = pos;
-            }
-            pos += 1;
+            __m128i v = _mm_loadu_si128((const __m128i*)(str.data() + pos));
+            uint32_t other = ~(uint32_t)_mm_movemask_epi8(SpaceMask(v)) & 0xFFFF;
+            uint32_t newlines = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+            if (other) newlines &= (1u << CountTrailingZeros(other)) - 1;
+            for (; newlines; newlines &= newlines - 1) lineStarts.push_back((uint32_t)pos + CountTrailingZeros(newlines));
+            if (other) return pos + CountTrailingZeros(other);
         }
-        else if (std::isalpha(str[pos]))
+#endif
+        for (; pos < str.size() && Is(str[pos], Space); pos++)
         {
-            int begin = pos;
-            do { pos += 1; } while (std::isalnum(str[pos]) || str[pos] == '_');
+            if (str[pos] == '\n') lineStarts.push_back((uint32_t)pos);
+        }
+        return pos;
+    }
 
-            std::string val = str.substr(begin, pos - begin);
-            ret.push_back({ (val == "true" || val == "false") ? TokenType::Boolean : TokenType::Text, val, { line, begin - lineStart } });
+    size_t SkipIdentifier(std::string_view str, size_t pos)
+    {
+#ifdef LEXER_SSE2
+        for (size_t end = std::min(pos + 8, str.size()); pos < end; pos++)  // most runs are short, so try a few bytes before paying for a vector load
+        {
+            if (!Is(str[pos], Ident)) return pos;
         }
-        else if (str[pos] == '"')
+        for (; pos + 16 <= str.size(); pos += 16)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i*)(str.data() + pos));
+            uint32_t other = ~(uint32_t)_mm_movemask_epi8(IdentMask(v)) & 0xFFFF;
+            if (other) return pos + CountTrailingZeros(other);
+        }
+#endif
+        while (pos < str.size() && Is(str[pos], Ident)) pos++;
+        return pos;
+    }
+
+    size_t SkipDigits(std::string_view str, size_t pos)
+    {
+#ifdef LEXER_SSE2
+        for (size_t end = std::min(pos + 8, str.size()); pos < end; pos++)  // most runs are short, so try a few bytes before paying for a vector load
+        {
+            if (!Is(str[pos], Digit)) return pos;
+        }
+        for (; pos + 16 <= str.size(); pos += 16)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i*)(str.data() + pos));
+            uint32_t other = ~(uint32_t)_mm_movemask_epi8(InRange(v, '0', '9')) & 0xFFFF;
+            if (other) return pos + CountTrailingZeros(other);
+        }
+#endif
+        while (pos < str.size() && Is(str[pos], Digit)) pos++;
+        return pos;
+    }
+
+    // Finds the first of a or b at or after pos.
+    size_t FindEither(std::string_view str, size_t pos, char a, char b)
+    {
+#ifdef LEXER_SSE2
+        for (; pos + 16 <= str.size(); pos += 16)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i*)(str.data() + pos));
+            uint32_t stop = (uint32_t)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(a)), _mm_cmpeq_epi8(v, _mm_set1_epi8(b))));
+            if (stop) return pos + CountTrailingZeros(stop);
+        }
+#endif
+        while (pos < str.size() && str[pos] != a && str[pos] != b) pos++;
+        return pos;
+    }
+
+    // Finds the closing quote or the next backslash inside a string literal.
+    inline size_t SkipStringContents(std::string_view str, size_t pos) { return FindEither(str, pos, '"', '\\'); }
+
+    size_t SkipComment(std::string_view str, size_t pos)
+    {
+        const void* newline = std::memchr(str.data() + pos, '\n', str.size() - pos);  // the C library already vectorizes this
+        return newline ? (const char*)newline - str.data() : str.size();
+    }
+}
+
+SymbolTable::SymbolTable()
+{
+    for (std::string_view k : { "lambda", "if", "for", "while", "return", "true", "false", "int", "double", "string", "bool" }) Intern(k);
+}
+
+SymbolId SymbolTable::Intern(std::string_view name)
+{
+    auto found = ids.find(name);
+    if (found != ids.end()) return found->second;
+
+    SymbolId id = (SymbolId)names.size();
+    names.emplace_back(name);
+    ids.emplace(names.back(), id);
+    return id;
+}
+
+namespace
+{
+    TextPosition PositionOf(const std::vector<uint32_t>& lineStarts, uint32_t offset)
+    {
+        int line = std::lower_bound(lineStarts.begin(), lineStarts.end(), offset) - lineStarts.begin();  // number of newlines before the offset
+        return { line + 1, (int)offset - (line == 0 ? -1 : (int)lineStarts[line - 1]) };
+    }
+
+    void PushEndOfFile(TokenStream& out)
+    {
+        out.types.push_back(TokenType::EndOfFile);  // one past the end, where the lexer used to append a padding space
+        out.offsets.push_back((uint32_t)out.source.size() + 1);
+        out.lengths.push_back(0);
+        out.symbols.push_back(0);
+    }
+
+    struct LexError
+    {
+        std::string msg;
+        uint32_t offset = 0;
+        bool failed = false;
+        bool unfinished = false;  // ran out of source in the middle of a string literal, which more input might complete
+    };
+
+    // Lexes the tokens starting in [pos, end) of str, appending them to out with offsets relative to the whole of str. Lexing may
+    // stop early on an error, which is left in err. end must not fall inside a token, string literal or comment (see FindChunkBoundaries).
+    void LexRange(std::string_view str, size_t pos, size_t end, TokenStream& out, SymbolTable& symbols, LexError& err)
+    {
+        std::string_view whole = str;
+        str = str.substr(0, end);  // so runs of spaces stop at the end of the chunk too
+        auto at = [&](size_t i) -> char { return i < str.size() ? str[i] : '\0'; };  // the source is not null terminated
+        auto push = [&](TokenType type, size_t begin, size_t length, SymbolId symbol = 0)
         {
-            int begin = pos;
-            std::string r = "";
-            pos += 1;
-            for (; pos < str.size(); pos++)
+            out.types.push_back(type);
+            out.offsets.push_back((uint32_t)begin);
+            out.lengths.push_back((uint32_t)length);
+            out.symbols.push_back(symbol);
+        };
+        auto fail = [&](std::string msg, size_t offset, bool unfinished = false)
+        {
+            err = { std::move(msg), (uint32_t)offset, true, unfinished };
+        };
+
+        // The lexer only lets digits and a single dot through, so the only way decoding can fail is a value out of range.
+        auto pushInteger = [&](size_t begin, size_t end)
+        {
+            int value;
+            if (std::from_chars(str.data() + begin, str.data() + end, value).ec != std::errc()) { fail("Integer literal is too large.", begin); return false; }
+            push(TokenType::Integer, begin, end - begin, (SymbolId)out.integers.size());
+            out.integers.push_back(value);
+            return true;
+        };
+        auto pushDecimal = [&](size_t begin, size_t end)
+        {
+            double value;
+            if (std::from_chars(str.data() + begin, str.data() + end, value).ec != std::errc()) { fail("Decimal literal is too large.", begin); return false; }
+            push(TokenType::Decimal, begin, end - begin, (SymbolId)out.decimals.size());
+            out.decimals.push_back(value);
+            return true;
+        };
+
+        while (pos < str.size())
+        {
+            uint8_t cls = CHAR_CLASSES[(unsigned char)str[pos]];
+
+            if (cls & Space)
             {
-                if (str[pos] == '"') break;
+                pos = SkipSpaces(str, pos, out.lineStarts);
+            }
+            else if (cls & Alpha)
+            {
+                size_t begin = pos;
+                pos = SkipIdentifier(str, pos + 1);
 
-                if (str[pos] == '\\')
+                SymbolId symbol = symbols.Intern(str.substr(begin, pos - begin));
+                bool isBoolean = symbol == (SymbolId)Keyword::True || symbol == (SymbolId)Keyword::False;
+                push(isBoolean ? TokenType::Boolean : TokenType::Text, begin, pos - begin, symbol);
+            }
+            else if (str[pos] == '"')
+            {
+                if (!out.literals) out.literals = std::make_unique<char[]>(whole.size());
+                char* lit = out.literals.get();
+
+                size_t begin = pos;
+                pos += 1;
+                size_t valueEnd = pos;  // end of the unescaped value in the literals buffer
+                while (true)
                 {
+                    size_t next = SkipStringContents(str, pos);
+                    std::copy(str.begin() + pos, str.begin() + next, lit + valueEnd);
+                    valueEnd += next - pos;
+                    pos = next;
+
+                    if (pos >= str.size() || str[pos] == '"') break;
+
+                    // str[pos] is a backslash
                     pos += 1;
-                    Assert(pos < str.size(), "End of file reached while lexing string.", { line, begin - lineStart });
+                    if (pos >= str.size()) return fail("End of file reached while lexing string.", begin, true);
+
+                    size_t v = std::string_view("abfnrtv\\\'\"").find(str[pos]);
+                    if (v == std::string_view::npos) return fail("Unrecognized escape sequence.", begin);
+                    lit[valueEnd] = "\a\b\f\n\r\t\v\\\'\""[v];
+                    valueEnd += 1; pos += 1;
+                }
+                if (pos >= str.size()) return fail("End of file reached while lexing string.", begin, true);
+                pos += 1;
 
-                    size_t v = std::string("abfnrtv\\\'\"").find(str[pos]);
-                    Assert(v != std::string::npos, "Unrecognized escape sequence.", { line, begin - lineStart });
-                    r += std::string("\a\b\f\n\r\t\v\\\'\"")[v];
+                push(TokenType::StringLiteral, begin, valueEnd - begin - 1);
+            }
+            else if (cls & Digit)
+            {
+                size_t begin = pos;
+                pos = SkipDigits(str, pos + 1);
+                if (at(pos) == '.')
+                {
+                    pos = SkipDigits(str, pos + 1);
+                    if (!pushDecimal(begin, pos)) return;
                 }
                 else
                 {
-                    r += str[pos];
+                    if (!pushInteger(begin, pos)) return;
                 }
             }
-            Assert(pos < str.size(), "End of file reached while lexing string.", { line, begin - lineStart });
-            pos += 1;
-            ret.push_back({ TokenType::StringLiteral, r, { line, begin - lineStart } });
+            else if (str[pos] == '.' && Is(at(pos + 1), Digit))
+            {
+                size_t begin = pos;
+                pos = SkipDigits(str, pos + 2);
+                if (!pushDecimal(begin, pos)) return;
+            }
+            else if (str[pos] == '/' && at(pos + 1) == '/')  // comments
+            {
+                pos = SkipComment(str, pos);
+            }
+            else if (cls & Operator)
+            {
+                size_t begin = pos; pos += 1;
+                if (at(pos) == '=') pos += 1;
+                push(TokenType::Symbol, begin, pos - begin, (SymbolId)ClassifySymbol(str[begin], pos - begin > 1 ? str[begin + 1] : '\0'));
+            }
+            else if (cls & Doubled)
+            {
+                size_t begin = pos; pos += 1;
+                if (at(pos) == str[pos - 1]) pos += 1;
+                push(TokenType::Symbol, begin, pos - begin, (SymbolId)ClassifySymbol(str[begin], pos - begin > 1 ? str[begin + 1] : '\0'));
+            }
+            else if (cls & Punctuation)
+            {
+                size_t begin = pos; pos += 1;
+                push(TokenType::Symbol, begin, pos - begin);
+            }
+            else
+            {
+                return fail("Unrecognized symbol." + std::string(whole.substr(pos)), pos);
+            }
         }
-        else if (std::isdigit(str[pos]))
+    }
+
+    // Splits str into roughly equal chunks that can be lexed independently. Every chunk but the first starts on a newline that is
+    // not inside a string literal, which is also never inside a comment, as a comment always ends at the first newline.
+    // This has to walk the whole source, but only stops at quotes, backslashes in strings, slashes and newlines, so it is cheap.
+    std::vector<size_t> FindChunkBoundaries(std::string_view str, int chunks, bool& hasStrings)
+    {
+        std::vector<size_t> ret = { 0 };
+        hasStrings = false;
+
+        size_t pos = 0;
+        size_t target = str.size() / chunks;
+        while (pos < str.size() && (int)ret.size() < chunks)
         {
-            int begin = pos;
-            do { pos += 1; } while (std::isdigit(str[pos]));
-            if (str[pos] == '.')
+            // Between tokens: look for the next thing that changes state, or a newline once we are past the next split point.
+            pos = pos < target ? FindEither(str, pos, '"', '/') : std::min(FindEither(str, pos, '"', '/'), SkipComment(str, pos));
+            if (pos >= str.size()) break;
+
+            if (str[pos] == '\n')
             {
-                do { pos += 1; } while (std::isdigit(str[pos]));
-                ret.push_back({ TokenType::Decimal, str.substr(begin, pos - begin), { line, begin - lineStart } });
+                ret.push_back(pos);
+                target = pos + (str.size() - pos) / (chunks - ret.size() + 1);
+                pos += 1;
+            }
+            else if (str[pos] == '"')
+            {
+                hasStrings = true;
+                pos += 1;
+                while (true)
+                {
+                    pos = SkipStringContents(str, pos);
+                    if (pos >= str.size() || str[pos] == '"') break;
+                    pos += 2;  // skip the escaped character, whatever it is
+                }
+                pos += 1;
+            }
+            else if (pos + 1 < str.size() && str[pos + 1] == '/')
+            {
+                pos = SkipComment(str, pos);  // the newline ending the comment is a fine place to split, so it is looked at next
             }
             else
             {
-                ret.push_back({ TokenType::Integer, str.substr(begin, pos - begin), { line, begin - lineStart } });
+                pos += 1;  // division
             }
         }
-        else if (str[pos] == '.' && std::isdigit(str[pos + 1]))
+
+        if (!hasStrings) hasStrings = str.find('"', pos) != std::string_view::npos;  // the rest of the last chunk was not scanned
+        ret.push_back(str.size());
+        return ret;
+    }
+}
+
+TokenStream Tokenize(std::string_view str, SymbolTable& symbols, int chunks)
+{
+    Assert(str.size() < UINT32_MAX - 1, "Source files must be smaller than 4GB.");
+
+    TokenStream ret;
+    ret.source = str;
+
+    if (chunks == 0) chunks = (int)std::min<size_t>(ThreadPool::Global().Size(), str.size() / MIN_PARALLEL_CHUNK_SIZE);
+    if (chunks <= 1)
+    {
+        LexError err;
+        LexRange(str, 0, str.size(), ret, symbols, err);
+        if (err.failed) Assert(false, err.msg, PositionOf(ret.lineStarts, err.offset));
+    }
+    else
+    {
+        bool hasStrings;
+        std::vector<size_t> boundaries = FindChunkBoundaries(str, chunks, hasStrings);
+        if (hasStrings) ret.literals = std::make_unique<char[]>(str.size());  // shared, as each literal is written at its own offset
+
+        struct Chunk
         {
-            int begin = pos; pos += 2;
-            while (std::isdigit(str[pos])) pos += 1;
-            ret.push_back({ TokenType::Decimal, str.substr(begin, pos - begin), { line, begin - lineStart } });
+            TokenStream tokens;
+            SymbolTable symbols;
+            LexError err;
+        };
+        std::vector<Chunk> parts(boundaries.size() - 1);
+
+        ThreadPool::Global().ParallelFor((int)parts.size(), [&](int i)
+        {
+            Chunk& c = parts[i];
+            c.tokens.literals = std::unique_ptr<char[]>(ret.literals.get());  // borrowed, released below
+            LexRange(str, boundaries[i], boundaries[i + 1], c.tokens, c.symbols, c.err);
+            c.tokens.literals.release();
+        });
+
+        // Stitch the chunks back together in order. Interning each chunk's names in order of first use gives the same ids the serial lexer would.
+        size_t total = 0;
+        for (Chunk& c : parts) total += c.tokens.Size();
+        ret.types.reserve(total + 1); ret.offsets.reserve(total + 1); ret.lengths.reserve(total + 1); ret.symbols.reserve(total + 1);
+
+        for (Chunk& c : parts)
+        {
+            std::vector<SymbolId> remap(c.symbols.names.size());
+            for (SymbolId i = 0; i < remap.size(); i++) remap[i] = symbols.Intern(c.symbols.Name(i));
+
+            for (int i = 0; i < c.tokens.Size(); i++)
+            {
+                ret.types.push_back(c.tokens.types[i]);
+                ret.offsets.push_back(c.tokens.offsets[i]);
+                ret.lengths.push_back(c.tokens.lengths[i]);
+                switch (c.tokens.types[i])
+                {
+                case TokenType::Text: case TokenType::Boolean: ret.symbols.push_back(remap[c.tokens.symbols[i]]); break;
+                case TokenType::Integer: ret.symbols.push_back(c.tokens.symbols[i] + (SymbolId)ret.integers.size()); break;
+                case TokenType::Decimal: ret.symbols.push_back(c.tokens.symbols[i] + (SymbolId)ret.decimals.size()); break;
+                case TokenType::Symbol: ret.symbols.push_back(c.tokens.symbols[i]); break;
+                default: ret.symbols.push_back(0); break;
+                }
+            }
+            ret.integers.insert(ret.integers.end(), c.tokens.integers.begin(), c.tokens.integers.end());
+            ret.decimals.insert(ret.decimals.end(), c.tokens.decimals.begin(), c.tokens.decimals.end());
+            ret.lineStarts.insert(ret.lineStarts.end(), c.tokens.lineStarts.begin(), c.tokens.lineStarts.end());
+
+            if (c.err.failed) Assert(false, c.err.msg, PositionOf(ret.lineStarts, c.err.offset));  // the serial lexer would also have stopped at the first error
         }
-        else if (str[pos] == '/' && str[pos + 1] == '/')  // comments
+    }
+
+    PushEndOfFile(ret);
+    return ret;
+}
+
+bool TryTokenize(std::string_view str, SymbolTable& symbols, TokenStream& out, std::string& error, TextPosition& errorPos)
+{
+    Assert(str.size() < UINT32_MAX - 1, "Source files must be smaller than 4GB.");
+
+    out = TokenStream();
+    out.source = str;
+
+    LexError err;
+    LexRange(str, 0, str.size(), out, symbols, err);
+    if (err.failed)
+    {
+        error = err.msg;
+        errorPos = PositionOf(out.lineStarts, err.offset);
+        return false;
+    }
+
+    PushEndOfFile(out);
+    return true;
+}
+
+// The state of a stream made by TokenizeLazily. The input is read in blocks, and each block is lexed up to its last newline into a
+// page of its own, so the values of tokens stay where they are until the whole page is dropped. Whatever follows the last newline
+// (or the start of a string literal that is still open) is carried over to the next page.
+struct TokenReader
+{
+    struct Page
+    {
+        std::unique_ptr<char[]> text;
+        TokenStream tokens;  // only the literals buffer is kept, the tokens themselves are moved into the reader
+        int end;  // index of the first token after this page
+    };
+
+    std::istream& in;
+    SymbolTable& symbols;
+    int backtrack;
+    size_t blockSize;
+
+    std::deque<Page> pages;
+    std::string carry;
+    size_t carryOffset = 0;  // where carry starts in the input
+    bool finished = false;
+
+    std::deque<Token> tokens;  // offsets are from the start of the input, and numeric literals index integers and decimals from their first entry ever
+    int first = 0;  // index of tokens.front()
+    int furthest = 0;  // the furthest token asked for
+    std::deque<int> integers; SymbolId firstInteger = 0;
+    std::deque<double> decimals; SymbolId firstDecimal = 0;
+
+    std::deque<uint32_t> lineStarts;
+    int droppedLines = 0;
+    int64_t lastDroppedLineStart = -1;
+
+    TokenReader(std::istream& in, SymbolTable& symbols, int backtrack, size_t blockSize) : in(in), symbols(symbols), backtrack(backtrack), blockSize(blockSize) {}
+
+    TextPosition PositionOf(uint32_t offset) const
+    {
+        int line = std::lower_bound(lineStarts.begin(), lineStarts.end(), offset) - lineStarts.begin();
+        int64_t lineStart = line == 0 ? lastDroppedLineStart : lineStarts[line - 1];
+        return { droppedLines + line + 1, (int)(offset - lineStart) };
+    }
+
+    // Lexes the next block of input. Returns false once the end of file token has been produced.
+    bool Pull()
+    {
+        if (finished) return false;
+
+        Page page = { std::make_unique<char[]>(carry.size() + blockSize), {}, 0 };
+        std::copy(carry.begin(), carry.end(), page.text.get());
+        in.read(page.text.get() + carry.size(), blockSize);
+        std::string_view view(page.text.get(), carry.size() + in.gcount());
+        bool eof = !in;
+
+        size_t end = eof ? view.size() : view.rfind('\n');
+        if (end == std::string_view::npos) end = 0;  // no complete line yet, keep reading
+        TokenStream& out = page.tokens;
+        out.source = view;
+
+        LexError err;
+        LexRange(view, 0, end, out, symbols, err);
+        if (err.failed && err.unfinished && !eof) end = err.offset;  // the string literal continues in the next block
+
+        for (int i = 0; i < out.Size(); i++)
         {
-            while (pos < str.size() && str[pos] != '\n') pos += 1;
+            Token t = out[i];
+            t.offset += (uint32_t)carryOffset;
+            if (t.type == TokenType::Integer) t.symbol += firstInteger + (SymbolId)integers.size();
+            if (t.type == TokenType::Decimal) t.symbol += firstDecimal + (SymbolId)decimals.size();
+            tokens.push_back(t);
         }
-        else if (std::string("+-*/%^=!><").find(str[pos]) != std::string::npos)
+        integers.insert(integers.end(), out.integers.begin(), out.integers.end());
+        decimals.insert(decimals.end(), out.decimals.begin(), out.decimals.end());
+        for (uint32_t i : out.lineStarts) lineStarts.push_back(i + (uint32_t)carryOffset);
+        if (err.failed && !(err.unfinished && !eof)) Assert(false, err.msg, PositionOf(err.offset + (uint32_t)carryOffset));
+
+        carry = view.substr(end);
+        carryOffset += end;
+        std::unique_ptr<char[]> literals = std::move(out.literals);  // the values still point into the page
+        out = TokenStream();
+        out.literals = std::move(literals);
+        page.end = first + (int)tokens.size();
+        pages.push_back(std::move(page));
+
+        if (eof && carry.empty())
         {
-            int begin = pos; pos += 1;
-            if (str[pos] == '=') pos += 1;
-            ret.push_back({ TokenType::Symbol, str.substr(begin, pos - begin), { line, begin - lineStart } });
+            tokens.push_back({ TokenType::EndOfFile, {}, (uint32_t)carryOffset + 1, 0 });
+            finished = true;
         }
-        else if (std::string("&|").find(str[pos]) != std::string::npos)
+        return true;
+    }
+
+    // Forgets the tokens that are too far behind to be asked for again, along with their pages and lines.
+    void Drop()
+    {
+        for (; first < furthest - backtrack; first++)
         {
-            int begin = pos; pos += 1;
-            if (str[pos] == str[pos - 1]) pos += 1;
-            ret.push_back({ TokenType::Symbol, str.substr(begin, pos - begin), { line, begin - lineStart } });
+            if (tokens.front().type == TokenType::Integer) { integers.pop_front(); firstInteger++; }
+            if (tokens.front().type == TokenType::Decimal) { decimals.pop_front(); firstDecimal++; }
+            tokens.pop_front();
         }
-        else if (std::string(",()[]{}_:;").find(str[pos]) != std::string::npos)
+        while (pages.size() > 1 && pages.front().end <= first) pages.pop_front();
+        while (!lineStarts.empty() && lineStarts.front() < tokens.front().offset)
         {
-            int begin = pos; pos += 1;
-            ret.push_back({ TokenType::Symbol, str.substr(begin, pos - begin), { line, begin - lineStart } });
+            lastDroppedLineStart = lineStarts.front();
+            lineStarts.pop_front();
+            droppedLines++;
         }
-        else
+    }
+
+    int Index(int i)
+    {
+        while (i >= first + (int)tokens.size()) Assert(Pull(), "Read past the end of the token stream.");
+        if (i < first) Assert(false, "Token " + std::to_string(i) + " was dropped from the streaming window. Try a larger backtracking window.");
+        if (i > furthest)
         {
-            Assert(false, "Unrecognized symbol." + str.substr(pos), { line, pos - lineStart });
+            furthest = i;
+            Drop();
         }
+        return i - first;
     }
+};
 
-    ret.push_back({ TokenType::EndOfFile, "", { line, pos - lineStart } });
+TokenStream::TokenStream() = default;
+TokenStream::TokenStream(TokenStream&&) noexcept = default;
+TokenStream& TokenStream::operator=(TokenStream&&) noexcept = default;
+TokenStream::~TokenStream() = default;
+
+TokenStream TokenizeLazily(std::istream& in, SymbolTable& symbols, int backtrack, size_t blockSize)
+{
+    TokenStream ret;
+    ret.reader = std::make_unique<TokenReader>(in, symbols, backtrack, blockSize);
     return ret;
 }
 
+int TokenStream::StreamedSize() const { return reader->first + (int)reader->tokens.size(); }
+Token TokenStream::StreamedToken(int i) const { return reader->tokens[reader->Index(i)]; }
+int TokenStream::StreamedInteger(int i) const { return reader->integers[reader->tokens[reader->Index(i)].symbol - reader->firstInteger]; }
+double TokenStream::StreamedDecimal(int i) const { return reader->decimals[reader->tokens[reader->Index(i)].symbol - reader->firstDecimal]; }
+
+TextPosition TokenStream::GetPosition(int i) const
+{
+    if (reader) return reader->PositionOf(reader->tokens[reader->Index(i)].offset);
+    TextPosition pos = PositionOf(lineStarts, offsets[i]);
+    pos.line += firstLine - 1;
+    return pos;
+}
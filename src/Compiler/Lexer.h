@@ -1,9 +1,15 @@
 #pragma once
 #include "Assertion.h"
 #include <string>
+#include <string_view>
 #include <vector>
+#include <memory>
+#include <cstdint>
+#include <deque>
+#include <unordered_map>
+#include <iosfwd>
 
-enum class TokenType
+enum class TokenType : uint8_t
 {
     Text,
     Symbol,
@@ -14,12 +20,143 @@ enum class TokenType
     EndOfFile,
 };
 
+typedef uint32_t SymbolId;
+
+// Names the compiler itself looks for. These are interned first, in this order, so their ids are fixed.
+enum class Keyword : SymbolId
+{
+    Lambda, If, For, While, Return, True, False,
+    Int, Double, String, Bool,
+};
+
+// What an operator is, worked out once by the lexer and kept as the symbol of its token, so that the parser can switch on it rather
+// than look at its text. Every other symbol is Other.
+enum class SymbolKind : SymbolId
+{
+    Other,
+    Plus, Minus, Star, Slash, Percent, Caret, Not,
+    Less, Greater, LessEqual, GreaterEqual, EqualEqual, NotEqual, AndAnd, OrOr,
+};
+
+constexpr SymbolKind ClassifySymbol(char c, char d)  // d is the second character, or '\0'
+{
+    if (d == '\0')
+    {
+        switch (c)
+        {
+        case '+': return SymbolKind::Plus;
+        case '-': return SymbolKind::Minus;
+        case '*': return SymbolKind::Star;
+        case '/': return SymbolKind::Slash;
+        case '%': return SymbolKind::Percent;
+        case '^': return SymbolKind::Caret;
+        case '!': return SymbolKind::Not;
+        case '<': return SymbolKind::Less;
+        case '>': return SymbolKind::Greater;
+        default: return SymbolKind::Other;
+        }
+    }
+    if (d == '=')
+    {
+        switch (c)
+        {
+        case '<': return SymbolKind::LessEqual;
+        case '>': return SymbolKind::GreaterEqual;
+        case '=': return SymbolKind::EqualEqual;
+        case '!': return SymbolKind::NotEqual;
+        default: return SymbolKind::Other;
+        }
+    }
+    if (c == '&' && d == '&') return SymbolKind::AndAnd;
+    if (c == '|' && d == '|') return SymbolKind::OrOr;
+    return SymbolKind::Other;
+}
+
+// Maps every identifier in a compilation to a small integer, so the front end never compares names as strings.
+struct SymbolTable
+{
+    std::deque<std::string> names;  // a deque never moves its elements, so the views in ids stay valid
+    std::unordered_map<std::string_view, SymbolId> ids;
+
+    SymbolTable();
+    SymbolId Intern(std::string_view name);
+    inline std::string_view Name(SymbolId id) const { return names[id]; }
+};
+
+// A token as handed out by a TokenStream. Nothing is owned, and the position is only worked out when asked for (see TokenStream::GetPosition).
 struct Token
 {
     TokenType type;
-    std::string value;
-    TextPosition pos;
+    std::string_view value;
+    uint32_t offset;
+    SymbolId symbol;  // the interned name of Text and Boolean tokens, the index of the value of Integer and Decimal tokens, or the SymbolKind of Symbol tokens
+};
+
+inline bool IsKeyword(const Token& t, Keyword k) { return t.type == TokenType::Text && t.symbol == (SymbolId)k; }
+
+struct TokenReader;
+
+// A tokenized source buffer, stored as parallel arrays since the parser mostly looks at the type and value of each token.
+// Tokens refer to the source by offset, so the source must outlive the stream (it is not copied). String literals are copied into a
+// single side buffer, at the same offset they have in the source, and unescaped there (which never makes a string longer).
+struct TokenStream
+{
+    std::string_view source;
+    std::unique_ptr<char[]> literals;
+
+    std::vector<TokenType> types;
+    std::vector<uint32_t> offsets;  // where each token starts in the source, the opening quote for string literals
+    std::vector<uint32_t> lengths;  // length of the value, unescaped for string literals
+    std::vector<SymbolId> symbols;  // the interned name of each Text token, an index into integers or decimals for numeric literals, or a SymbolKind
+    std::vector<int> integers;  // numeric literals, decoded once by the lexer
+    std::vector<double> decimals;
+    std::vector<uint32_t> lineStarts;  // offset of the newline before each line after the first. The lexer does not count newlines inside string literals.
+    int firstLine = 1;  // the line the source starts on, when it was cut out of a larger file at the start of a line
+
+    std::unique_ptr<TokenReader> reader;  // only set by TokenizeLazily, in which case the tokens are kept there instead of in the arrays above
+
+    TokenStream();
+    TokenStream(TokenStream&&) noexcept;
+    TokenStream& operator=(TokenStream&&) noexcept;
+    ~TokenStream();
+
+    inline int Size() const { return reader ? StreamedSize() : (int)types.size(); }  // only counts the tokens lexed so far when streaming
+
+    inline Token operator[](int i) const
+    {
+        if (reader) return StreamedToken(i);
+        switch (types[i])
+        {
+        case TokenType::StringLiteral: return { types[i], { literals.get() + offsets[i] + 1, lengths[i] }, offsets[i], symbols[i] };
+        case TokenType::EndOfFile: return { types[i], {}, offsets[i], symbols[i] };
+        default: return { types[i], source.substr(offsets[i], lengths[i]), offsets[i], symbols[i] };
+        }
+    }
+
+    inline int Integer(int i) const { return reader ? StreamedInteger(i) : integers[symbols[i]]; }
+    inline double Decimal(int i) const { return reader ? StreamedDecimal(i) : decimals[symbols[i]]; }
+
+    TextPosition GetPosition(int i) const;
+
+private:
+    int StreamedSize() const;
+    Token StreamedToken(int i) const;
+    int StreamedInteger(int i) const;
+    double StreamedDecimal(int i) const;
 };
 
-std::vector<Token> Tokenize(std::string str);
+// Sources at least this many bytes per thread are lexed in parallel by default.
+constexpr size_t MIN_PARALLEL_CHUNK_SIZE = 1 << 20;
+
+// Splits the source into this many chunks at newlines, lexes them in parallel, and stitches the results back together. The result
+// is identical to lexing it all at once. 0 picks a number of chunks from the pool size and the size of the source.
+TokenStream Tokenize(std::string_view str, SymbolTable& symbols, int chunks = 0);
+
+// Like Tokenize, but serial, and returns false with what went wrong instead of failing an assertion when str does not lex, for
+// sources that may have been cut off in the middle of a string literal.
+bool TryTokenize(std::string_view str, SymbolTable& symbols, TokenStream& out, std::string& error, TextPosition& errorPos);
 
+// Lexes the input as the parser asks for tokens, reading it blockSize bytes at a time, so memory use does not grow with the size of
+// the input. Only the tokens up to backtrack behind the furthest one asked for are kept, and asking for an older one fails an
+// assertion, so the window has to cover the longest statement the parser may back out of.
+TokenStream TokenizeLazily(std::istream& in, SymbolTable& symbols, int backtrack = 1 << 16, size_t blockSize = 1 << 16);
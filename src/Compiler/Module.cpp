@@ -0,0 +1,813 @@
+#include "Module.h"
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <ostream>
+#include <sstream>
+#include <unordered_map>
+
+namespace
+{
+    constexpr uint32_t CACHE_MAGIC = 0x4d434453;  // "SDCM" on little endian machines
+    constexpr uint32_t NEW_LAZY = UINT32_MAX;  // in place of the index of a lazy lambda written out in full
+    constexpr uint32_t BYTE_ORDER_MARK = 0x01020304;  // so files from a machine of the other endianness never load
+
+    double MsSince(std::chrono::steady_clock::time_point begin)
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+    }
+
+    // Everything is written in the byte order of the machine. Nodes are written depth first and get new indices when read, so
+    // whatever backtracking left in the arena is not written. Lazy lambdas are shared between copies of a type, so each is written
+    // once, and after that by the index it gets once written, in the order they are finished.
+    struct Writer
+    {
+        std::string out;
+        const TokenStream& tokens;
+        bool ok = true;
+        std::unordered_map<const LazyLambda*, uint32_t> lazies;
+        uint32_t next = 0;
+
+        Writer(const TokenStream& tokens) : tokens(tokens) {}
+
+        template<typename T> void Pod(const T& v) { out.append((const char*)&v, sizeof(T)); }
+        void Count(size_t n) { Pod((uint32_t)n); }
+        void String(std::string_view s) { Count(s.size()); out.append(s.data(), s.size()); }
+
+        template<typename T> void PodVector(const std::vector<T>& v)
+        {
+            Count(v.size());
+            out.append((const char*)v.data(), v.size() * sizeof(T));
+        }
+
+        // Most numbers in a token stream are small, or close to the one before, so they are written 7 bits at a time.
+        void Varints(const std::vector<uint32_t>& v, bool delta)
+        {
+            Count(v.size());
+            uint32_t previous = 0;
+            for (uint32_t i : v)
+            {
+                uint32_t x = delta ? i - previous : i;
+                previous = i;
+                for (; x >= 0x80; x >>= 7) out += (char)(x | 0x80);
+                out += (char)x;
+            }
+        }
+
+        void View(const VectorView<Token>& v)
+        {
+            if (v.stream != &tokens) ok = false;
+            Pod((uint32_t)v.begin);
+        }
+
+        void Types(const TypeList& types)
+        {
+            Count(types.size());
+            for (const HeapAlloc<Type>& t : types) Write(t.Get());
+        }
+
+        void Write(const Type& t)
+        {
+            Pod((uint8_t)t.index());
+            if (std::holds_alternative<AtomicType>(t)) Pod((uint8_t)std::get<AtomicType>(t));
+            else if (std::holds_alternative<UnionType>(t)) Types(std::get<UnionType>(t).values);
+            else if (std::holds_alternative<OverloadType>(t)) Types(std::get<OverloadType>(t).values);
+            else if (std::holds_alternative<RecordType>(t)) Types(std::get<RecordType>(t).values);
+            else
+            {
+                const LambdaType& l = std::get<LambdaType>(t);
+                Write(l.arg.Get());
+                Write(l.ret.Get());  // not Ret(), as that would parse a lazy body
+
+                Pod(l.temp.has_value());
+                if (l.temp.has_value())
+                {
+                    const TemplateLambda& temp = l.temp.value();
+                    Types(temp.instantiatedArgs);
+                    Count(temp.definitions.size());
+                    for (const std::pair<VectorView<Token>, HeapAlloc<ParsingContext>>& d : temp.definitions)
+                    {
+                        View(d.first);
+                        Write(d.second.Get());
+                    }
+                    Count(temp.returnTypes.size());
+                    for (const HeapAlloc<ReturnTypeSet>& r : temp.returnTypes) Write(r.Get());
+                }
+
+                Pod(l.lazy != nullptr);
+                if (l.lazy) Write(*l.lazy);
+            }
+        }
+
+        void Write(const ReturnTypeSet& r)
+        {
+            Count(r.types.size());
+            for (const Type& t : r.types) Write(t);
+            Pod(r.isOptional);
+        }
+
+        void Write(const std::vector<ErrorOutput>& errors)
+        {
+            Count(errors.size());
+            for (const ErrorOutput& e : errors)
+            {
+                String(e.msg);
+                Pod(e.pos);
+            }
+        }
+
+        void Write(const std::map<SymbolId, Type>& typedefs)
+        {
+            Count(typedefs.size());
+            for (const std::pair<const SymbolId, Type>& t : typedefs)
+            {
+                Pod(t.first);
+                Write(t.second);
+            }
+        }
+
+        // Only what a context is made of: the lookup index is rebuilt on the first lookup, and no checkpoint can be open.
+        void Write(const ParsingContext& ctx)
+        {
+            Count(ctx.varStack.size());
+            for (const std::pair<SymbolId, Type>& v : ctx.varStack)
+            {
+                Pod(v.first);
+                Write(v.second);
+            }
+            Write(*ctx.typedefs);
+            Write(ctx.errors);
+            Pod(ctx.lazyLambdas);
+        }
+
+        void Write(const LazyLambda& lazy)
+        {
+            auto found = lazies.find(&lazy);
+            if (found != lazies.end())
+            {
+                if (found->second == NEW_LAZY) ok = false;  // it contains itself, which would never be freed when read
+                Pod(found->second);
+                return;
+            }
+            Pod(NEW_LAZY);
+            lazies[&lazy] = NEW_LAZY;
+
+            View(lazy.tokens);
+            Pod((uint64_t)lazy.stackSize);
+            Count(lazy.captured.size());
+            for (const std::pair<int, std::pair<SymbolId, Type>>& c : lazy.captured)
+            {
+                Pod(c.first);
+                Pod(c.second.first);
+                Write(c.second.second);
+            }
+            Write(*lazy.typedefs);
+            Pod(lazy.parsed);
+            Pod(lazy.body.has_value());
+            if (lazy.body.has_value()) Write(lazy.body.value().Get());
+            Write(lazy.ret);
+            Write(lazy.errors);
+            Pod(lazy.reported);
+            lazies[&lazy] = next++;
+        }
+
+        void Write(const Expression& e)
+        {
+            Pod((uint8_t)e.index());
+            Write(GetExpressionType(e));
+            if (std::holds_alternative<LiteralExpression>(e))
+            {
+                View(std::get<LiteralExpression>(e).vec);
+            }
+            else if (std::holds_alternative<VariableExpression>(e))
+            {
+                View(std::get<VariableExpression>(e).vec);
+                Pod(std::get<VariableExpression>(e).stackIndex);
+            }
+            else if (std::holds_alternative<LambdaExpression>(e))
+            {
+                const LambdaExpression& l = std::get<LambdaExpression>(e);
+                View(l.vec);
+                Write(l.args.Get());
+                Write(l.body.Get());
+            }
+            else if (std::holds_alternative<MultiExpression>(e))
+            {
+                const MultiExpression& m = std::get<MultiExpression>(e);
+                View(m.vec);
+                Pod((uint8_t)m.exprType);
+                Count(m.elements.size());
+                for (const AstRef<Expression>& i : m.elements) Write(i.Get());
+            }
+            else if (std::holds_alternative<BinaryExpression>(e))
+            {
+                const BinaryExpression& b = std::get<BinaryExpression>(e);
+                View(b.vec);
+                Pod((uint8_t)b.exprType);
+                Write(b.a.Get());
+                Write(b.b.Get());
+            }
+            else
+            {
+                const UnaryExpression& u = std::get<UnaryExpression>(e);
+                View(u.vec);
+                Pod((uint8_t)u.exprType);
+                Write(u.a.Get());
+            }
+        }
+
+        void Write(const Statement& s)
+        {
+            Pod((uint8_t)s.index());
+            Write(GetStatementType(s));
+            if (std::holds_alternative<SingleStatement>(s))
+            {
+                Write(std::get<SingleStatement>(s).expr.Get());
+            }
+            else if (std::holds_alternative<ScopeStatement>(s))
+            {
+                const ScopeStatement& scope = std::get<ScopeStatement>(s);
+                Count(scope.vec.size());
+                for (const AstRef<Statement>& i : scope.vec) Write(i.Get());
+                Pod(scope.stackBegin);
+                Pod(scope.stackEnd);
+            }
+            else if (std::holds_alternative<ForStatement>(s))
+            {
+                const ForStatement& f = std::get<ForStatement>(s);
+                Write(f.cond1.Get());
+                Write(f.cond2.Get());
+                Write(f.cond3.Get());
+                Write(f.contents.Get());
+            }
+            else if (std::holds_alternative<WhileStatement>(s))
+            {
+                Write(std::get<WhileStatement>(s).condition.Get());
+                Write(std::get<WhileStatement>(s).contents.Get());
+            }
+            else if (std::holds_alternative<IfStatement>(s))
+            {
+                Write(std::get<IfStatement>(s).condition.Get());
+                Write(std::get<IfStatement>(s).contents.Get());
+            }
+            else
+            {
+                Write(std::get<ReturnStatement>(s).expr.Get());
+            }
+        }
+
+        void Write(const TokenStream& t, const SymbolTable& symbols)
+        {
+            Count(symbols.names.size());
+            for (const std::string& name : symbols.names) String(name);
+
+            PodVector(t.types);
+            Varints(t.offsets, true);
+            Varints(t.lengths, false);
+            Varints(t.symbols, false);
+            PodVector(t.integers);
+            PodVector(t.decimals);
+            Varints(t.lineStarts, true);
+            Pod(t.firstLine);
+            for (int i = 0; i < t.Size(); i++)
+            {
+                if (t.types[i] == TokenType::StringLiteral) out.append(t.literals.get() + t.offsets[i] + 1, t.lengths[i]);
+            }
+        }
+    };
+
+    // The reverse of Writer. Anything out of range clears ok and reads as zero, and the caller throws the result away.
+    struct Reader
+    {
+        std::string_view in;
+        size_t pos = 0;
+        bool ok = true;
+        const TokenStream& tokens;
+        std::vector<std::shared_ptr<LazyLambda>> lazies;
+        // Every variable past a context is named by a token of its own, so no stack index can reach the size of the largest
+        // context read so far plus the number of tokens. The module's context comes before its statements.
+        size_t stackLimit = 0;
+
+        Reader(std::string_view in, const TokenStream& tokens) : in(in), tokens(tokens) {}
+
+        template<typename T> T Pod()
+        {
+            T v{};
+            if (in.size() - pos < sizeof(T))
+            {
+                ok = false;
+                return v;
+            }
+            std::memcpy(&v, in.data() + pos, sizeof(T));
+            pos += sizeof(T);
+            return v;
+        }
+
+        bool Bool()
+        {
+            uint8_t b = Pod<uint8_t>();
+            if (b > 1) ok = false;
+            return b == 1;
+        }
+
+        // A count of elements at least minSize bytes each, which has to fit in what is left.
+        size_t Count(size_t minSize = 1)
+        {
+            size_t n = Pod<uint32_t>();
+            if (n > (in.size() - pos) / minSize)
+            {
+                ok = false;
+                return 0;
+            }
+            return n;
+        }
+
+        std::string String()
+        {
+            size_t n = Count();
+            std::string ret(in.substr(pos, n));
+            pos += n;
+            return ret;
+        }
+
+        template<typename T> void PodVector(std::vector<T>& v)
+        {
+            v.resize(Count(sizeof(T)));
+            if (!v.empty()) std::memcpy(v.data(), in.data() + pos, v.size() * sizeof(T));
+            pos += v.size() * sizeof(T);
+        }
+
+        void Varints(std::vector<uint32_t>& v, bool delta)
+        {
+            v.resize(Count());
+            uint32_t previous = 0;
+            for (uint32_t& i : v)
+            {
+                uint32_t x = 0;
+                for (int shift = 0; ok; shift += 7)
+                {
+                    uint8_t b = Pod<uint8_t>();
+                    if (shift > 28) ok = false;
+                    else x |= (uint32_t)(b & 0x7f) << shift;
+                    if (!(b & 0x80)) break;
+                }
+                i = delta ? previous + x : x;
+                previous = i;
+            }
+        }
+
+        // A position on the variable stack, which has to be in [lowest, end).
+        int StackIndex(int lowest, size_t end)
+        {
+            int i = Pod<int>();
+            if (i < lowest || (i >= 0 && (size_t)i >= end)) ok = false;
+            return ok ? i : lowest;
+        }
+
+        VectorView<Token> View()
+        {
+            uint32_t begin = Pod<uint32_t>();
+            if (begin >= (uint32_t)tokens.Size()) ok = false;
+            return { tokens, ok ? (int)begin : 0 };
+        }
+
+        // A choice of variant or enum, which has to be below end.
+        template<typename T> T Kind(T end)
+        {
+            uint8_t k = Pod<uint8_t>();
+            if (k >= (uint8_t)end) ok = false;
+            return ok ? (T)k : (T)0;
+        }
+
+        TypeList Types()
+        {
+            TypeList ret;
+            for (size_t n = Count(); ok && ret.size() < n;) ret.push_back({ ReadType() });
+            return ret;
+        }
+
+        // Set after construction, as the constructors would compare the values, which can parse lazy bodies, and they were
+        // written as they ended up anyway, even with fewer than two left.
+        template<typename T> Type Values()
+        {
+            T t{ { { AtomicType::Error }, { AtomicType::Void } } };
+            t.values = Types();
+            return t;
+        }
+
+        Type ReadType()
+        {
+            switch (Kind<uint8_t>(std::variant_size_v<Type>))
+            {
+            case 0: return Kind(AtomicType(ATOMIC_TYPE_COUNT));
+            case 1: return Values<UnionType>();
+            case 2: return Values<OverloadType>();
+            case 3: return Values<RecordType>();
+            }
+
+            Type arg = ReadType();
+            Type ret = ReadType();
+            LambdaType l = LambdaType{ { std::move(arg) }, { AtomicType::Error } };
+            l.ret = { std::move(ret) };  // the constructor makes it Template for template lambdas, which is what was written anyway
+
+            l.temp.reset();
+            if (Bool())
+            {
+                TemplateLambda temp;
+                temp.instantiatedArgs = Types();
+                for (size_t n = Count(); ok && temp.definitions.size() < n;)
+                {
+                    VectorView<Token> v = View();
+                    temp.definitions.push_back({ v, { ReadContext() } });
+                }
+                for (size_t n = Count(); ok && temp.returnTypes.size() < n;) temp.returnTypes.push_back({ ReadReturnTypes() });
+                l.temp = std::move(temp);
+            }
+
+            if (Bool()) l.lazy = ReadLazy();
+            return l;
+        }
+
+        ReturnTypeSet ReadReturnTypes()
+        {
+            ReturnTypeSet r;
+            for (size_t n = Count(); ok && r.types.size() < n;) r.types.push_back(ReadType());
+            r.isOptional = Bool();
+            return r;
+        }
+
+        std::vector<ErrorOutput> ReadErrors()
+        {
+            std::vector<ErrorOutput> errors;
+            for (size_t n = Count(); ok && errors.size() < n;)
+            {
+                std::string msg = String();
+                errors.push_back({ std::move(msg), Pod<TextPosition>() });
+            }
+            return errors;
+        }
+
+        SharedTypedefs ReadTypedefs()
+        {
+            std::map<SymbolId, Type> typedefs;
+            for (size_t i = 0, n = Count(); ok && i < n; i++)
+            {
+                SymbolId name = Pod<SymbolId>();
+                typedefs[name] = ReadType();
+            }
+            return std::make_shared<const std::map<SymbolId, Type>>(std::move(typedefs));
+        }
+
+        ParsingContext ReadContext()
+        {
+            ParsingContext ctx;
+            size_t n = Count();
+            stackLimit = std::max(stackLimit, n + tokens.Size());
+            while (ok && ctx.varStack.size() < n)
+            {
+                SymbolId name = Pod<SymbolId>();
+                ctx.varStack.push_back({ name, ReadType() });
+            }
+            ctx.typedefs = ReadTypedefs();
+            ctx.errors = ReadErrors();
+            ctx.lazyLambdas = Bool();
+            return ctx;
+        }
+
+        std::shared_ptr<LazyLambda> ReadLazy()
+        {
+            uint32_t index = Pod<uint32_t>();
+            if (index != NEW_LAZY)
+            {
+                if (index < lazies.size()) return lazies[index];
+                ok = false;
+                return nullptr;
+            }
+
+            VectorView<Token> v = View();
+            std::shared_ptr<LazyLambda> lazy = std::make_shared<LazyLambda>(LazyLambda{ v, (size_t)Pod<uint64_t>() });
+            if (lazy->stackSize > stackLimit)
+            {
+                ok = false;
+                lazy->stackSize = 0;
+            }
+            for (size_t n = Count(); ok && lazy->captured.size() < n;)
+            {
+                int stackIndex = StackIndex(0, lazy->stackSize);
+                SymbolId name = Pod<SymbolId>();
+                lazy->captured.push_back({ stackIndex, { name, ReadType() } });
+            }
+            lazy->typedefs = ReadTypedefs();
+            lazy->parsed = Bool();
+            if (Bool()) lazy->body = AstRef<Statement>(ReadStatement());
+            lazy->ret = ReadType();
+            lazy->errors = ReadErrors();
+            lazy->reported = Bool();
+            lazies.push_back(lazy);
+            return lazy;
+        }
+
+        Expression ReadExpression()
+        {
+            uint8_t kind = Kind<uint8_t>(std::variant_size_v<Expression>);
+            Type type = ReadType();
+            VectorView<Token> v = View();
+            if (!ok) return LiteralExpression{ AtomicType::Error, v };
+
+            switch (kind)
+            {
+            case 0: return LiteralExpression{ std::move(type), v };
+            case 1: return VariableExpression{ std::move(type), v, StackIndex(-1, stackLimit) };
+            case 2:
+            {
+                Expression args = ReadExpression();
+                Statement body = ReadStatement();
+                return LambdaExpression{ std::move(type), v, { std::move(args) }, { std::move(body) } };
+            }
+            case 3:
+            {
+                MultiExpressionType exprType = Kind(MultiExpressionType(MULTI_EXPRESSION_TYPE_COUNT));
+                ExpressionList elements;
+                for (size_t n = Count(); ok && elements.size() < n;) elements.push_back(ReadExpression());
+                return MultiExpression{ std::move(type), v, exprType, std::move(elements) };
+            }
+            case 4:
+            {
+                BinaryExpressionType exprType = Kind(BinaryExpressionType(BINARY_EXPRESSION_TYPE_COUNT));
+                Expression a = ReadExpression();
+                Expression b = ReadExpression();
+                return BinaryExpression{ std::move(type), v, exprType, { std::move(a) }, { std::move(b) } };
+            }
+            default:
+            {
+                UnaryExpressionType exprType = Kind(UnaryExpressionType(UNARY_EXPRESSION_TYPE_COUNT));
+                Expression a = ReadExpression();
+                return UnaryExpression{ std::move(type), v, exprType, { std::move(a) } };
+            }
+            }
+        }
+
+        Statement ReadStatement()
+        {
+            uint8_t kind = Kind<uint8_t>(std::variant_size_v<Statement>);
+            ReturnTypeSet type = ReadReturnTypes();
+            if (!ok) return SingleStatement{ { LiteralExpression{ AtomicType::Error, { tokens, 0 } } } };
+
+            switch (kind)
+            {
+            case 0: return SingleStatement{ { ReadExpression() }, std::move(type) };
+            case 1:
+            {
+                std::vector<AstRef<Statement>> vec;
+                for (size_t n = Count(); ok && vec.size() < n;) vec.push_back(ReadStatement());
+                int stackBegin = StackIndex(0, stackLimit + 1);
+                return ScopeStatement{ std::move(vec), std::move(type), stackBegin, StackIndex(stackBegin, stackLimit + 1) };
+            }
+            case 2:
+            {
+                Expression cond1 = ReadExpression();
+                Expression cond2 = ReadExpression();
+                Expression cond3 = ReadExpression();
+                Statement contents = ReadStatement();
+                return ForStatement{ { std::move(cond1) }, { std::move(cond2) }, { std::move(cond3) }, { std::move(contents) }, std::move(type) };
+            }
+            case 3:
+            {
+                Expression condition = ReadExpression();
+                Statement contents = ReadStatement();
+                return WhileStatement{ { std::move(condition) }, { std::move(contents) }, std::move(type) };
+            }
+            case 4:
+            {
+                Expression condition = ReadExpression();
+                Statement contents = ReadStatement();
+                return IfStatement{ { std::move(condition) }, { std::move(contents) }, std::move(type) };
+            }
+            default: return ReturnStatement{ { ReadExpression() }, std::move(type) };
+            }
+        }
+
+        void ReadTokens(TokenStream& t, SymbolTable& symbols)
+        {
+            size_t names = Count();
+            for (size_t i = 0; ok && i < names; i++)
+            {
+                if (symbols.Intern(String()) != i) ok = false;  // the keywords come first in both
+            }
+
+            PodVector(t.types);
+            Varints(t.offsets, true);
+            Varints(t.lengths, false);
+            Varints(t.symbols, false);
+            PodVector(t.integers);
+            PodVector(t.decimals);
+            Varints(t.lineStarts, true);
+            t.firstLine = Pod<int>();
+
+            size_t n = t.types.size();
+            if (t.offsets.size() != n || t.lengths.size() != n || t.symbols.size() != n || n == 0 || t.types.back() != TokenType::EndOfFile)
+            {
+                ok = false;
+                return;
+            }
+            for (size_t i = 0; ok && i < n; i++)
+            {
+                if (t.types[i] == TokenType::EndOfFile) continue;
+                if ((size_t)t.offsets[i] + t.lengths[i] + (t.types[i] == TokenType::StringLiteral) > t.source.size()) ok = false;  // past the quote
+                else if (t.types[i] == TokenType::StringLiteral)
+                {
+                    if (!t.literals) t.literals = std::make_unique<char[]>(t.source.size());
+                    if (in.size() - pos < t.lengths[i]) ok = false;
+                    else std::memcpy(t.literals.get() + t.offsets[i] + 1, in.data() + pos, t.lengths[i]);
+                    pos += ok ? t.lengths[i] : 0;
+                }
+                else if (t.types[i] > TokenType::EndOfFile || (t.types[i] == TokenType::Text && t.symbols[i] >= names)) ok = false;
+                else if (t.types[i] == TokenType::Integer && t.symbols[i] >= t.integers.size()) ok = false;
+                else if (t.types[i] == TokenType::Decimal && t.symbols[i] >= t.decimals.size()) ok = false;
+                else if (t.types[i] == TokenType::Symbol && t.symbols[i] > (SymbolId)SymbolKind::OrOr) ok = false;
+            }
+        }
+    };
+
+    uint64_t Fnv1a(std::string_view bytes, uint64_t hash = 0xcbf29ce484222325)
+    {
+        for (unsigned char c : bytes)
+        {
+            hash ^= c;
+            hash *= 0x100000001b3;
+        }
+        return hash;
+    }
+}
+
+void WriteModuleTiming(std::ostream& out, const ModuleTiming& timing)
+{
+    out << "read " << timing.readMs << " ms, ";
+    if (timing.cacheHit)
+    {
+        out << "cache hit, loaded in " << timing.cacheMs << " ms\n";
+        return;
+    }
+    out << "lexed " << timing.lexMs << " ms, parsed " << timing.parseMs << " ms, ";
+    if (timing.cacheWritten) out << "cache miss, written in " << timing.cacheMs << " ms\n";
+    else out << "not cached\n";
+}
+
+std::unique_ptr<Module> ParseModule(std::string source, const SymbolTable& symbols, const ParsingContext& ctx, ModuleTiming* timing, ThreadPool* pool, int minParallelTokens)
+{
+    std::unique_ptr<Module> m = std::make_unique<Module>();
+    m->source = std::move(source);
+    m->ctx = ctx;
+    for (const std::string& name : symbols.names) m->symbols.Intern(name);
+
+    auto begin = std::chrono::steady_clock::now();
+    m->tokens = Tokenize(m->source, m->symbols);
+    if (timing) timing->lexMs = MsSince(begin);
+
+    begin = std::chrono::steady_clock::now();
+    int definiteReturns = 0;
+    bool parallel = pool && ParseStatementsParallel(m->tokens, m->ctx, m->statements, *pool, minParallelTokens);
+    for (int i = 0; !parallel && m->tokens[i].type != TokenType::EndOfFile;)
+    {
+        if (definiteReturns == 1)
+        {
+            m->ctx.errors.push_back({ "Unreachable code (already returned).", m->tokens.GetPosition(i) });
+        }
+
+        Statement s = SingleStatement{ { LiteralExpression{ AtomicType::Error, { m->tokens, i } } } };
+        int consumed = 0;
+        if (!ParseStatement({ m->tokens, i }, m->ctx, s, consumed))
+        {
+            m->parsed = false;
+            break;
+        }
+        if (!GetStatementType(s).isOptional) definiteReturns++;
+        m->statements.push_back(std::move(s));
+        i += consumed;
+    }
+    if (timing) timing->parseMs = MsSince(begin);
+
+    return m;
+}
+
+std::optional<uint64_t> ModuleKey(std::string_view source, const SymbolTable& symbols, const ParsingContext& ctx)
+{
+    TokenStream none;
+    Writer w(none);
+    w.Pod(COMPILER_VERSION);
+    w.Pod((uint64_t)source.size());
+    w.Count(symbols.names.size());
+    for (const std::string& name : symbols.names) w.String(name);
+    w.Write(ctx);
+    if (!w.ok) return std::nullopt;
+    return Fnv1a(source, Fnv1a(w.out));
+}
+
+std::string SerializeModule(const Module& m, uint64_t key)
+{
+    Writer w(m.tokens);
+    w.Pod(CACHE_MAGIC);
+    w.Pod(BYTE_ORDER_MARK);
+    w.Pod(COMPILER_VERSION);
+    w.Pod(key);
+
+    w.Write(m.tokens, m.symbols);
+    w.Write(m.ctx);
+    w.Count(m.statements.size());
+    for (const AstRef<Statement>& s : m.statements) w.Write(s.Get());
+    w.Pod(m.parsed);
+
+    return w.ok ? std::move(w.out) : std::string();
+}
+
+std::unique_ptr<Module> DeserializeModule(std::string_view bytes, std::string source, uint64_t key)
+{
+    std::unique_ptr<Module> m = std::make_unique<Module>();
+    m->source = std::move(source);
+    m->tokens.source = m->source;
+
+    Reader r(bytes, m->tokens);
+    if (r.Pod<uint32_t>() != CACHE_MAGIC || r.Pod<uint32_t>() != BYTE_ORDER_MARK || r.Pod<uint32_t>() != COMPILER_VERSION || r.Pod<uint64_t>() != key) return nullptr;
+
+    r.ReadTokens(m->tokens, m->symbols);
+    if (!r.ok) return nullptr;  // the nodes check their views against the tokens
+    m->ctx = r.ReadContext();
+    for (size_t n = r.Count(); r.ok && m->statements.size() < n;) m->statements.push_back(r.ReadStatement());
+    m->parsed = r.Bool();
+
+    if (!r.ok || r.pos != bytes.size()) return nullptr;
+    return m;
+}
+
+std::unique_ptr<Module> LoadModule(const std::filesystem::path& path, const SymbolTable& symbols, const ParsingContext& ctx, const std::filesystem::path& cacheDir, ModuleTiming* timing, ThreadPool* pool)
+{
+    ModuleTiming t;
+    auto begin = std::chrono::steady_clock::now();
+    std::ifstream file(path, std::ios::binary);
+    Assert(file.good(), "Could not open " + path.string() + ".");
+    std::stringstream contents;
+    contents << file.rdbuf();
+    std::string source = contents.str();
+    t.readMs = MsSince(begin);
+
+    std::optional<uint64_t> key = ModuleKey(source, symbols, ctx);
+    std::filesystem::path cachePath = path;
+    if (key.has_value())
+    {
+        if (cacheDir.empty()) cachePath += ".cache";
+        else
+        {
+            std::ostringstream name;
+            name << std::hex << key.value() << ".cache";
+            cachePath = cacheDir / name.str();
+        }
+
+        begin = std::chrono::steady_clock::now();
+        std::ifstream cached(cachePath, std::ios::binary);
+        if (cached.good())
+        {
+            std::stringstream bytes;
+            bytes << cached.rdbuf();
+            std::string b = bytes.str();
+            t.readMs += MsSince(begin);
+
+            begin = std::chrono::steady_clock::now();
+            std::unique_ptr<Module> m = DeserializeModule(b, source, key.value());
+            if (m)
+            {
+                t.cacheHit = true;
+                t.cacheMs = MsSince(begin);
+                if (timing) *timing = t;
+                return m;
+            }
+        }
+    }
+
+    std::unique_ptr<Module> m = ParseModule(std::move(source), symbols, ctx, &t, pool);
+
+    if (key.has_value())
+    {
+        begin = std::chrono::steady_clock::now();
+        std::string bytes = SerializeModule(*m, key.value());
+        if (!bytes.empty())
+        {
+            // Written under another name first, so that a reader never sees half a file.
+            std::error_code ec;
+            if (!cacheDir.empty()) std::filesystem::create_directories(cacheDir, ec);
+            std::filesystem::path temp = cachePath;
+            temp += ".tmp";
+            {
+                std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+                out.write(bytes.data(), bytes.size());
+                t.cacheWritten = out.good();
+            }
+            if (t.cacheWritten) std::filesystem::rename(temp, cachePath, ec);
+            t.cacheWritten = t.cacheWritten && !ec;
+            if (!t.cacheWritten) std::filesystem::remove(temp, ec);
+        }
+        t.cacheMs = MsSince(begin);
+    }
+
+    if (timing) *timing = t;
+    return m;
+}
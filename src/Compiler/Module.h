@@ -0,0 +1,67 @@
+#pragma once
+#include "ParallelParser.h"
+#include "Parser.h"
+#include <cstdint>
+#include <filesystem>
+#include <iosfwd>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class ThreadPool;
+
+// Bump this whenever the lexer, parser or type checker change what they make of a source, or the cache format changes, so that
+// modules cached by an older compiler are compiled again instead of loaded.
+constexpr uint32_t COMPILER_VERSION = 3;
+
+// A source file of top level statements, lexed and parsed like the inside of a scope. The tokens view source and the nodes are in
+// the AstArena that was active when the module was made or loaded, so a module stays where it is made, and is only used with that
+// arena active.
+struct Module
+{
+    std::string source;
+    SymbolTable symbols;
+    TokenStream tokens;
+    ParsingContext ctx;  // as the last statement left it, with every error
+    std::vector<AstRef<Statement>> statements;
+    bool parsed = true;  // false if a statement failed to parse, in which case statements ends before it
+
+    Module() = default;
+    Module(const Module&) = delete;
+    Module& operator=(const Module&) = delete;
+};
+
+// How long each step of getting a module took, in milliseconds, and whether the cache was used.
+struct ModuleTiming
+{
+    bool cacheHit = false;
+    bool cacheWritten = false;
+    double readMs = 0;  // the source, and the cache file on a hit
+    double lexMs = 0;
+    double parseMs = 0;
+    double cacheMs = 0;  // loading the cached module on a hit, writing it otherwise
+};
+
+void WriteModuleTiming(std::ostream& out, const ModuleTiming& timing);
+
+// The names in symbols are interned into the module's own table first, in the same order, so that the ids ctx uses keep naming
+// the same things. With a pool, statements that are independent of each other are parsed at the same time on it (see
+// ParseStatementsParallel, which is also what minParallelTokens is passed to), which makes the same module.
+std::unique_ptr<Module> ParseModule(std::string source, const SymbolTable& symbols = {}, const ParsingContext& ctx = {}, ModuleTiming* timing = nullptr, ThreadPool* pool = nullptr, int minParallelTokens = MIN_PARALLEL_PARSE_TOKENS);
+
+// Identifies what compiling source from symbols and ctx makes: a hash of all three and the compiler version. There is none if ctx
+// holds types that cannot be serialized (see SerializeModule).
+std::optional<uint64_t> ModuleKey(std::string_view source, const SymbolTable& symbols, const ParsingContext& ctx);
+
+// A compact binary form of the tokens, nodes and types of a module, without its source. It is empty if the module cannot be
+// written, which happens when a type or node views tokens of a stream other than the module's own.
+std::string SerializeModule(const Module& m, uint64_t key);
+
+// Null if bytes were not written by this compiler version for this key, or are damaged. The source has to be the one it was made from.
+std::unique_ptr<Module> DeserializeModule(std::string_view bytes, std::string source, uint64_t key);
+
+// Reads and compiles the file at path, unless a module cached with the same key can be loaded instead. Cache files are kept next
+// to the source, or in cacheDir if one is given, where they are named by key so that several versions of a file can be kept.
+std::unique_ptr<Module> LoadModule(const std::filesystem::path& path, const SymbolTable& symbols = {}, const ParsingContext& ctx = {}, const std::filesystem::path& cacheDir = {}, ModuleTiming* timing = nullptr, ThreadPool* pool = nullptr);
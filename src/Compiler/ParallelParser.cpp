@@ -0,0 +1,362 @@
+#include "ParallelParser.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <atomic>
+#include <iterator>
+#include <memory>
+#include <numeric>
+#include <optional>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace
+{
+    constexpr SymbolId KEYWORD_COUNT = (SymbolId)Keyword::Bool + 1;
+
+    // The character of a one character symbol, or 0. Only brackets and semicolons matter here, and those are all single characters.
+    inline char SymbolChar(const Token& t) { return t.type == TokenType::Symbol && t.value.size() == 1 ? t.value[0] : 0; }
+    inline bool Opens(char c) { return c == '(' || c == '[' || c == '{'; }
+    inline bool Closes(char c) { return c == ')' || c == ']' || c == '}'; }
+
+    // One past the bracket that closes the one at i, or -1 if there is none.
+    int MatchBracket(const TokenStream& tokens, int i)
+    {
+        int depth = 0;
+        for (; tokens[i].type != TokenType::EndOfFile; i++)
+        {
+            char c = SymbolChar(tokens[i]);
+            if (Opens(c)) depth++;
+            else if (Closes(c) && --depth == 0) return i + 1;
+        }
+        return -1;
+    }
+
+    // One past the last token of the statement that starts at i, or -1 if that cannot be told from the brackets.
+    int StatementEnd(const TokenStream& tokens, int i)
+    {
+        Token t = tokens[i];
+        if (SymbolChar(t) == '{') return MatchBracket(tokens, i);
+        if (t.type == TokenType::Text && (t.symbol == (SymbolId)Keyword::If || t.symbol == (SymbolId)Keyword::For || t.symbol == (SymbolId)Keyword::While))
+        {
+            if (SymbolChar(tokens[i + 1]) != '(') return -1;
+            int close = MatchBracket(tokens, i + 1);
+            return close < 0 ? -1 : StatementEnd(tokens, close);
+        }
+
+        int depth = 0;
+        for (; tokens[i].type != TokenType::EndOfFile; i++)
+        {
+            char c = SymbolChar(tokens[i]);
+            if (Opens(c)) depth++;
+            else if (Closes(c) && --depth < 0) return -1;
+            else if (depth == 0 && c == ';') return i + 1;
+        }
+        return -1;
+    }
+
+    // A statement as a task parsed it, in the task's context and arena.
+    struct ParsedStatement
+    {
+        std::optional<AstRef<Statement>> statement;
+        size_t stackBefore = 0, stackAfter = 0;
+        size_t errorsBefore = 0, errorsAfter = 0;
+    };
+
+    struct Task
+    {
+        std::vector<int> statements;
+        size_t tokenCount = 0;
+        ParsingContext ctx;
+        std::unique_ptr<AstArena> arena;
+    };
+
+    // Moves the nodes of one statement out of a task's arena into the active one, moving the stack indices in them from where
+    // they are in the task's context to where they would be in a context that every statement before went into.
+    struct Relocation
+    {
+        const Task& task;
+        int statement;
+        const std::vector<ParsedStatement>& parsed;
+        const std::vector<size_t>& stackBefore;  // of each statement, in that context
+        size_t base;  // the size of the context before any statement
+
+        // Indices below the statement's own variables are those of the context from before, or of variables of an earlier
+        // statement of the same task, which starts where the one before it in the task ended.
+        int stackIndex(int index) const
+        {
+            if (index < (int)base) return index;
+            int owner = statement;
+            if (index < (int)parsed[statement].stackBefore)
+            {
+                owner = *std::upper_bound(task.statements.begin(), task.statements.end(), index, [&](int i, int s) { return i < (int)parsed[s].stackAfter; });
+            }
+            return index - (int)parsed[owner].stackBefore + (int)stackBefore[owner];
+        }
+
+        AstRef<Expression> Move(AstRef<Expression> ref)
+        {
+            std::optional<Expression> taken;
+            {
+                AstArena::Use use(*task.arena);
+                taken = std::move(ref.Get());
+            }
+            Expression& e = taken.value();
+
+            if (std::holds_alternative<VariableExpression>(e))
+            {
+                int& index = std::get<VariableExpression>(e).stackIndex;
+                if (index != -1) index = stackIndex(index);
+            }
+            else if (std::holds_alternative<LambdaExpression>(e))
+            {
+                std::get<LambdaExpression>(e).args = Move(std::get<LambdaExpression>(e).args);
+                std::get<LambdaExpression>(e).body = Move(std::get<LambdaExpression>(e).body);
+            }
+            else if (std::holds_alternative<MultiExpression>(e))
+            {
+                for (AstRef<Expression>& i : std::get<MultiExpression>(e).elements) i = Move(i);
+            }
+            else if (std::holds_alternative<BinaryExpression>(e))
+            {
+                std::get<BinaryExpression>(e).a = Move(std::get<BinaryExpression>(e).a);
+                std::get<BinaryExpression>(e).b = Move(std::get<BinaryExpression>(e).b);
+            }
+            else if (std::holds_alternative<UnaryExpression>(e))
+            {
+                std::get<UnaryExpression>(e).a = Move(std::get<UnaryExpression>(e).a);
+            }
+            return AstRef<Expression>(std::move(e));
+        }
+
+        AstRef<Statement> Move(AstRef<Statement> ref)
+        {
+            std::optional<Statement> taken;
+            {
+                AstArena::Use use(*task.arena);
+                taken = std::move(ref.Get());
+            }
+            Statement& s = taken.value();
+
+            if (std::holds_alternative<SingleStatement>(s))
+            {
+                std::get<SingleStatement>(s).expr = Move(std::get<SingleStatement>(s).expr);
+            }
+            else if (std::holds_alternative<ScopeStatement>(s))
+            {
+                ScopeStatement& scope = std::get<ScopeStatement>(s);
+                for (AstRef<Statement>& i : scope.vec) i = Move(i);
+                scope.stackBegin = stackIndex(scope.stackBegin);
+                scope.stackEnd = stackIndex(scope.stackEnd);
+            }
+            else if (std::holds_alternative<ForStatement>(s))
+            {
+                ForStatement& f = std::get<ForStatement>(s);
+                f.cond1 = Move(f.cond1);
+                f.cond2 = Move(f.cond2);
+                f.cond3 = Move(f.cond3);
+                f.contents = Move(f.contents);
+            }
+            else if (std::holds_alternative<WhileStatement>(s))
+            {
+                std::get<WhileStatement>(s).condition = Move(std::get<WhileStatement>(s).condition);
+                std::get<WhileStatement>(s).contents = Move(std::get<WhileStatement>(s).contents);
+            }
+            else if (std::holds_alternative<IfStatement>(s))
+            {
+                std::get<IfStatement>(s).condition = Move(std::get<IfStatement>(s).condition);
+                std::get<IfStatement>(s).contents = Move(std::get<IfStatement>(s).contents);
+            }
+            else
+            {
+                std::get<ReturnStatement>(s).expr = Move(std::get<ReturnStatement>(s).expr);
+            }
+            return AstRef<Statement>(std::move(s));
+        }
+    };
+}
+
+std::vector<StatementSpan> SplitStatements(const TokenStream& tokens)
+{
+    std::vector<StatementSpan> spans;
+    for (int i = 0; tokens[i].type != TokenType::EndOfFile;)
+    {
+        StatementSpan span = { i, StatementEnd(tokens, i) };
+        if (span.end < 0) return {};
+
+        std::vector<SymbolId> uncalled;
+        int braces = 0, argumentsEnd = -1;
+        Token next = tokens[span.begin];
+        for (int j = span.begin; j < span.end; j++)
+        {
+            Token t = next;
+            next = tokens[j + 1];
+            char c = SymbolChar(t);
+            if (c == '{') braces++;
+            else if (c == '}') braces--;
+            if (t.type != TokenType::Text) continue;
+            if (t.symbol == (SymbolId)Keyword::Lambda && j >= argumentsEnd && SymbolChar(next) == '(') argumentsEnd = MatchBracket(tokens, j + 1);
+            if (t.symbol < KEYWORD_COUNT) continue;
+
+            span.names.push_back(t.symbol);
+            if (braces == 0 && j >= argumentsEnd) span.outer.push_back(t.symbol);
+            if (SymbolChar(next) != '(') uncalled.push_back(t.symbol);
+        }
+        for (std::vector<SymbolId>* v : { &span.names, &span.outer, &uncalled })
+        {
+            std::sort(v->begin(), v->end());
+            v->erase(std::unique(v->begin(), v->end()), v->end());
+        }
+        std::set_difference(span.names.begin(), span.names.end(), uncalled.begin(), uncalled.end(), std::back_inserter(span.called));
+
+        spans.push_back(std::move(span));
+        i = spans.back().end;
+    }
+    return spans;
+}
+
+std::vector<int> GroupStatements(const std::vector<StatementSpan>& spans, const ParsingContext& ctx)
+{
+    // Only the variables of ctx and those made outside of braces and lambda arguments can outlive a statement. Of those, the ones
+    // of ctx that every statement only calls cannot be changed by any of them, unless they are template lambdas.
+    std::unordered_map<SymbolId, const Type*> outer;
+    for (const std::pair<SymbolId, Type>& v : ctx.varStack) outer[v.first] = &v.second;
+    std::unordered_set<SymbolId> unchangeable;
+    for (const std::pair<const SymbolId, const Type*>& v : outer)
+    {
+        if (!HasTemplateLambda(*v.second)) unchangeable.insert(v.first);
+    }
+    for (const StatementSpan& s : spans)
+    {
+        for (SymbolId name : s.outer) outer.insert({ name, nullptr });
+        for (SymbolId name : s.names)
+        {
+            if (!std::binary_search(s.called.begin(), s.called.end(), name)) unchangeable.erase(name);
+        }
+    }
+
+    std::vector<int> parent(spans.size());
+    std::iota(parent.begin(), parent.end(), 0);
+    auto root = [&](int i)
+    {
+        while (parent[i] != i) i = parent[i] = parent[parent[i]];
+        return i;
+    };
+
+    std::unordered_map<SymbolId, int> first;  // the first statement to name each variable
+    for (int i = 0; i < (int)spans.size(); i++)
+    {
+        for (SymbolId name : spans[i].names)
+        {
+            if (!outer.count(name) || unchangeable.count(name)) continue;
+            auto inserted = first.insert({ name, i });
+            if (inserted.second) continue;
+            int a = root(inserted.first->second), b = root(i);
+            parent[std::max(a, b)] = std::min(a, b);  // the root is always the group's first statement
+        }
+    }
+
+    std::vector<int> groups(spans.size());
+    std::vector<int> numbers(spans.size(), -1);
+    int count = 0;
+    for (int i = 0; i < (int)spans.size(); i++)
+    {
+        int r = root(i);
+        if (numbers[r] < 0) numbers[r] = count++;
+        groups[i] = numbers[r];
+    }
+    return groups;
+}
+
+bool ParseStatementsParallel(const TokenStream& tokens, ParsingContext& ctx, std::vector<AstRef<Statement>>& statements, ThreadPool& pool, int minTokensPerThread)
+{
+    if (ctx.lazyLambdas) return false;  // lazy bodies are parsed wherever they are first called, so they cannot be shared between tasks
+    int threads = pool.Size();
+    if (minTokensPerThread > 0 && std::thread::hardware_concurrency() > 0) threads = std::min(threads, (int)std::thread::hardware_concurrency());
+    if (threads < 2 || tokens.Size() / threads < minTokensPerThread) return false;
+    std::vector<StatementSpan> spans = SplitStatements(tokens);
+    if (spans.size() < 2) return false;
+    std::vector<int> groups = GroupStatements(spans, ctx);
+    int groupCount = *std::max_element(groups.begin(), groups.end()) + 1;
+    if (groupCount < 2) return false;
+
+    // A few tasks per thread, each with the groups that have the fewest tokens between them so far, so that a task that takes
+    // longer than the others can be made up for by the rest of the queue.
+    std::vector<std::vector<int>> members(groupCount);
+    for (int i = 0; i < (int)spans.size(); i++) members[groups[i]].push_back(i);
+    std::vector<Task> tasks(std::min(groupCount, pool.Size() * 4));
+    for (const std::vector<int>& g : members)
+    {
+        Task& t = *std::min_element(tasks.begin(), tasks.end(), [](const Task& a, const Task& b) { return a.tokenCount < b.tokenCount; });
+        for (int i : g)
+        {
+            t.statements.push_back(i);
+            t.tokenCount += spans[i].end - spans[i].begin;
+        }
+    }
+
+    std::vector<ParsedStatement> parsed(spans.size());
+    std::atomic<bool> failed = false;
+    pool.ParallelFor((int)tasks.size(), [&](int i)
+    {
+        Task& t = tasks[i];
+        std::sort(t.statements.begin(), t.statements.end());
+        t.ctx = ctx.Fork();
+        t.arena = std::make_unique<AstArena>(AstArena::Detached{});
+        AstArena::Use use(*t.arena);
+        for (int s : t.statements)
+        {
+            if (failed) return;
+            ParsedStatement& p = parsed[s];
+            p.stackBefore = t.ctx.varStack.size();
+            p.errorsBefore = t.ctx.errors.size();
+            Statement out = SingleStatement{ { LiteralExpression{ AtomicType::Error, { tokens, spans[s].begin } } } };
+            int consumed = 0;
+            bool ok = ParseStatement({ tokens, spans[s].begin }, t.ctx, out, consumed) && consumed == spans[s].end - spans[s].begin;
+            p.stackAfter = t.ctx.varStack.size();
+            p.errorsAfter = t.ctx.errors.size();
+            if (!ok)
+            {
+                failed = true;
+                return;
+            }
+            p.statement = AstRef<Statement>(std::move(out));
+        }
+    });
+    if (failed) return false;
+
+    // Where each statement's variables start in a context that every statement before it went into.
+    size_t base = ctx.varStack.size();
+    std::vector<size_t> stackBefore(spans.size());
+    size_t stackSize = base;
+    for (size_t i = 0; i < spans.size(); i++)
+    {
+        stackBefore[i] = stackSize;
+        stackSize += parsed[i].stackAfter - parsed[i].stackBefore;
+    }
+
+    std::vector<int> taskOf(spans.size());
+    for (int i = 0; i < (int)tasks.size(); i++) for (int s : tasks[i].statements) taskOf[s] = i;
+
+    int definiteReturns = 0;
+    for (int i = 0; i < (int)spans.size(); i++)
+    {
+        Task& t = tasks[taskOf[i]];
+        const ParsedStatement& p = parsed[i];
+
+        if (definiteReturns == 1)
+        {
+            ctx.errors.push_back({ "Unreachable code (already returned).", tokens.GetPosition(spans[i].begin) });
+        }
+        // The tasks are done with, so their errors are moved rather than copied. Their variables may share chunks with ctx, so
+        // those are copied, which only copies the top of each type.
+        auto errors = t.ctx.errors.begin();
+        ctx.errors.insert(ctx.errors.end(), std::make_move_iterator(errors + p.errorsBefore), std::make_move_iterator(errors + p.errorsAfter));
+        for (size_t v = p.stackBefore; v < p.stackAfter; v++) ctx.varStack.push_back(t.ctx.varStack[v]);
+
+        Relocation r = { t, i, parsed, stackBefore, base };
+        statements.push_back(r.Move(p.statement.value()));
+        if (!GetStatementType(statements.back().Get()).isOptional) definiteReturns++;
+    }
+    return true;
+}
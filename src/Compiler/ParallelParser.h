@@ -0,0 +1,35 @@
+#pragma once
+#include "Parser.h"
+#include <vector>
+
+class ThreadPool;
+
+// A top level statement, found by matching brackets without parsing it, and the names of the variables it may use.
+struct StatementSpan
+{
+    int begin;
+    int end;  // one past its last token
+    std::vector<SymbolId> names;  // sorted, without the keywords
+    std::vector<SymbolId> outer;  // those used outside of braces and lambda arguments, where a variable made outlives the statement
+    std::vector<SymbolId> called;  // those that are only ever called
+};
+
+// The top level statements of tokens, or none if they cannot be found without parsing, as when brackets do not match.
+std::vector<StatementSpan> SplitStatements(const TokenStream& tokens);
+
+// The group of each statement, numbered in order of their first statements. Statements that name the same variable of ctx or of
+// the top level are in the same group, so that each group can be parsed without the others. The exceptions are the variables of
+// ctx that are only ever called and are not template lambdas, as a call cannot change those.
+std::vector<int> GroupStatements(const std::vector<StatementSpan>& spans, const ParsingContext& ctx);
+
+// Statements are only parsed at the same time with at least this many tokens per thread, and on at least two hardware threads.
+// Below that, copying the context for every task and putting the results back together costs more than the tasks save.
+constexpr int MIN_PARALLEL_PARSE_TOKENS = 1 << 14;
+
+// Parses the top level statements of tokens as the inside of a scope, into ctx and the active arena, with the groups of statements
+// parsed at the same time on pool. Every group is parsed in a copy of ctx and an arena of its own, and the results are put back
+// together in the order of the statements, so stack indices, variables and errors come out as they would from parsing the
+// statements one after the other. Returns false without changing anything if the statements cannot be split, or if one of them
+// fails to parse, as the statements after it are not parsed at all then, or if there are fewer than minTokensPerThread tokens
+// for each thread of pool or of the machine. With 0, only the threads of pool count.
+bool ParseStatementsParallel(const TokenStream& tokens, ParsingContext& ctx, std::vector<AstRef<Statement>>& statements, ThreadPool& pool, int minTokensPerThread = MIN_PARALLEL_PARSE_TOKENS);
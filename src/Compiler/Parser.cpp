@@ -1,450 +1,544 @@
 #include "Parser.h"
 #include "Lexer.h"
 #include "Type.h"
+#include "Tracing.h"
+#include <algorithm>
 #include <variant>
 #include <iostream>
+#include <fstream>
 #include <vector>
 
-template<ExpressionParsingPrecedence T> bool IsSymbolValid(std::string val) = delete;
-template<> bool IsSymbolValid<ExpressionParsingPrecedence::Unary>(std::string val) { return val == "!" || val == "-" || val == "+"; }
-template<> bool IsSymbolValid<ExpressionParsingPrecedence::Cast>(std::string val) { return val == ":"; }
-template<> bool IsSymbolValid<ExpressionParsingPrecedence::Exponentiate>(std::string val) { return val == "^"; }
-template<> bool IsSymbolValid<ExpressionParsingPrecedence::Multiply>(std::string val) { return val == "*" || val == "/" || val == "%"; }
-template<> bool IsSymbolValid<ExpressionParsingPrecedence::Add>(std::string val) { return val == "+" || val == "-"; }
-template<> bool IsSymbolValid<ExpressionParsingPrecedence::Less>(std::string val) { return val == "<" || val == ">" || val == "<=" || val == ">="; }
-template<> bool IsSymbolValid<ExpressionParsingPrecedence::Equals>(std::string val) { return val == "==" || val == "!="; }
-template<> bool IsSymbolValid<ExpressionParsingPrecedence::Booleans>(std::string val) { return val == "||" || val == "&&"; }
-
-template<ExpressionParsingPrecedence T> BinaryExpressionType GetBinaryType(std::string val) = delete;
-template<> BinaryExpressionType GetBinaryType<ExpressionParsingPrecedence::Exponentiate>(std::string val) { return BinaryExpressionType::Exponentiate; }
-template<> BinaryExpressionType GetBinaryType<ExpressionParsingPrecedence::Multiply>(std::string val) { return val == "*" ? BinaryExpressionType::Multiply : val == "/" ? BinaryExpressionType::Divide : BinaryExpressionType::Modulus; }
-template<> BinaryExpressionType GetBinaryType<ExpressionParsingPrecedence::Add>(std::string val) { return val == "+" ? BinaryExpressionType::Add : BinaryExpressionType::Subtract; }
-template<> BinaryExpressionType GetBinaryType<ExpressionParsingPrecedence::Less>(std::string val) { return val == "<" ? BinaryExpressionType::Less : val == ">" ? BinaryExpressionType::Greater : val == "<=" ? BinaryExpressionType::LEq : BinaryExpressionType::GEq; }
-template<> BinaryExpressionType GetBinaryType<ExpressionParsingPrecedence::Equals>(std::string val) { return val == "==" ? BinaryExpressionType::Equals : BinaryExpressionType::NotEquals; }
-template<> BinaryExpressionType GetBinaryType<ExpressionParsingPrecedence::Booleans>(std::string val) { return val == "&&" ? BinaryExpressionType::BooleanAnd : BinaryExpressionType::BooleanOr; }
-
-template<ExpressionParsingPrecedence T> UnaryExpressionType GetUnaryType(std::string val) = delete;
-template<> UnaryExpressionType GetUnaryType<ExpressionParsingPrecedence::Unary>(std::string val) { return val == "!" ? UnaryExpressionType::Not : val == "-" ? UnaryExpressionType::Minus : UnaryExpressionType::Plus; };
-template<> UnaryExpressionType GetUnaryType<ExpressionParsingPrecedence::Cast>(std::string val) { return UnaryExpressionType::Cast; };
-
-#define TEMPCHECK if (t1 == AtomicType::Template || t2 == AtomicType::Template) return AtomicType::Template
-
-template<ExpressionParsingPrecedence T> Type GetBinaryReturnType(BinaryExpressionType exp, Type t1, Type t2) = delete;
-template<> Type GetBinaryReturnType<ExpressionParsingPrecedence::Exponentiate>(BinaryExpressionType exp, Type t1, Type t2) { TEMPCHECK; if (t1 == AtomicType::Integer && t2 == AtomicType::Integer) { return AtomicType::Integer; } else if (t1 == AtomicType::Double && t2 == AtomicType::Double) { return AtomicType::Double; } else { return AtomicType::Error; }; }
-template<> Type GetBinaryReturnType<ExpressionParsingPrecedence::Multiply>(BinaryExpressionType exp, Type t1, Type t2) { TEMPCHECK; if (t1 == AtomicType::Integer && t2 == AtomicType::Integer) { return AtomicType::Integer; } else if (t1 == AtomicType::Double && t2 == AtomicType::Double) { return AtomicType::Double; } else { return AtomicType::Error; }; };
-template<> Type GetBinaryReturnType<ExpressionParsingPrecedence::Add>(BinaryExpressionType exp, Type t1, Type t2) { TEMPCHECK; if (t1 == AtomicType::Integer && t2 == AtomicType::Integer) { return AtomicType::Integer; } else if (t1 == AtomicType::Double && t2 == AtomicType::Double) { return AtomicType::Double; } else if (t1 == AtomicType::String && t2 == AtomicType::String) { return AtomicType::String; } else { return AtomicType::Error; }; };
-template<> Type GetBinaryReturnType<ExpressionParsingPrecedence::Less>(BinaryExpressionType exp, Type t1, Type t2) { TEMPCHECK; if (t1 == AtomicType::Integer && t2 == AtomicType::Integer) { return AtomicType::Boolean; } else if (t1 == AtomicType::Double && t2 == AtomicType::Double) { return AtomicType::Boolean; } else { return AtomicType::Error; }; };
-template<> Type GetBinaryReturnType<ExpressionParsingPrecedence::Equals>(BinaryExpressionType exp, Type t1, Type t2) { TEMPCHECK; if (t1 == AtomicType::Error || t2 == AtomicType::Error) { return AtomicType::Error; } else if (t1 == t2) { return AtomicType::Boolean; } else { return AtomicType::Error; }; };
-template<> Type GetBinaryReturnType<ExpressionParsingPrecedence::Booleans>(BinaryExpressionType exp, Type t1, Type t2) { TEMPCHECK; if (t1 == AtomicType::Boolean && t2 == AtomicType::Boolean) { return AtomicType::Boolean; } else { return AtomicType::Error; }; };
-
-template<> Type GetBinaryReturnType<ExpressionParsingPrecedence::Cast>(BinaryExpressionType exp, Type t1, Type t2) { TEMPCHECK; if (CheckCast(t1, t2)) { return t2; } else { return AtomicType::Error; }; };
-
-template<ExpressionParsingPrecedence T> Type GetUnaryReturnType(UnaryExpressionType exp, Type t1) = delete;
-template<> Type GetUnaryReturnType<ExpressionParsingPrecedence::Unary>(UnaryExpressionType exp, Type t1)
+AstArena*& AstArena::Active()
 {
-    if (t1 == AtomicType::Template) return t1;
+    thread_local AstArena* active = nullptr;
+    return active;
+}
 
-    if (exp == UnaryExpressionType::Not)
-    {
-        if (t1 == AtomicType::Boolean) return AtomicType::Boolean;
-        else return AtomicType::Error;
-    }
-    else if (exp == UnaryExpressionType::Minus || exp == UnaryExpressionType::Plus)
-    {
-        if (t1 == AtomicType::Integer || t1 == AtomicType::Double) return t1;
-        else return AtomicType::Error;
-    }
-    else
-    {
-        return AtomicType::Error;
-    }
+AstArena::AstArena() : previous(Active())
+{
+    Active() = this;
 }
 
-const std::vector<std::string> EXPRESSION_PREC_NAMES = { "VarDef", "MultiVarDef", "Assignment", "Record", "Overload", "Booleans", "Equals", "Less", "Add", "Multiply", "Exponentiate", "Cast", "FunctionCall", "Unary", "Brackets", "Literal", "Lambda", "Variable" };
+AstArena::AstArena(Detached) : previous(nullptr), detached(true) {}
 
-struct Instrumentation
+AstArena::~AstArena()
 {
-    static int depth;
+    if (!detached) Active() = previous;
+}
 
-    ExpressionParsingPrecedence prec;
-    Instrumentation(ExpressionParsingPrecedence ep)
-        : prec(ep)
-    {
-#ifndef RUN_TESTS
-        for (int i = 0; i < depth; i++) std::cout << "  ";
-        std::cout << EXPRESSION_PREC_NAMES[(int)prec] << '\n';
-#endif
-        depth++;
-    }
-    ~Instrumentation()
-    {
-        depth--;
-    }
+AstArena& AstArena::Current()
+{
+    AstArena* active = Active();
+    if (!active) Assert(false, "No AstArena to put AST nodes in. Make one before parsing.");  // checked first, as this is on every node access
+    return *active;
+}
+
+// A binary operator, and the precedence level it binds at. A higher level binds tighter.
+struct BinaryOperator
+{
+    ExpressionParsingPrecedence level;
+    BinaryExpressionType type;
 };
 
-Type ReturnTypeSet::ToType()
+// The lexer has already worked out which operator each symbol is (see SymbolKind).
+bool GetBinaryOperator(const Token& t, BinaryOperator& out)
 {
-    if (types.size() == 0)
-    {
-        return AtomicType::Void;
+    if (t.type != TokenType::Symbol) return false;
+    switch ((SymbolKind)t.symbol)
+    {
+    case SymbolKind::OrOr: out = { ExpressionParsingPrecedence::Booleans, BinaryExpressionType::BooleanOr }; return true;
+    case SymbolKind::AndAnd: out = { ExpressionParsingPrecedence::Booleans, BinaryExpressionType::BooleanAnd }; return true;
+    case SymbolKind::EqualEqual: out = { ExpressionParsingPrecedence::Equals, BinaryExpressionType::Equals }; return true;
+    case SymbolKind::NotEqual: out = { ExpressionParsingPrecedence::Equals, BinaryExpressionType::NotEquals }; return true;
+    case SymbolKind::Less: out = { ExpressionParsingPrecedence::Less, BinaryExpressionType::Less }; return true;
+    case SymbolKind::LessEqual: out = { ExpressionParsingPrecedence::Less, BinaryExpressionType::LEq }; return true;
+    case SymbolKind::Greater: out = { ExpressionParsingPrecedence::Less, BinaryExpressionType::Greater }; return true;
+    case SymbolKind::GreaterEqual: out = { ExpressionParsingPrecedence::Less, BinaryExpressionType::GEq }; return true;
+    case SymbolKind::Plus: out = { ExpressionParsingPrecedence::Add, BinaryExpressionType::Add }; return true;
+    case SymbolKind::Minus: out = { ExpressionParsingPrecedence::Add, BinaryExpressionType::Subtract }; return true;
+    case SymbolKind::Star: out = { ExpressionParsingPrecedence::Multiply, BinaryExpressionType::Multiply }; return true;
+    case SymbolKind::Slash: out = { ExpressionParsingPrecedence::Multiply, BinaryExpressionType::Divide }; return true;
+    case SymbolKind::Percent: out = { ExpressionParsingPrecedence::Multiply, BinaryExpressionType::Modulus }; return true;
+    case SymbolKind::Caret: out = { ExpressionParsingPrecedence::Exponentiate, BinaryExpressionType::Exponentiate }; return true;
+    default: return false;
     }
-    else if (types.size() == 1 && !isOptional)
-    {
-        return types.front();
-    }
-    else
+}
+
+bool GetUnaryOperator(const Token& t, UnaryExpressionType& out)
+{
+    if (t.type != TokenType::Symbol) return false;
+    switch ((SymbolKind)t.symbol)
     {
-        std::vector<HeapAlloc<Type>> retTypes;
-        for (Type& t : types) retTypes.push_back({ t });
-        if (isOptional) retTypes.push_back({ AtomicType::Void });
-        return UnionType{ retTypes };
+    case SymbolKind::Not: out = UnaryExpressionType::Not; return true;
+    case SymbolKind::Minus: out = UnaryExpressionType::Minus; return true;
+    case SymbolKind::Plus: out = UnaryExpressionType::Plus; return true;
+    default: return false;
     }
 }
 
-int Instrumentation::depth = 0;
+inline bool IsSymbol(const Token& t, char c) { return t.type == TokenType::Symbol && t.value.size() == 1 && t.value[0] == c; }
 
-template<ExpressionParsingPrecedence T>
-bool ParseExpression(VectorView<Token> tokens, ParsingContext& ctx, Expression& outExpr, int& tokensConsumed)
+// The result types of the operators on atomic types, worked out at compile time, so that type checking one is a single load. Other
+// types go through the rules after the tables, which only Equals and Template arguments can make anything but Error of.
+namespace
 {
-    Instrumentation inst(T);
+    constexpr int ATOMIC_TYPES = (int)AtomicType::Boolean + 1;
+    constexpr int PRECEDENCE_LEVELS = (int)ExpressionParsingPrecedence::Variable + 1;
+    constexpr int UNARY_TYPES = (int)UnaryExpressionType::Plus + 1;
 
-    if (!ParseExpression<(ExpressionParsingPrecedence)((int)T + 1)>(tokens, ctx, outExpr, tokensConsumed)) return false;
+    constexpr AtomicType BinaryResult(ExpressionParsingPrecedence level, AtomicType a, AtomicType b)
+    {
+        if (a == AtomicType::Template || b == AtomicType::Template) return AtomicType::Template;
+        bool ints = a == AtomicType::Integer && b == AtomicType::Integer;
+        bool doubles = a == AtomicType::Double && b == AtomicType::Double;
+        switch (level)
+        {
+        case ExpressionParsingPrecedence::Exponentiate:
+        case ExpressionParsingPrecedence::Multiply: return ints ? AtomicType::Integer : doubles ? AtomicType::Double : AtomicType::Error;
+        case ExpressionParsingPrecedence::Add: return ints ? AtomicType::Integer : doubles ? AtomicType::Double : a == AtomicType::String && b == AtomicType::String ? AtomicType::String : AtomicType::Error;
+        case ExpressionParsingPrecedence::Less: return ints || doubles ? AtomicType::Boolean : AtomicType::Error;
+        case ExpressionParsingPrecedence::Equals: return a != AtomicType::Error && a == b ? AtomicType::Boolean : AtomicType::Error;
+        case ExpressionParsingPrecedence::Booleans: return a == AtomicType::Boolean && b == AtomicType::Boolean ? AtomicType::Boolean : AtomicType::Error;
+        default: return AtomicType::Error;
+        }
+    }
 
-    std::string val = tokens[tokensConsumed].value;
-    while (tokens[tokensConsumed].type == TokenType::Symbol && IsSymbolValid<T>(val))
+    constexpr AtomicType UnaryResult(UnaryExpressionType exp, AtomicType a)
     {
-        int consumed = 0;
-        Expression expr = LiteralExpression{ AtomicType::Error, tokens };
-        if (!ParseExpression<(ExpressionParsingPrecedence)((int)T + 1)>(tokens.SubView(tokensConsumed + 1), ctx, expr, consumed))
+        if (a == AtomicType::Template) return AtomicType::Template;
+        switch (exp)
         {
-            ctx.errors.push_back({ "Failed to parse expression.", tokens[tokensConsumed + 1].pos });
-            return false;
+        case UnaryExpressionType::Not: return a == AtomicType::Boolean ? AtomicType::Boolean : AtomicType::Error;
+        case UnaryExpressionType::Minus:
+        case UnaryExpressionType::Plus: return a == AtomicType::Integer || a == AtomicType::Double ? a : AtomicType::Error;
+        default: return AtomicType::Error;
         }
-        else
+    }
+
+    struct OperatorTables
+    {
+        AtomicType binary[PRECEDENCE_LEVELS][ATOMIC_TYPES][ATOMIC_TYPES] = {};
+        AtomicType unary[UNARY_TYPES][ATOMIC_TYPES] = {};
+
+        constexpr OperatorTables()
         {
-            BinaryExpressionType ty = GetBinaryType<T>(val);
-            Type ot = GetBinaryReturnType<T>(ty, GetExpressionType(outExpr), GetExpressionType(expr));
-            if (ot == AtomicType::Error)
+            for (int a = 0; a < ATOMIC_TYPES; a++)
             {
-                ctx.errors.push_back({ "Wrong types for '" + val + "' operation.", tokens[0].pos });
+                for (int l = 0; l < PRECEDENCE_LEVELS; l++)
+                {
+                    for (int b = 0; b < ATOMIC_TYPES; b++) binary[l][a][b] = BinaryResult((ExpressionParsingPrecedence)l, (AtomicType)a, (AtomicType)b);
+                }
+                for (int u = 0; u < UNARY_TYPES; u++) unary[u][a] = UnaryResult((UnaryExpressionType)u, (AtomicType)a);
             }
-
-            tokensConsumed += 1 + consumed;
-            outExpr = BinaryExpression{ ot, tokens, ty, { outExpr }, { expr } };
         }
-        val = tokens[tokensConsumed].value;
-    }
+    };
 
-    return true;
+    constexpr OperatorTables OPERATOR_TABLES;
+    static_assert(OPERATOR_TABLES.binary[(int)ExpressionParsingPrecedence::Add][(int)AtomicType::String][(int)AtomicType::String] == AtomicType::String, "Operator tables are wrong.");
+    static_assert(OPERATOR_TABLES.unary[(int)UnaryExpressionType::Minus][(int)AtomicType::Boolean] == AtomicType::Error, "Operator tables are wrong.");
+
+    inline bool IsTemplate(const Type& t) { return std::holds_alternative<AtomicType>(t) && std::get<AtomicType>(t) == AtomicType::Template; }
 }
 
-//    Assignment, Booleans, Equals, Add, Multiply, Exponentiate, Cast, Unary, Brackets, Literal, Variable,
+Type GetBinaryReturnType(ExpressionParsingPrecedence level, const Type& t1, const Type& t2)
+{
+    if (std::holds_alternative<AtomicType>(t1) && std::holds_alternative<AtomicType>(t2))
+    {
+        return OPERATOR_TABLES.binary[(int)level][(int)std::get<AtomicType>(t1)][(int)std::get<AtomicType>(t2)];
+    }
+    if (IsTemplate(t1) || IsTemplate(t2)) return AtomicType::Template;
+    if (level == ExpressionParsingPrecedence::Equals && t1 == t2) return AtomicType::Boolean;
+    return AtomicType::Error;
+}
 
+Type GetCastReturnType(const Type& from, const Type& to)
+{
+    if (IsTemplate(from) || IsTemplate(to)) return AtomicType::Template;
+    if (CheckCast(from, to)) return to;
+    return AtomicType::Error;
+}
 
-template<> bool ParseExpression<ExpressionParsingPrecedence::Variable>(VectorView<Token> tokens, ParsingContext& ctx, Expression& outExpr, int& tokensConsumed)
+Type GetUnaryReturnType(UnaryExpressionType exp, const Type& t1)
 {
-    Instrumentation inst(ExpressionParsingPrecedence::Variable);
+    if (std::holds_alternative<AtomicType>(t1)) return OPERATOR_TABLES.unary[(int)exp][(int)std::get<AtomicType>(t1)];
+    return AtomicType::Error;
+}
 
-    if (tokens[0].type == TokenType::Text)
+Type ReturnTypeSet::ToType() const
+{
+    if (types.size() == 0)
     {
-        for (int i = ctx.varStack.size() - 1; i >= 0; i--)
-        {
-            if (tokens[0].value == ctx.varStack[i].first)
-            {
-                outExpr = VariableExpression{ ctx.varStack[i].second, tokens, i };
-                tokensConsumed = 1;
-                return true;
-            }
-        }
-        ctx.errors.push_back({ "Unrecognized identifier: " + tokens[0].value + ".", tokens[0].pos });
-        tokensConsumed = 1;
-        outExpr = VariableExpression{ AtomicType::Error, tokens, -1 };
-        return true;
+        return AtomicType::Void;
+    }
+    else if (types.size() == 1 && !isOptional)
+    {
+        return types.front();
     }
     else
     {
-        return false;
+        TypeList retTypes;
+        retTypes.reserve(types.size() + 1);
+        for (const Type& t : types) retTypes.push_back({ t });
+        if (isOptional) retTypes.push_back({ AtomicType::Void });
+        return UnionType{ retTypes };
     }
 }
 
-template<> bool ParseExpression<ExpressionParsingPrecedence::Lambda>(VectorView<Token> tokens, ParsingContext& ctx, Expression& outExpr, int& tokensConsumed)
+// Everything from Booleans down is parsed by the functions below. Primary expressions are told apart by their first token, unary and
+// postfix operators are handled directly, and binary operators by precedence climbing, so the cost of parsing a token no longer
+// depends on how many precedence levels there are. Errors are reported exactly where the old chain of one function per level did.
+
+bool ParseVariable(VectorView<Token> tokens, ParsingContext& ctx, Expression& outExpr, int& tokensConsumed)
 {
-    Instrumentation inst(ExpressionParsingPrecedence::Lambda);
+    Instrumentation inst(ExpressionParsingPrecedence::Variable, tokensConsumed);
 
-    if (tokens[0].type == TokenType::Text && tokens[0].value == "lambda")
+    int i = ctx.FindVariable(tokens[0].symbol);
+    if (i != -1)
     {
-        if (tokens[1].type != TokenType::Symbol || tokens[1].value != "(")
-        {
-            ctx.errors.push_back({ "Lambda arguments must be enclosed by parentheses.", tokens[1].pos });
-            return false;
-        }
-        int varStackSize = ctx.varStack.size();
-        if (!ParseExpression<ExpressionParsingPrecedence::MultiVarDef>(tokens.SubView(2), ctx, outExpr, tokensConsumed))
-        {
-            ctx.errors.push_back({ "Error while parsing lambda arguments.", tokens[2].pos });
-            return false;
-        }
-        tokensConsumed += 2;
-        if (tokens[tokensConsumed].type != TokenType::Symbol || tokens[tokensConsumed].value != ")")
-        {
-            ctx.errors.push_back({ "Lambda arguments must be enclosed by parentheses.", tokens[tokensConsumed].pos });
-            return false;
-        }
-        tokensConsumed += 1;
+        outExpr = VariableExpression{ ctx.varStack[i].second, tokens, i };
+        tokensConsumed = 1;
+        return inst.Succeed();
+    }
+    ctx.errors.push_back({ "Unrecognized identifier: " + std::string(tokens[0].value) + ".", tokens.Pos(0) });
+    tokensConsumed = 1;
+    outExpr = VariableExpression{ AtomicType::Error, tokens, -1 };
+    return inst.Succeed();
+}
 
-        Statement stat = SingleStatement{ { LiteralExpression{ AtomicType::Error, tokens } } };
-        int consumed = 0;
-        if (!ParseStatement(tokens.SubView(tokensConsumed), ctx, stat, consumed))
-        {
-            ctx.errors.push_back({ "Error in lambda body.", tokens[tokensConsumed].pos });
-            return false;
-        }
-        ctx.varStack.erase(ctx.varStack.begin() + varStackSize, ctx.varStack.end());
+// The length of a lambda body in braces, up to the matching closing brace, or 0 if it is not in braces or never closed.
+int SkimBody(VectorView<Token> tokens)
+{
+    if (!IsSymbol(tokens[0], '{')) return 0;
 
-        tokensConsumed += consumed;
-        outExpr = LambdaExpression{ LambdaType{ { GetExpressionType(outExpr) }, { GetStatementType(stat).ToType() } }, tokens, { outExpr }, { stat } };
-        if (std::get<LambdaType>(GetExpressionType(outExpr)).temp.has_value())
+    int depth = 0;
+    for (int i = 0; tokens[i].type != TokenType::EndOfFile; i++)
+    {
+        if (tokens[i].type != TokenType::Symbol || tokens[i].value.size() != 1) continue;
+        switch (tokens[i].value[0])
         {
-            std::get<LambdaType>(GetExpressionType(outExpr)).temp.value().AddDefinition(tokens, ctx);
+        case '(': case '[': case '{': depth++; break;
+        case ')': case ']': case '}': if (--depth == 0) return i + 1; break;
         }
-        return true;
-    }
-    else
-    {
-        return ParseExpression<ExpressionParsingPrecedence::Variable>(tokens, ctx, outExpr, tokensConsumed);
     }
+    return 0;
 }
 
-template<> bool ParseExpression<ExpressionParsingPrecedence::Literal>(VectorView<Token> tokens, ParsingContext& ctx, Expression& outExpr, int& tokensConsumed)
+bool ParseLambda(VectorView<Token> tokens, ParsingContext& ctx, Expression& outExpr, int& tokensConsumed)
 {
-    Instrumentation inst(ExpressionParsingPrecedence::Literal);
+    Instrumentation inst(ExpressionParsingPrecedence::Lambda, tokensConsumed);
 
-    if (tokens[0].type == TokenType::Integer)
+    if (!IsSymbol(tokens[1], '('))
     {
-        outExpr = LiteralExpression{ AtomicType::Integer, tokens };
+        ctx.errors.push_back({ "Lambda arguments must be enclosed by parentheses.", tokens.Pos(1) });
+        return false;
     }
-    else if (tokens[0].type == TokenType::Decimal)
+    int varStackSize = ctx.varStack.size();
+    if (!ParseExpression<ExpressionParsingPrecedence::MultiVarDef>(tokens.SubView(2), ctx, outExpr, tokensConsumed))
     {
-        outExpr = LiteralExpression{ AtomicType::Double, tokens };
+        ctx.errors.push_back({ "Error while parsing lambda arguments.", tokens.Pos(2) });
+        return false;
+    }
+    tokensConsumed += 2;
+    if (!IsSymbol(tokens[tokensConsumed], ')'))
+    {
+        ctx.errors.push_back({ "Lambda arguments must be enclosed by parentheses.", tokens.Pos(tokensConsumed) });
+        return false;
     }
-    else if (tokens[0].type == TokenType::StringLiteral)
+    tokensConsumed += 1;
+
+    // Template lambdas are parsed again for every instantiation, which assumes that the body parsed when it was defined, so they
+    // are never skimmed.
+    bool isTemplate = ctx.lazyLambdas && LambdaType{ { GetExpressionType(outExpr) }, { AtomicType::Error } }.temp.has_value();
+    int skimmed = ctx.lazyLambdas && !isTemplate ? SkimBody(tokens.SubView(tokensConsumed)) : 0;
+    if (skimmed > 0)
     {
-        outExpr = LiteralExpression{ AtomicType::String, tokens };
+        std::shared_ptr<LazyLambda> lazy = std::make_shared<LazyLambda>(LazyLambda{ tokens.SubView(1), (size_t)varStackSize, {}, ctx.typedefs });
+        for (int i = 2; i < tokensConsumed + skimmed; i++)  // arguments can name an outer variable too, and then reuse it
+        {
+            if (tokens[i].type != TokenType::Text) continue;
+            int index = ctx.FindVariable(tokens[i].symbol);
+            if (index < 0 || index >= varStackSize) continue;  // new arguments are added again when the body is parsed
+            auto found = std::find_if(lazy->captured.begin(), lazy->captured.end(), [&](auto& c) { return c.first == index; });
+            if (found == lazy->captured.end()) lazy->captured.push_back({ index, ctx.varStack[index] });
+        }
+        ctx.PopVariables(varStackSize);
+
+        tokensConsumed += skimmed;
+        LambdaType type = LambdaType{ { GetExpressionType(outExpr) }, { AtomicType::Error } };
+        type.lazy = lazy;
+        outExpr = LambdaExpression{ std::move(type), tokens, { std::move(outExpr) }, { SingleStatement{ { LiteralExpression{ AtomicType::Error, tokens } } } } };
+        return inst.Succeed();
     }
-    else if (tokens[0].type == TokenType::Boolean)
+
+    Statement stat = SingleStatement{ { LiteralExpression{ AtomicType::Error, tokens } } };
+    int consumed = 0;
+    if (!ParseStatement(tokens.SubView(tokensConsumed), ctx, stat, consumed))
     {
-        outExpr = LiteralExpression{ AtomicType::Boolean, tokens };
+        ctx.errors.push_back({ "Error in lambda body.", tokens.Pos(tokensConsumed) });
+        return false;
     }
-    else
+    ctx.PopVariables(varStackSize);
+
+    tokensConsumed += consumed;
+    outExpr = LambdaExpression{ LambdaType{ { GetExpressionType(outExpr) }, { GetStatementType(stat).ToType() } }, tokens, { std::move(outExpr) }, { std::move(stat) } };
+    if (std::get<LambdaType>(GetExpressionType(outExpr)).temp.has_value())
     {
-        return ParseExpression<ExpressionParsingPrecedence::Lambda>(tokens, ctx, outExpr, tokensConsumed);
+        std::get<LambdaType>(GetExpressionType(outExpr)).temp.value().AddDefinition(tokens.SubView(1), ctx);
     }
-    tokensConsumed = 1;
-    return true;
+    return inst.Succeed();
 }
 
-template<> bool ParseExpression<ExpressionParsingPrecedence::Brackets>(VectorView<Token> tokens, ParsingContext& ctx, Expression& outExpr, int& tokensConsumed)
+ParsingContext LazyLambda::Context() const
 {
-    Instrumentation inst(ExpressionParsingPrecedence::Brackets);
+    // The variables the body does not name are never looked up, so they only keep the stack indices of the others where they were.
+    ParsingContext ctx;
+    ctx.varStack.resize(stackSize, { (SymbolId)Keyword::Lambda, AtomicType::Error });
+    for (const std::pair<int, std::pair<SymbolId, Type>>& c : captured) ctx.varStack.Edit(c.first) = c.second;
+    ctx.typedefs = typedefs;
+    ctx.lazyLambdas = true;
+    return ctx;
+}
 
-    if (tokens[0].type == TokenType::Symbol && tokens[0].value == "(")
-    {
-        if (!ParseExpression(tokens.SubView(1), ctx, outExpr, tokensConsumed)) return false;
-        if (tokens[tokensConsumed + 1].type != TokenType::Symbol || tokens[tokensConsumed + 1].value != ")")
-        {
-            ctx.errors.push_back({ "No matching ).", tokens[0].pos });
-            return false;
-        }
+void LazyLambda::Parse()
+{
+    if (parsed) return;
+    Assert(&AstArena::Current() == arena, "Lazy lambdas can only be parsed with the AstArena they were skimmed in active.");
+    parsed = true;
 
-        tokensConsumed += 2;
-        return true;
+    ParsingContext ctx = Context();
+    Expression args = LiteralExpression{ AtomicType::Error, tokens };
+    int consumed = 0;
+    if (!ParseExpression<ExpressionParsingPrecedence::MultiVarDef>(tokens.SubView(1), ctx, args, consumed)) Assert(false, "Failed to parse lambda arguments that were already parsed.");
+    ctx.errors.clear();  // already reported when the lambda was defined
+
+    Statement stat = SingleStatement{ { LiteralExpression{ AtomicType::Error, tokens } } };
+    int bodyConsumed = 0;
+    if (ParseStatement(tokens.SubView(consumed + 2), ctx, stat, bodyConsumed))
+    {
+        ret = GetStatementType(stat).ToType();
+        body = AstRef<Statement>(std::move(stat));
     }
     else
     {
-        return ParseExpression<ExpressionParsingPrecedence::Literal>(tokens, ctx, outExpr, tokensConsumed);
+        ctx.errors.push_back({ "Error in lambda body.", tokens.Pos(consumed + 2) });
     }
+    errors = std::move(ctx.errors);
 }
 
-template<> bool ParseExpression<ExpressionParsingPrecedence::Unary>(VectorView<Token> tokens, ParsingContext& ctx, Expression& outExpr, int& tokensConsumed)
+bool ParseBrackets(VectorView<Token> tokens, ParsingContext& ctx, Expression& outExpr, int& tokensConsumed)
 {
-    Instrumentation inst(ExpressionParsingPrecedence::Unary);
+    Instrumentation inst(ExpressionParsingPrecedence::Brackets, tokensConsumed);
 
-    std::string val = tokens[0].value;
+    if (!ParseExpression(tokens.SubView(1), ctx, outExpr, tokensConsumed)) return false;
+    if (!IsSymbol(tokens[tokensConsumed + 1], ')'))
+    {
+        ctx.errors.push_back({ "No matching ).", tokens.Pos(0) });
+        return false;
+    }
 
-    if (tokens[0].type == TokenType::Symbol && IsSymbolValid<ExpressionParsingPrecedence::Unary>(val))
+    tokensConsumed += 2;
+    return inst.Succeed();
+}
+
+// Literals, variables, lambdas and bracketed expressions.
+bool ParsePrimary(VectorView<Token> tokens, ParsingContext& ctx, Expression& outExpr, int& tokensConsumed)
+{
+    Token t = tokens[0];
+    switch (t.type)
     {
-        if (!ParseExpression<ExpressionParsingPrecedence::Unary>(tokens.SubView(1), ctx, outExpr, tokensConsumed)) return false;
-        tokensConsumed += 1;
+    case TokenType::Integer: outExpr = LiteralExpression{ AtomicType::Integer, tokens }; break;
+    case TokenType::Decimal: outExpr = LiteralExpression{ AtomicType::Double, tokens }; break;
+    case TokenType::StringLiteral: outExpr = LiteralExpression{ AtomicType::String, tokens }; break;
+    case TokenType::Boolean: outExpr = LiteralExpression{ AtomicType::Boolean, tokens }; break;
+    case TokenType::Text: return IsKeyword(t, Keyword::Lambda) ? ParseLambda(tokens, ctx, outExpr, tokensConsumed) : ParseVariable(tokens, ctx, outExpr, tokensConsumed);
+    case TokenType::Symbol: return IsSymbol(t, '(') && ParseBrackets(tokens, ctx, outExpr, tokensConsumed);
+    default: return false;
+    }
 
-        UnaryExpressionType ty = GetUnaryType<ExpressionParsingPrecedence::Unary>(val);
-        Type ot = GetUnaryReturnType<ExpressionParsingPrecedence::Unary>(ty, GetExpressionType(outExpr));
-        if (ot == AtomicType::Error)
-        {
-            ctx.errors.push_back({ "Wrong types for unary '" + val + "' operation.", tokens[0].pos });
-        }
+    Instrumentation inst(ExpressionParsingPrecedence::Literal, tokensConsumed);
+    tokensConsumed = 1;
+    return inst.Succeed();
+}
 
-        outExpr = UnaryExpression{ ot, tokens, ty, { outExpr } };
-        return true;
+// Prefix operators bind tighter than anything but a primary expression, even function calls, so -f(x) negates f before calling it.
+bool ParseUnary(VectorView<Token> tokens, ParsingContext& ctx, Expression& outExpr, int& tokensConsumed)
+{
+    UnaryExpressionType ty;
+    if (!GetUnaryOperator(tokens[0], ty)) return ParsePrimary(tokens, ctx, outExpr, tokensConsumed);
 
-    }
-    else
+    Instrumentation inst(ExpressionParsingPrecedence::Unary, tokensConsumed);
+
+    if (!ParseUnary(tokens.SubView(1), ctx, outExpr, tokensConsumed)) return false;
+    tokensConsumed += 1;
+
+    Type ot = GetUnaryReturnType(ty, GetExpressionType(outExpr));
+    if (ot == AtomicType::Error)
     {
-        return ParseExpression<ExpressionParsingPrecedence::Brackets>(tokens, ctx, outExpr, tokensConsumed);
+        ctx.errors.push_back({ "Wrong types for unary '" + std::string(tokens[0].value) + "' operation.", tokens.Pos(0) });
     }
+
+    outExpr = UnaryExpression{ std::move(ot), tokens, ty, { std::move(outExpr) } };
+    return inst.Succeed();
 }
 
-template<> bool ParseExpression<ExpressionParsingPrecedence::FunctionCall>(VectorView<Token> tokens, ParsingContext &ctx, Expression &outExpr, int &tokensConsumed)
+// At most one call, so f(1)(2) leaves the second argument list alone.
+bool ParseFunctionCall(VectorView<Token> tokens, ParsingContext &ctx, Expression &outExpr, int &tokensConsumed)
 {
-    Instrumentation inst(ExpressionParsingPrecedence::FunctionCall);
+    if (!ParseUnary(tokens, ctx, outExpr, tokensConsumed)) return false;
+    if (!IsSymbol(tokens[tokensConsumed], '(')) return true;
 
-    if (!ParseExpression<ExpressionParsingPrecedence::Unary>(tokens, ctx, outExpr, tokensConsumed)) return false;
+    Instrumentation inst(ExpressionParsingPrecedence::FunctionCall, tokensConsumed);
 
-    if (tokens[tokensConsumed].type == TokenType::Symbol && tokens[tokensConsumed].value == "(")
+    int consumed = 0;
+    Expression expr = LiteralExpression{ AtomicType::Error, tokens };
+    if (!ParseExpression(tokens.SubView(tokensConsumed + 1), ctx, expr, consumed))
     {
-        int consumed = 0;
-        Expression expr = LiteralExpression{ AtomicType::Error, tokens };
-        if (!ParseExpression(tokens.SubView(tokensConsumed + 1), ctx, expr, consumed))
-        {
-            return false;
-        }
-        else if (tokens[tokensConsumed + 1 + consumed].type != TokenType::Symbol || tokens[tokensConsumed + 1 + consumed].value != ")")
-        {
-            return false;
-        }
-        else if (!std::holds_alternative<LambdaType>(GetExpressionType(outExpr)))  // TODO: make overloads of lambdas callable
-        {
-            ctx.errors.push_back({ "Cannot call a non-lambda type.", tokens[tokensConsumed].pos });
-            GetExpressionType(outExpr) = AtomicType::Error;
-        }
-        else if (std::get<LambdaType>(GetExpressionType(outExpr)).temp.has_value())
-        {
-            if (IsTemplateType(GetExpressionType(expr)))
-            {
-                GetExpressionType(outExpr) = AtomicType::Template;
-            }
-            else
-            {
-                std::get<LambdaType>(GetExpressionType(outExpr)).temp.value().AddInstArgs(GetExpressionType(expr), ctx);
-                outExpr = BinaryExpression{ std::get<LambdaType>(GetExpressionType(outExpr)).temp.value().GetReturnType(GetExpressionType(expr)), tokens, BinaryExpressionType::FunctionCall, { outExpr }, { expr } };
-            }
-        }
-        else if (std::get<LambdaType>(GetExpressionType(outExpr)).arg.Get() != GetExpressionType(expr))
+        return false;
+    }
+    else if (!IsSymbol(tokens[tokensConsumed + 1 + consumed], ')'))
+    {
+        return false;
+    }
+    else if (!std::holds_alternative<LambdaType>(GetExpressionType(outExpr)))  // TODO: make overloads of lambdas callable
+    {
+        ctx.errors.push_back({ "Cannot call a non-lambda type.", tokens.Pos(tokensConsumed) });
+        GetExpressionType(outExpr) = AtomicType::Error;
+    }
+    else if (std::get<LambdaType>(GetExpressionType(outExpr)).temp.has_value())
+    {
+        if (IsTemplateType(GetExpressionType(expr)))
         {
-            ctx.errors.push_back({ "Invalid function arguments.", tokens[tokensConsumed].pos });
-            GetExpressionType(outExpr) = AtomicType::Error;
+            GetExpressionType(outExpr) = AtomicType::Template;
         }
         else
         {
-            outExpr = BinaryExpression{ std::get<LambdaType>(GetExpressionType(outExpr)).ret.Get(), tokens, BinaryExpressionType::FunctionCall, { outExpr }, { expr } };
+            std::get<LambdaType>(GetExpressionType(outExpr)).temp.value().AddInstArgs(GetExpressionType(expr), ctx);
+            outExpr = BinaryExpression{ std::get<LambdaType>(GetExpressionType(outExpr)).temp.value().GetReturnType(GetExpressionType(expr)), tokens, BinaryExpressionType::FunctionCall, { std::move(outExpr) }, { std::move(expr) } };
         }
-        tokensConsumed += 2 + consumed;
-        return true;
+    }
+    else if (std::get<LambdaType>(GetExpressionType(outExpr)).arg.Get() != GetExpressionType(expr))
+    {
+        ctx.errors.push_back({ "Invalid function arguments.", tokens.Pos(tokensConsumed) });
+        GetExpressionType(outExpr) = AtomicType::Error;
     }
     else
     {
-        return true;
+        const std::shared_ptr<LazyLambda>& lazy = std::get<LambdaType>(GetExpressionType(outExpr)).lazy;
+        if (lazy) ctx.ReportLazyErrors(lazy);
+        outExpr = BinaryExpression{ std::get<LambdaType>(GetExpressionType(outExpr)).Ret(), tokens, BinaryExpressionType::FunctionCall, { std::move(outExpr) }, { std::move(expr) } };
     }
+    tokensConsumed += 2 + consumed;
+    return inst.Succeed();
 }
 
-template<> bool ParseExpression<ExpressionParsingPrecedence::Cast>(VectorView<Token> tokens, ParsingContext& ctx, Expression& outExpr, int& tokensConsumed)
+// A cast (x : type) or a type check (x :: type), again at most one.
+bool ParseCast(VectorView<Token> tokens, ParsingContext& ctx, Expression& outExpr, int& tokensConsumed)
 {
-    Instrumentation inst(ExpressionParsingPrecedence::Cast);
+    if (!ParseFunctionCall(tokens, ctx, outExpr, tokensConsumed)) return false;
+    if (!IsSymbol(tokens[tokensConsumed], ':')) return true;
 
-    if (!ParseExpression<ExpressionParsingPrecedence::FunctionCall>(tokens, ctx, outExpr, tokensConsumed)) return false;
+    Instrumentation inst(ExpressionParsingPrecedence::Cast, tokensConsumed);
 
-    std::string val = tokens[tokensConsumed].value;
-    if (tokens[tokensConsumed].type == TokenType::Symbol && IsSymbolValid<ExpressionParsingPrecedence::Cast>(val))
+    if (IsSymbol(tokens[tokensConsumed + 1], ':'))  // type check
     {
-        if (tokens[tokensConsumed + 1].type == TokenType::Symbol && IsSymbolValid<ExpressionParsingPrecedence::Cast>(tokens[tokensConsumed + 1].value))  // type check
+        int consumed = 0;
+        Type ot;
+        if (!ParseType(tokens.SubView(tokensConsumed + 2), ctx, ot, consumed))
         {
-            int consumed = 0;
-            Type ot;
-            if (!ParseType(tokens.SubView(tokensConsumed + 2), ctx, ot, consumed))
-            {
-                ctx.errors.push_back({ "Failed to parse type check.", tokens[tokensConsumed + 2].pos });
-                return false;
-            }
-            else
-            {
-                if (GetExpressionType(outExpr) != ot)
-                {
-                    ctx.errors.push_back({ "Type check failed.", tokens[tokensConsumed + 2].pos });
-                    GetExpressionType(outExpr) = AtomicType::Error;
-                }
-                tokensConsumed += 2 + consumed;
-                return true;
-            }
+            ctx.errors.push_back({ "Failed to parse type check.", tokens.Pos(tokensConsumed + 2) });
+            return false;
         }
-        else  // type cast
+        else
         {
-            int consumed = 0;
-            Type ot;
-            if (ParseType(tokens.SubView(tokensConsumed + 1), ctx, ot, consumed))
-            {
-                ot = GetBinaryReturnType<ExpressionParsingPrecedence::Cast>(BinaryExpressionType::Add, GetExpressionType(outExpr), ot);
-                if (ot == AtomicType::Error)
-                {
-                    ctx.errors.push_back({ "Invalid type cast.", tokens[tokensConsumed].pos });
-                }
-
-                tokensConsumed += 1 + consumed;
-                outExpr = UnaryExpression{ ot, tokens, UnaryExpressionType::Cast, { outExpr } };
-                return true;
-            }
-            else
+            if (GetExpressionType(outExpr) != ot)
             {
-                ctx.errors.push_back({ "Failed to parse type cast.", tokens[tokensConsumed + 1].pos });
-                return false;
+                ctx.errors.push_back({ "Type check failed.", tokens.Pos(tokensConsumed + 2) });
+                GetExpressionType(outExpr) = AtomicType::Error;
             }
+            tokensConsumed += 2 + consumed;
+            return inst.Succeed();
         }
     }
-    else
+    else  // type cast
     {
-        return true;
+        int consumed = 0;
+        Type ot;
+        if (ParseType(tokens.SubView(tokensConsumed + 1), ctx, ot, consumed))
+        {
+            ot = GetCastReturnType(GetExpressionType(outExpr), ot);
+            if (ot == AtomicType::Error)
+            {
+                ctx.errors.push_back({ "Invalid type cast.", tokens.Pos(tokensConsumed) });
+            }
+
+            tokensConsumed += 1 + consumed;
+            outExpr = UnaryExpression{ std::move(ot), tokens, UnaryExpressionType::Cast, { std::move(outExpr) } };
+            return inst.Succeed();
+        }
+        else
+        {
+            ctx.errors.push_back({ "Failed to parse type cast.", tokens.Pos(tokensConsumed + 1) });
+            return false;
+        }
     }
 }
 
-template<> bool ParseExpression<ExpressionParsingPrecedence::Exponentiate>(VectorView<Token> tokens, ParsingContext& ctx, Expression& outExpr, int& tokensConsumed)
+// Parses an operand, then folds in binary operators for as long as they bind at least as tightly as minLevel. Operators are left
+// associative, except ^, whose right hand side may itself contain more ^. When the right hand side of any other operator cannot be
+// parsed, the error is reported at its start, once for every operator it was the right hand side of.
+bool ParseBinary(VectorView<Token> tokens, ParsingContext& ctx, Expression& outExpr, int& tokensConsumed, ExpressionParsingPrecedence minLevel)
 {
-    Instrumentation inst(ExpressionParsingPrecedence::Exponentiate);
+    Instrumentation inst(minLevel, tokensConsumed);
 
-    if (!ParseExpression<ExpressionParsingPrecedence::Cast>(tokens, ctx, outExpr, tokensConsumed)) return false;
+    if (!ParseCast(tokens, ctx, outExpr, tokensConsumed)) return false;
 
-    std::string val = tokens[tokensConsumed].value;
-    if (tokens[tokensConsumed].type == TokenType::Symbol && IsSymbolValid<ExpressionParsingPrecedence::Exponentiate>(val))
+    BinaryOperator op;
+    while (GetBinaryOperator(tokens[tokensConsumed], op) && op.level >= minLevel)
     {
+        std::string_view val = tokens[tokensConsumed].value;
+        bool rightAssociative = op.level == ExpressionParsingPrecedence::Exponentiate;
+        ExpressionParsingPrecedence rhsLevel = rightAssociative ? op.level : (ExpressionParsingPrecedence)((int)op.level + 1);
+
         int consumed = 0;
         Expression expr = LiteralExpression{ AtomicType::Error, tokens };
-        if (!ParseExpression<ExpressionParsingPrecedence::Exponentiate>(tokens.SubView(tokensConsumed + 1), ctx, expr, consumed)) return false;
+        if (!ParseBinary(tokens.SubView(tokensConsumed + 1), ctx, expr, consumed, rhsLevel))
+        {
+            if (!rightAssociative) ctx.errors.push_back({ "Failed to parse expression.", tokens.Pos(tokensConsumed + 1) });
+            return false;
+        }
 
-        BinaryExpressionType ty = GetBinaryType<ExpressionParsingPrecedence::Exponentiate>(val);
-        Type ot = GetBinaryReturnType<ExpressionParsingPrecedence::Exponentiate>(ty, GetExpressionType(outExpr), GetExpressionType(expr));
+        Type ot = GetBinaryReturnType(op.level, GetExpressionType(outExpr), GetExpressionType(expr));
         if (ot == AtomicType::Error)
         {
-            ctx.errors.push_back({ "Wrong types for '" + val + "' operation.", tokens[0].pos });
+            ctx.errors.push_back({ "Wrong types for '" + std::string(val) + "' operation.", tokens.Pos(0) });
         }
 
         tokensConsumed += 1 + consumed;
-        outExpr = BinaryExpression{ ot, tokens, ty, { outExpr }, { expr } };
+        outExpr = BinaryExpression{ std::move(ot), tokens, op.type, { std::move(outExpr) }, { std::move(expr) } };
     }
 
-    return true;
+    return inst.Succeed();
+}
+
+template<> bool ParseExpression<ExpressionParsingPrecedence::Booleans>(VectorView<Token> tokens, ParsingContext& ctx, Expression& outExpr, int& tokensConsumed)
+{
+    return ParseBinary(tokens, ctx, outExpr, tokensConsumed, ExpressionParsingPrecedence::Booleans);
 }
 
 template<> bool ParseExpression<ExpressionParsingPrecedence::Overload>(VectorView<Token> tokens, ParsingContext& ctx, Expression& outExpr, int& tokensConsumed)
 {
-    Instrumentation inst(ExpressionParsingPrecedence::Overload);
+    Instrumentation inst(ExpressionParsingPrecedence::Overload, tokensConsumed);
 
-    std::vector<HeapAlloc<Expression>> exprs;
-    std::vector<HeapAlloc<Type>> types;
+    ExpressionList exprs;
+    TypeList types;
     tokensConsumed = 0;
 
     do
     {
         int consumed = 0;
         if (!ParseExpression<ExpressionParsingPrecedence::Booleans>(tokens.SubView(tokensConsumed), ctx, outExpr, consumed)) return false;
-        exprs.push_back(outExpr);
         types.push_back(GetExpressionType(outExpr));
+        exprs.push_back(std::move(outExpr));
         tokensConsumed += consumed + 1;
     }
     while (tokens[tokensConsumed - 1].type == TokenType::Symbol && tokens[tokensConsumed - 1].value == "&");
@@ -452,25 +546,29 @@ template<> bool ParseExpression<ExpressionParsingPrecedence::Overload>(VectorVie
     tokensConsumed -= 1;
     if (exprs.size() != 1)
     {
-        outExpr = MultiExpression{ OverloadType{ types }, tokens, MultiExpressionType::Overload, exprs };
+        outExpr = MultiExpression{ OverloadType{ std::move(types) }, tokens, MultiExpressionType::Overload, std::move(exprs) };
     }
-    return true;
+    else
+    {
+        outExpr = std::move(exprs.front().Get());
+    }
+    return inst.Succeed();
 }
 
 template<> bool ParseExpression<ExpressionParsingPrecedence::Record>(VectorView<Token> tokens, ParsingContext& ctx, Expression& outExpr, int& tokensConsumed)
 {
-    Instrumentation inst(ExpressionParsingPrecedence::Record);
+    Instrumentation inst(ExpressionParsingPrecedence::Record, tokensConsumed);
 
-    std::vector<HeapAlloc<Expression>> exprs;
-    std::vector<HeapAlloc<Type>> types;
+    ExpressionList exprs;
+    TypeList types;
     tokensConsumed = 0;
 
     do
     {
         int consumed = 0;
         if (!ParseExpression<ExpressionParsingPrecedence::Overload>(tokens.SubView(tokensConsumed), ctx, outExpr, consumed)) return false;
-        exprs.push_back(outExpr);
         types.push_back(GetExpressionType(outExpr));
+        exprs.push_back(std::move(outExpr));
         tokensConsumed += consumed + 1;
     }
     while (tokens[tokensConsumed - 1].type == TokenType::Symbol && tokens[tokensConsumed - 1].value == ",");
@@ -478,26 +576,31 @@ template<> bool ParseExpression<ExpressionParsingPrecedence::Record>(VectorView<
     tokensConsumed -= 1;
     if (exprs.size() != 1)
     {
-        outExpr = MultiExpression{ RecordType{ types }, tokens, MultiExpressionType::Record, exprs };
+        outExpr = MultiExpression{ RecordType{ std::move(types) }, tokens, MultiExpressionType::Record, std::move(exprs) };
     }
-    return true;
+    else
+    {
+        outExpr = std::move(exprs.front().Get());
+    }
+    return inst.Succeed();
 }
 
 template<> bool ParseExpression<ExpressionParsingPrecedence::Assignment>(VectorView<Token> tokens, ParsingContext& ctx, Expression& outExpr, int& tokensConsumed)
 {
-    Instrumentation inst(ExpressionParsingPrecedence::Assignment);
+    Instrumentation inst(ExpressionParsingPrecedence::Assignment, tokensConsumed);
 
-    ParsingContext oldctx = ctx;  // vardef will mess with ctx, so we need to revert upon failure
+    ParsingCheckpoint cp = ctx.Checkpoint();  // vardef will mess with ctx, so we need to revert upon failure
 
     if (ParseExpression<ExpressionParsingPrecedence::MultiVarDef>(tokens, ctx, outExpr, tokensConsumed))
     {
         if (tokens[tokensConsumed].type == TokenType::Symbol && tokens[tokensConsumed].value == "=")
         {
+            ctx.Commit(cp);
             Expression expr = LiteralExpression{ AtomicType::Error, tokens };
             int consumed = 0;
             if (!ParseExpression<ExpressionParsingPrecedence::Assignment>(tokens.SubView(tokensConsumed + 1), ctx, expr, consumed))
             {
-                ctx.errors.push_back({ "Error while parsing assignment.", tokens[tokensConsumed].pos });
+                ctx.errors.push_back({ "Error while parsing assignment.", tokens.Pos(tokensConsumed) });
                 return false;
             }
             else
@@ -506,19 +609,19 @@ template<> bool ParseExpression<ExpressionParsingPrecedence::Assignment>(VectorV
                 {
                     if (std::get<VariableExpression>(outExpr).stackIndex == -1)
                     {
-                        ctx.errors.push_back({ "Cannot use '_' notation for single variable assignment.", tokens[0].pos });
+                        ctx.errors.push_back({ "Cannot use '_' notation for single variable assignment.", tokens.Pos(0) });
                     }
                     else
                     {
                         Type& ot2 = GetExpressionType(outExpr);
                         if (ot2 == AtomicType::Template)
                         {
-                            ctx.varStack[std::get<VariableExpression>(outExpr).stackIndex].second = GetExpressionType(expr);
+                            ctx.SetVariableType(std::get<VariableExpression>(outExpr).stackIndex, GetExpressionType(expr));
                             ot2 = GetExpressionType(expr);
                         }
                         else if (ot2 != GetExpressionType(expr))
                         {
-                            ctx.errors.push_back({ "Cannot set variable to an expression of a different type.", tokens[tokensConsumed].pos });
+                            ctx.errors.push_back({ "Cannot set variable to an expression of a different type.", tokens.Pos(tokensConsumed) });
                         }
                         else if (std::holds_alternative<LambdaType>(ot2) && std::get<LambdaType>(ot2).temp.has_value())
                         {
@@ -530,14 +633,15 @@ template<> bool ParseExpression<ExpressionParsingPrecedence::Assignment>(VectorV
                 {
                     if (!std::holds_alternative<RecordType>(GetExpressionType(expr)))
                     {
-                        ctx.errors.push_back({ "Attempted to set multiple variables with a single (non-record) expression.", tokens[tokensConsumed].pos });
+                        ctx.errors.push_back({ "Attempted to set multiple variables with a single (non-record) expression.", tokens.Pos(tokensConsumed) });
                     }
                     else
                     {
                         Type ot2 = GetExpressionType(outExpr);
+                        std::get<RecordType>(ot2).id.Set(0);  // its values are set below, so it is no longer the type it was copied from
                         if (std::get<RecordType>(ot2).values.size() != std::get<RecordType>(GetExpressionType(expr)).values.size())
                         {
-                            ctx.errors.push_back({ "Type mismatch during assignment (different number of components).", tokens[tokensConsumed].pos });
+                            ctx.errors.push_back({ "Type mismatch during assignment (different number of components).", tokens.Pos(tokensConsumed) });
                         }
                         else
                         {
@@ -549,7 +653,7 @@ template<> bool ParseExpression<ExpressionParsingPrecedence::Assignment>(VectorV
                                     int stackIndex = std::get<VariableExpression>(std::get<MultiExpression>(outExpr).elements[i].Get()).stackIndex;
                                     if (stackIndex != -1)
                                     {
-                                        ctx.varStack[stackIndex].second = std::get<RecordType>(GetExpressionType(expr)).values[i].Get();
+                                        ctx.SetVariableType(stackIndex, std::get<RecordType>(GetExpressionType(expr)).values[i].Get());
                                         std::get<RecordType>(ot2).values[i] = HeapAlloc<Type>{ ctx.varStack[stackIndex].second };
                                         isSetting = true;
                                     }
@@ -559,7 +663,7 @@ template<> bool ParseExpression<ExpressionParsingPrecedence::Assignment>(VectorV
                                     isSetting = true;
                                     if (std::get<RecordType>(ot2).values[i].Get() != std::get<RecordType>(GetExpressionType(expr)).values[i].Get())
                                     {
-                                        ctx.errors.push_back({ "Type mismatch during assignment.", tokens[tokensConsumed].pos });
+                                        ctx.errors.push_back({ "Type mismatch during assignment.", tokens.Pos(tokensConsumed) });
                                     }
                                     else if (std::holds_alternative<LambdaType>(std::get<RecordType>(ot2).values[i].Get()) && std::get<LambdaType>(std::get<RecordType>(ot2).values[i].Get()).temp.has_value())
                                     {
@@ -569,54 +673,45 @@ template<> bool ParseExpression<ExpressionParsingPrecedence::Assignment>(VectorV
                             }
                             if (!isSetting)
                             {
-                                ctx.errors.push_back({ "Cannot use '_' for every variable in assignment.", tokens[0].pos });
+                                ctx.errors.push_back({ "Cannot use '_' for every variable in assignment.", tokens.Pos(0) });
                             }
                         }
                     }
                 }
-                outExpr = BinaryExpression{ GetExpressionType(expr), tokens, BinaryExpressionType::Assignment, { outExpr }, { expr } };
+                outExpr = BinaryExpression{ GetExpressionType(expr), tokens, BinaryExpressionType::Assignment, { std::move(outExpr) }, { std::move(expr) } };
                 tokensConsumed += 1 + consumed;
-                return true;
+                return inst.Succeed();
             }
         }
     }
-    ctx = oldctx;
+    ctx.Rollback(cp);
 
-    return ParseExpression<ExpressionParsingPrecedence::Record>(tokens, ctx, outExpr, tokensConsumed);
+    return inst.Result(ParseExpression<ExpressionParsingPrecedence::Record>(tokens, ctx, outExpr, tokensConsumed));
 }
 
 
 template<> bool ParseExpression<ExpressionParsingPrecedence::VarDef>(VectorView<Token> tokens, ParsingContext& ctx, Expression& outExpr, int& tokensConsumed)
 {
-    Instrumentation inst(ExpressionParsingPrecedence::VarDef);
+    Instrumentation inst(ExpressionParsingPrecedence::VarDef, tokensConsumed);
 
     if (tokens[0].type == TokenType::Symbol && tokens[0].value == "_")
     {
         outExpr = VariableExpression{ AtomicType::Template, tokens, -1 };
         tokensConsumed = 1;
-        return true;
+        return inst.Succeed();
     }
 
     if (tokens[0].type != TokenType::Text) return false;
 
-    int stackPos = -1;
-    for (int i = ctx.varStack.size() - 1; i >= 0; i--)
-    {
-        if (tokens[0].value == ctx.varStack[i].first)
-        {
-            stackPos = i;
-            break;
-        }
-    }
+    int stackPos = ctx.FindVariable(tokens[0].symbol);
     if (stackPos == -1)
     {
-        stackPos = ctx.varStack.size();
-        ctx.varStack.push_back({ tokens[0].value, AtomicType::Template });
+        stackPos = ctx.AddVariable(tokens[0].symbol, AtomicType::Template);
     }
 
     tokensConsumed = 1;
 
-    if (tokens[1].type == TokenType::Symbol && IsSymbolValid<ExpressionParsingPrecedence::Cast>(tokens[1].value))
+    if (IsSymbol(tokens[1], ':'))
     {
         Type ot = AtomicType::Error;
         int consumed = 0;
@@ -624,57 +719,62 @@ template<> bool ParseExpression<ExpressionParsingPrecedence::VarDef>(VectorView<
 
         if (ctx.varStack[stackPos].second == AtomicType::Template)
         {
-            ctx.varStack[stackPos].second = ot;
+            ctx.SetVariableType(stackPos, ot);
         }
         else if (ctx.varStack[stackPos].second != ot)
         {
-            ctx.errors.push_back({ "Cannot redefine variable to a different type.", tokens[1].pos });
+            ctx.errors.push_back({ "Cannot redefine variable to a different type.", tokens.Pos(1) });
         }
 
         tokensConsumed += 1 + consumed;
     }
 
     outExpr = VariableExpression{ ctx.varStack[stackPos].second, tokens, stackPos };
-    return true;
+    return inst.Succeed();
 }
 
 template<> bool ParseExpression<ExpressionParsingPrecedence::MultiVarDef>(VectorView<Token> tokens, ParsingContext& ctx, Expression& outExpr, int& tokensConsumed)
 {
-    Instrumentation inst(ExpressionParsingPrecedence::MultiVarDef);
+    Instrumentation inst(ExpressionParsingPrecedence::MultiVarDef, tokensConsumed);
 
-    auto oldVS = ctx.varStack;
+    ParsingCheckpoint cp = ctx.Checkpoint();
 
-    std::vector<HeapAlloc<Type>> types;
-    std::vector<HeapAlloc<Expression>> locs;
+    TypeList types;
+    ExpressionList locs;
 
-    if (!ParseExpression<ExpressionParsingPrecedence::VarDef>(tokens, ctx, outExpr, tokensConsumed)) return false;
+    if (!ParseExpression<ExpressionParsingPrecedence::VarDef>(tokens, ctx, outExpr, tokensConsumed))
+    {
+        ctx.Commit(cp);
+        return false;
+    }
 
     types.push_back({ std::get<VariableExpression>(outExpr).type });
-    locs.push_back(outExpr);
+    locs.push_back(std::move(outExpr));
 
     while (tokens[tokensConsumed].type == TokenType::Symbol && tokens[tokensConsumed].value == ",")
     {
         int consumed = 0;
         if (!ParseExpression<ExpressionParsingPrecedence::VarDef>(tokens.SubView(tokensConsumed + 1), ctx, outExpr, consumed))
         {
-            ctx.varStack = oldVS;
+            ctx.Rollback(cp, true);  // undoes the variables, but leaves any errors in place
             return false;
         }
         types.push_back({ std::get<VariableExpression>(outExpr).type });
-        locs.push_back(outExpr);
+        locs.push_back(std::move(outExpr));
         tokensConsumed += 1 + consumed;
     }
 
+    ctx.Commit(cp);
     if (types.size() == 1)
     {
-        outExpr = locs.front().Get();
+        outExpr = std::move(locs.front().Get());
     }
     else
     {
-        outExpr = MultiExpression{ RecordType{ types }, tokens, MultiExpressionType::Variables, locs };
+        outExpr = MultiExpression{ RecordType{ std::move(types) }, tokens, MultiExpressionType::Variables, std::move(locs) };
     }
 
-    return true;
+    return inst.Succeed();
 }
 
 
@@ -696,21 +796,21 @@ template<> bool ParseStatement<StatementParsingType::Single>(VectorView<Token> t
     if (!ParseExpression(tokens, ctx, expr, tokensConsumed)) return false;
     if (tokens[tokensConsumed].type != TokenType::Symbol || tokens[tokensConsumed].value != ";")
     {
-        ctx.errors.push_back({ "Missing semicolon in statement." + tokens[tokensConsumed].value, tokens[tokensConsumed].pos });
+        ctx.errors.push_back({ "Missing semicolon in statement." + std::string(tokens[tokensConsumed].value), tokens.Pos(tokensConsumed) });
         return false;
     }
 
     tokensConsumed += 1;
-    outStatement = SingleStatement{ { expr } };  // single statements always output NoReturn, even when the underlying expression does not.
+    outStatement = SingleStatement{ { std::move(expr) } };  // single statements always output NoReturn, even when the underlying expression does not.
     return true;
 }
 
 template<> bool ParseStatement<StatementParsingType::If>(VectorView<Token> tokens, ParsingContext &ctx, Statement &outStatement, int &tokensConsumed)
 {
-    if (tokens[0].type != TokenType::Text || tokens[0].value != "if") return false;
+    if (!IsKeyword(tokens[0], Keyword::If)) return false;
     if (tokens[1].type != TokenType::Symbol || tokens[1].value != "(")
     {
-        ctx.errors.push_back({ "If statement must have parentheses around the condition.", tokens[1].pos });
+        ctx.errors.push_back({ "If statement must have parentheses around the condition.", tokens.Pos(1) });
         return false;
     }
 
@@ -719,7 +819,7 @@ template<> bool ParseStatement<StatementParsingType::If>(VectorView<Token> token
     tokensConsumed += 2;
     if (tokens[tokensConsumed].type != TokenType::Symbol || tokens[tokensConsumed].value != ")")
     {
-        ctx.errors.push_back({ "If statement must have parentheses around the condition.", tokens[tokensConsumed].pos });
+        ctx.errors.push_back({ "If statement must have parentheses around the condition.", tokens.Pos(tokensConsumed) });
         return false;
     }
     tokensConsumed += 1;
@@ -730,19 +830,20 @@ template<> bool ParseStatement<StatementParsingType::If>(VectorView<Token> token
 
     if (GetExpressionType(expr) != AtomicType::Boolean)
     {
-        ctx.errors.push_back({ "If statement conditional must be a boolean.", tokens[2].pos });
+        ctx.errors.push_back({ "If statement conditional must be a boolean.", tokens.Pos(2) });
     }
 
-    outStatement = IfStatement{ { expr }, { outStatement }, { GetStatementType(outStatement).types, true } };
+    ReturnTypeSet type = { GetStatementType(outStatement).types, true };
+    outStatement = IfStatement{ { std::move(expr) }, { std::move(outStatement) }, std::move(type) };
     return true;
 }
 
 template<> bool ParseStatement<StatementParsingType::For>(VectorView<Token> tokens, ParsingContext &ctx, Statement &outStatement, int &tokensConsumed)
 {
-    if (tokens[0].type != TokenType::Text || tokens[0].value != "for") return false;
+    if (!IsKeyword(tokens[0], Keyword::For)) return false;
     if (tokens[1].type != TokenType::Symbol || tokens[1].value != "(")
     {
-        ctx.errors.push_back({ "For statement must have parentheses around the arguments.", tokens[1].pos });
+        ctx.errors.push_back({ "For statement must have parentheses around the arguments.", tokens.Pos(1) });
         return false;
     }
 
@@ -751,7 +852,7 @@ template<> bool ParseStatement<StatementParsingType::For>(VectorView<Token> toke
     tokensConsumed += 2;
     if (tokens[tokensConsumed].type != TokenType::Symbol || tokens[tokensConsumed].value != ";")
     {
-        ctx.errors.push_back({ "For statement must have 2 semicolons to separate the arguments.", tokens[tokensConsumed].pos });
+        ctx.errors.push_back({ "For statement must have 2 semicolons to separate the arguments.", tokens.Pos(tokensConsumed) });
         return false;
     }
     tokensConsumed += 1;
@@ -762,7 +863,7 @@ template<> bool ParseStatement<StatementParsingType::For>(VectorView<Token> toke
     tokensConsumed += consumed;
     if (tokens[tokensConsumed].type != TokenType::Symbol || tokens[tokensConsumed].value != ";")
     {
-        ctx.errors.push_back({ "For statement must have 2 semicolons to separate the arguments.", tokens[tokensConsumed].pos });
+        ctx.errors.push_back({ "For statement must have 2 semicolons to separate the arguments.", tokens.Pos(tokensConsumed) });
         return false;
     }
     tokensConsumed += 1;
@@ -772,7 +873,7 @@ template<> bool ParseStatement<StatementParsingType::For>(VectorView<Token> toke
     tokensConsumed += consumed;
     if (tokens[tokensConsumed].type != TokenType::Symbol || tokens[tokensConsumed].value != ")")
     {
-        ctx.errors.push_back({ "For statement must have parentheses around the arguments.", tokens[tokensConsumed].pos });
+        ctx.errors.push_back({ "For statement must have parentheses around the arguments.", tokens.Pos(tokensConsumed) });
         return false;
     }
     tokensConsumed += 1;
@@ -782,19 +883,20 @@ template<> bool ParseStatement<StatementParsingType::For>(VectorView<Token> toke
 
     if (GetExpressionType(expr2) != AtomicType::Boolean)
     {
-        ctx.errors.push_back({ "For statement conditional must be a boolean.", tokens[2].pos });
+        ctx.errors.push_back({ "For statement conditional must be a boolean.", tokens.Pos(2) });
     }
 
-    outStatement = ForStatement{ { expr1 }, { expr2 }, { expr3 }, { outStatement }, { GetStatementType(outStatement).types, true } };
+    ReturnTypeSet type = { GetStatementType(outStatement).types, true };
+    outStatement = ForStatement{ { std::move(expr1) }, { std::move(expr2) }, { std::move(expr3) }, { std::move(outStatement) }, std::move(type) };
     return true;
 }
 
 template<> bool ParseStatement<StatementParsingType::While>(VectorView<Token> tokens, ParsingContext &ctx, Statement &outStatement, int &tokensConsumed)
 {
-    if (tokens[0].type != TokenType::Text || tokens[0].value != "while") return false;
+    if (!IsKeyword(tokens[0], Keyword::While)) return false;
     if (tokens[1].type != TokenType::Symbol || tokens[1].value != "(")
     {
-        ctx.errors.push_back({ "While statement must have parentheses around the condition.", tokens[1].pos });
+        ctx.errors.push_back({ "While statement must have parentheses around the condition.", tokens.Pos(1) });
         return false;
     }
 
@@ -803,7 +905,7 @@ template<> bool ParseStatement<StatementParsingType::While>(VectorView<Token> to
     tokensConsumed += 2;
     if (tokens[tokensConsumed].type != TokenType::Symbol || tokens[tokensConsumed].value != ")")
     {
-        ctx.errors.push_back({ "While statement must have parentheses around the condition.", tokens[tokensConsumed].pos });
+        ctx.errors.push_back({ "While statement must have parentheses around the condition.", tokens.Pos(tokensConsumed) });
         return false;
     }
     tokensConsumed += 1;
@@ -814,26 +916,28 @@ template<> bool ParseStatement<StatementParsingType::While>(VectorView<Token> to
 
     if (GetExpressionType(expr) != AtomicType::Boolean)
     {
-        ctx.errors.push_back({ "While statement conditional must be a boolean.", tokens[2].pos });
+        ctx.errors.push_back({ "While statement conditional must be a boolean.", tokens.Pos(2) });
     }
 
-    outStatement = WhileStatement{ { expr }, { outStatement }, { GetStatementType(outStatement).types, true } };
+    ReturnTypeSet type = { GetStatementType(outStatement).types, true };
+    outStatement = WhileStatement{ { std::move(expr) }, { std::move(outStatement) }, std::move(type) };
     return true;
 }
 
 template<> bool ParseStatement<StatementParsingType::Return>(VectorView<Token> tokens, ParsingContext &ctx, Statement &outStatement, int &tokensConsumed)
 {
-    if (tokens[0].type != TokenType::Text || tokens[0].value != "return") return false;
+    if (!IsKeyword(tokens[0], Keyword::Return)) return false;
     Expression expr = LiteralExpression{ AtomicType::Error, tokens };
     if (!ParseExpression(tokens.SubView(1), ctx, expr, tokensConsumed)) return false;
     tokensConsumed += 1;
     if (tokens[tokensConsumed].type != TokenType::Symbol || tokens[tokensConsumed].value != ";")
     {
-        ctx.errors.push_back({ "Missing semicolon in return statement.", tokens[tokensConsumed].pos });
+        ctx.errors.push_back({ "Missing semicolon in return statement.", tokens.Pos(tokensConsumed) });
         return false;
     }
     tokensConsumed += 1;
-    outStatement = ReturnStatement{ { expr }, { { GetExpressionType(expr) }, false } };
+    ReturnTypeSet type = { { GetExpressionType(expr) }, false };
+    outStatement = ReturnStatement{ { std::move(expr) }, std::move(type) };
     return true;
 }
 
@@ -843,7 +947,7 @@ template<> bool ParseStatement<StatementParsingType::Scope>(VectorView<Token> to
     tokensConsumed = 1;
     int stackSize = ctx.varStack.size();
 
-    std::vector<HeapAlloc<Statement>> statements;
+    std::vector<AstRef<Statement>> statements;
     std::vector<Type> returnTypes;
     int definiteReturnTypes = 0;
 
@@ -851,7 +955,7 @@ template<> bool ParseStatement<StatementParsingType::Scope>(VectorView<Token> to
     {
         if (definiteReturnTypes == 1)
         {
-            ctx.errors.push_back({ "Unreachable code (already returned).", tokens[tokensConsumed].pos });
+            ctx.errors.push_back({ "Unreachable code (already returned).", tokens.Pos(tokensConsumed) });
         }
 
         int consumed = 0;
@@ -874,8 +978,8 @@ template<> bool ParseStatement<StatementParsingType::Scope>(VectorView<Token> to
         if (!GetStatementType(outStatement).isOptional) definiteReturnTypes++;
     }
     tokensConsumed += 1;
-    outStatement = ScopeStatement{ statements, { returnTypes, definiteReturnTypes == 0 }, { ctx.varStack.begin() + stackSize, ctx.varStack.end() } };
-    ctx.varStack.erase(ctx.varStack.begin() + stackSize, ctx.varStack.end());
+    outStatement = ScopeStatement{ std::move(statements), { returnTypes, definiteReturnTypes == 0 }, stackSize, (int)ctx.varStack.size() };
+    ctx.PopVariables(stackSize);
     return true;
 }
 
@@ -931,7 +1035,7 @@ std::string TypeToString(Type t)
     }
     if (std::holds_alternative<LambdaType>(t))
     {
-        return "Lambda{" + TypeToString(std::get<LambdaType>(t).arg.Get()) + "," + TypeToString(std::get<LambdaType>(t).ret.Get()) + "}";
+        return "Lambda{" + TypeToString(std::get<LambdaType>(t).arg.Get()) + "," + TypeToString(std::get<LambdaType>(t).Ret()) + "}";
     }
     return "huh?";
 }
@@ -944,7 +1048,7 @@ std::string ExpressionToString(Expression e)
     {
         if (!std::holds_alternative<AtomicType>(std::get<LiteralExpression>(e).type)) return "ERROR";
 
-        return "LiteralExp{" + std::get<LiteralExpression>(e).vec[0].value + ",type:" + type + "}";
+        return "LiteralExp{" + std::string(std::get<LiteralExpression>(e).vec[0].value) + ",type:" + type + "}";
     }
     else if (std::holds_alternative<VariableExpression>(e))
     {
@@ -952,12 +1056,20 @@ std::string ExpressionToString(Expression e)
     }
     else if (std::holds_alternative<LambdaExpression>(e))
     {
-        return "LambdaExpression{" + ExpressionToString(std::get<LambdaExpression>(e).args.Get()) + "," + StatementToString(std::get<LambdaExpression>(e).body.Get()) + ",type:" + type + "}";
+        const LambdaExpression& lambda = std::get<LambdaExpression>(e);
+        std::string body = StatementToString(lambda.body.Get());
+        if (std::holds_alternative<LambdaType>(lambda.type) && std::get<LambdaType>(lambda.type).lazy)
+        {
+            LazyLambda& lazy = *std::get<LambdaType>(lambda.type).lazy;
+            lazy.Parse();
+            body = lazy.body.has_value() ? StatementToString(lazy.body.value().Get()) : "ERROR";
+        }
+        return "LambdaExpression{" + ExpressionToString(lambda.args.Get()) + "," + body + ",type:" + type + "}";
     }
     else if (std::holds_alternative<MultiExpression>(e))
     {
         std::string ret = "MultiExp{" + ToStringVectors::MULTI_EXPRESSION[(int)std::get<MultiExpression>(e).exprType];
-        for (HeapAlloc<Expression>& i : std::get<MultiExpression>(e).elements)
+        for (AstRef<Expression>& i : std::get<MultiExpression>(e).elements)
         {
             ret += ExpressionToString(i.Get()) + ",";
         }
@@ -996,7 +1108,7 @@ std::string StatementToString(Statement s)
     else if (std::holds_alternative<ScopeStatement>(s))
     {
         std::string ret = "{\n";
-        for (HeapAlloc<Statement>& i : std::get<ScopeStatement>(s).vec)
+        for (AstRef<Statement>& i : std::get<ScopeStatement>(s).vec)
         {
             ret += StatementToString(i.Get());
         }
@@ -1010,6 +1122,7 @@ std::string StatementToString(Statement s)
 
 #ifndef RUN_TESTS
 #ifndef CREATE_TESTS
+#ifndef RUN_BENCHMARKS
 
 int main()
 {
@@ -1018,12 +1131,14 @@ int main()
         std::cout << "Enter possible statement: ";
         std::string temp; std::getline(std::cin, temp);
 
-        std::vector<Token> tokens = Tokenize(temp);
-        for (Token& i : tokens)
+        SymbolTable symbols;
+        AstArena arena;
+        TokenStream tokens = Tokenize(temp, symbols);
+        for (int i = 0; i < tokens.Size(); i++)
         {
-             std::cout << i.value << std::endl;
+             std::cout << tokens[i].value << std::endl;
         }
-        ParsingContext pc = { { { "func1", LambdaType{ { AtomicType::Integer }, { AtomicType::String } } } } };
+        ParsingContext pc = { { { symbols.Intern("func1"), LambdaType{ { AtomicType::Integer }, { AtomicType::String } } } } };
         Statement s = SingleStatement{ { LiteralExpression{ AtomicType::Error, { tokens, 0 } } } }; int n = 0;
         std::cout << (ParseStatement({tokens, 0}, pc, s, n) ? "Parsing worked!" : "Parsing failed.") << std::endl;
         std::cout << StatementToString(s) << std::endl;
@@ -1037,9 +1152,17 @@ int main()
             for (int j = 1; j < i.pos.column; j++) std::cout << ' ';
             std::cout << "v\n" << temp.substr(pos, temp.find('\n', pos) - pos) << "\n" << std::endl;
         }
+
+#ifdef PARSER_TRACING
+        WriteParserTraceJson(std::cout);
+        std::ofstream trace("parser_trace.json");
+        WriteParserTraceChrome(trace);
+        ResetParserTrace();
+#endif
     }
 }
 
 #endif
 #endif
+#endif
 
@@ -1,5 +1,10 @@
 #pragma once
 #include "Type.h"
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <new>
+#include <optional>
 #include <variant>
 #include <vector>
 
@@ -9,6 +14,19 @@ typedef std::variant<SingleStatement, ScopeStatement, ForStatement, WhileStateme
 struct LiteralExpression; struct VariableExpression; struct LambdaExpression; struct MultiExpression; struct BinaryExpression; struct UnaryExpression;
 typedef std::variant<LiteralExpression, VariableExpression, LambdaExpression, MultiExpression, BinaryExpression, UnaryExpression> Expression;
 
+// A child node, by its index in the AstArena that is active on this thread (see below). Making one from a node stores a copy of
+// that node in the arena. Copying one is shallow, so a copied node shares its children with the original.
+template<typename T>
+class AstRef
+{
+    uint32_t index;
+public:
+    T& Get();
+    const T& Get() const;
+
+    AstRef(const T& v);
+    AstRef(T&& v);
+};
 
 struct LiteralExpression
 {
@@ -27,21 +45,24 @@ struct LambdaExpression
 {
     Type type;
     VectorView<Token> vec;
-    HeapAlloc<Expression> args;
-    HeapAlloc<Statement> body;
+    AstRef<Expression> args;
+    AstRef<Statement> body;
 };
 
 enum class MultiExpressionType
 {
     Variables, Record, Overload,
 };
+constexpr int MULTI_EXPRESSION_TYPE_COUNT = (int)MultiExpressionType::Overload + 1;
+
+typedef SmallVector<AstRef<Expression>, 4> ExpressionList;
 
 struct MultiExpression
 {
     Type type;  // must be a record
     VectorView<Token> vec;
     MultiExpressionType exprType;
-    std::vector<HeapAlloc<Expression>> elements;
+    ExpressionList elements;
 };
 
 enum class BinaryExpressionType
@@ -51,27 +72,29 @@ enum class BinaryExpressionType
     Add, Subtract, Multiply, Divide, Modulus, Exponentiate,
     FunctionCall,
 };
+constexpr int BINARY_EXPRESSION_TYPE_COUNT = (int)BinaryExpressionType::FunctionCall + 1;
 
 struct BinaryExpression
 {
     Type type;
     VectorView<Token> vec;
     BinaryExpressionType exprType;
-    HeapAlloc<Expression> a;
-    HeapAlloc<Expression> b;
+    AstRef<Expression> a;
+    AstRef<Expression> b;
 };
 
 enum class UnaryExpressionType
 {
     Cast, Not, Minus, Plus,  // Cast is a UnaryExpressionType, but it is parsed when ExpressionParsingPrecedence is Cast, not Unary
 };
+constexpr int UNARY_EXPRESSION_TYPE_COUNT = (int)UnaryExpressionType::Plus + 1;
 
 struct UnaryExpression
 {
     Type type;
     VectorView<Token> vec;
     UnaryExpressionType exprType;
-    HeapAlloc<Expression> a;
+    AstRef<Expression> a;
 };
 
 inline const Type& GetExpressionType(const Expression& expr)
@@ -104,14 +127,7 @@ enum class ExpressionParsingPrecedence
 template<ExpressionParsingPrecedence T = ExpressionParsingPrecedence::Assignment>
 bool ParseExpression(VectorView<Token> tokens, ParsingContext& ctx, Expression& outExpr, int& tokensConsumed);
 
-template<> bool ParseExpression<ExpressionParsingPrecedence::Variable>(VectorView<Token> tokens, ParsingContext& ctx, Expression& outExpr, int& tokensConsumed);
-template<> bool ParseExpression<ExpressionParsingPrecedence::Lambda>(VectorView<Token> tokens, ParsingContext& ctx, Expression& outExpr, int& tokensConsumed);
-template<> bool ParseExpression<ExpressionParsingPrecedence::Literal>(VectorView<Token> tokens, ParsingContext& ctx, Expression& outExpr, int& tokensConsumed);
-template<> bool ParseExpression<ExpressionParsingPrecedence::Brackets>(VectorView<Token> tokens, ParsingContext& ctx, Expression& outExpr, int& tokensConsumed);
-template<> bool ParseExpression<ExpressionParsingPrecedence::Unary>(VectorView<Token> tokens, ParsingContext& ctx, Expression& outExpr, int& tokensConsumed);
-template<> bool ParseExpression<ExpressionParsingPrecedence::FunctionCall>(VectorView<Token> tokens, ParsingContext& ctx, Expression& outExpr, int& tokensConsumed);
-template<> bool ParseExpression<ExpressionParsingPrecedence::Cast>(VectorView<Token> tokens, ParsingContext& ctx, Expression& outExpr, int& tokensConsumed);
-template<> bool ParseExpression<ExpressionParsingPrecedence::Exponentiate>(VectorView<Token> tokens, ParsingContext& ctx, Expression& outExpr, int& tokensConsumed);
+template<> bool ParseExpression<ExpressionParsingPrecedence::Booleans>(VectorView<Token> tokens, ParsingContext& ctx, Expression& outExpr, int& tokensConsumed);  // and every level below it
 template<> bool ParseExpression<ExpressionParsingPrecedence::Overload>(VectorView<Token> tokens, ParsingContext& ctx, Expression& outExpr, int& tokensConsumed);
 template<> bool ParseExpression<ExpressionParsingPrecedence::Record>(VectorView<Token> tokens, ParsingContext& ctx, Expression& outExpr, int& tokensConsumed);
 template<> bool ParseExpression<ExpressionParsingPrecedence::Assignment>(VectorView<Token> tokens, ParsingContext& ctx, Expression& outExpr, int& tokensConsumed);
@@ -127,48 +143,49 @@ struct ReturnTypeSet
     std::vector<Type> types;
     bool isOptional = true;
 
-    Type ToType();
+    Type ToType() const;
 };
 
 struct SingleStatement
 {
-    HeapAlloc<Expression> expr;
+    AstRef<Expression> expr;
     ReturnTypeSet type;
 };
 
 struct ScopeStatement
 {
-    std::vector<HeapAlloc<Statement>> vec;
+    std::vector<AstRef<Statement>> vec;
     ReturnTypeSet type = {};
-    std::vector<std::pair<std::string, Type>> ctx;
+    int stackBegin;  // the variables defined in the scope, as a range of the variable stack, which is popped when it ends
+    int stackEnd;
 };
 
 struct ForStatement
 {
-    HeapAlloc<Expression> cond1;
-    HeapAlloc<Expression> cond2;
-    HeapAlloc<Expression> cond3;
-    HeapAlloc<Statement> contents;
+    AstRef<Expression> cond1;
+    AstRef<Expression> cond2;
+    AstRef<Expression> cond3;
+    AstRef<Statement> contents;
     ReturnTypeSet type = {};
 };
 
 struct WhileStatement
 {
-    HeapAlloc<Expression> condition;
-    HeapAlloc<Statement> contents;
+    AstRef<Expression> condition;
+    AstRef<Statement> contents;
     ReturnTypeSet type = {};
 };
 
 struct IfStatement
 {
-    HeapAlloc<Expression> condition;
-    HeapAlloc<Statement> contents;
+    AstRef<Expression> condition;
+    AstRef<Statement> contents;
     ReturnTypeSet type = {};
 };
 
 struct ReturnStatement
 {
-    HeapAlloc<Expression> expr;
+    AstRef<Expression> expr;
     ReturnTypeSet type = {};
 };
 
@@ -194,6 +211,111 @@ inline ReturnTypeSet& GetStatementType(Statement& expr)
 }
 
 
+// Owns every node made while it is alive, from its construction until it is destroyed, when the previously active arena (if any)
+// becomes active again. So one AstArena per compilation, made before the first node, replaces a separate allocation per node with
+// one per block of nodes, and frees the whole tree at once.
+class AstArena
+{
+    static constexpr int BLOCK_BITS = 12;  // 4096 nodes per block
+    static constexpr uint32_t BLOCK_SIZE = 1u << BLOCK_BITS;
+
+    template<typename T>
+    struct Pool
+    {
+        std::vector<std::unique_ptr<std::aligned_storage_t<sizeof(T), alignof(T)>[]>> blocks;
+        uint32_t size = 0;
+
+        T& At(uint32_t i) { return *std::launder(reinterpret_cast<T*>(&blocks[i >> BLOCK_BITS][i & (BLOCK_SIZE - 1)])); }
+
+        template<typename U>
+        uint32_t Add(U&& v)
+        {
+            if ((size & (BLOCK_SIZE - 1)) == 0)
+            {
+                Assert(size != 0 || blocks.empty(), "Too many nodes for a 32 bit index.");
+                blocks.push_back(std::make_unique<std::aligned_storage_t<sizeof(T), alignof(T)>[]>(BLOCK_SIZE));
+            }
+            new (&blocks[size >> BLOCK_BITS][size & (BLOCK_SIZE - 1)]) T(std::forward<U>(v));
+            return size++;
+        }
+
+        ~Pool()
+        {
+            for (uint32_t i = 0; i < size; i++) At(i).~T();
+        }
+    };
+
+    Pool<Expression> expressions;
+    Pool<Statement> statements;
+    AstArena* previous;
+    bool detached = false;
+
+    static AstArena*& Active();
+
+    template<typename T> Pool<T>& Nodes();
+
+public:
+    AstArena();
+    ~AstArena();
+    AstArena(const AstArena&) = delete;
+    AstArena& operator=(const AstArena&) = delete;
+
+    // A detached arena is never made active by its own lifetime, only by the Use scopes on it, so that it can be filled on other
+    // threads than the one it is made and destroyed on.
+    struct Detached {};
+    explicit AstArena(Detached);
+
+    // Makes arena the active one on this thread until the end of the scope.
+    class Use
+    {
+        AstArena* previous;
+    public:
+        explicit Use(AstArena& arena) : previous(Active()) { Active() = &arena; }
+        ~Use() { Active() = previous; }
+        Use(const Use&) = delete;
+        Use& operator=(const Use&) = delete;
+    };
+
+    static AstArena& Current();
+
+    template<typename T> T& At(uint32_t i) { return Nodes<T>().At(i); }
+    template<typename T> uint32_t Add(const T& v) { return Nodes<T>().Add(v); }
+    template<typename T> uint32_t Add(T&& v) { return Nodes<T>().Add(std::move(v)); }
+
+    size_t NodeCount() const { return expressions.size + statements.size; }
+};
+
+template<> inline AstArena::Pool<Expression>& AstArena::Nodes<Expression>() { return expressions; }
+template<> inline AstArena::Pool<Statement>& AstArena::Nodes<Statement>() { return statements; }
+
+template<typename T> T& AstRef<T>::Get() { return AstArena::Current().At<T>(index); }
+template<typename T> const T& AstRef<T>::Get() const { return AstArena::Current().At<T>(index); }
+template<typename T> AstRef<T>::AstRef(const T& v) : index(AstArena::Current().Add<T>(v)) {}
+template<typename T> AstRef<T>::AstRef(T&& v) : index(AstArena::Current().Add<T>(std::move(v))) {}
+
+
+// The body of a lambda parsed in lazy mode, which is only skimmed for its closing brace, along with the variables it names from
+// outside. It is parsed the first time the return type is needed, usually by a call, in a context made of just those variables at
+// the same stack indices. Every copy of the lambda's type shares one of these, so that happens once. The body goes in the AstArena
+// that was active when the lambda was skimmed, which must be active again for the first call, as it is for any use of its nodes.
+struct LazyLambda
+{
+    VectorView<Token> tokens;  // from the ( before the arguments
+    size_t stackSize;  // of the context the lambda was defined in, before the arguments
+    std::vector<std::pair<int, std::pair<SymbolId, Type>>> captured;
+    SharedTypedefs typedefs;
+
+    bool parsed = false;
+    std::optional<AstRef<Statement>> body;  // unset if it failed to parse
+    Type ret = AtomicType::Error;
+    std::vector<ErrorOutput> errors;
+    bool reported = false;  // set once errors have been added to the context of a call
+    AstArena* arena = &AstArena::Current();
+
+    ParsingContext Context() const;
+    void Parse();
+};
+
 enum class StatementParsingType
 {
     Single, If, For, While, Return, Scope,
@@ -0,0 +1,140 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <initializer_list>
+#include <new>
+#include <utility>
+
+// A vector that keeps up to N elements inside itself, and only moves them to the heap once it grows past that. Almost every
+// record, union and overload has two to four members, so their member lists never allocate. The methods are the ones of
+// std::vector that the compiler uses, and iterators are plain pointers, which any push or erase invalidates.
+template<typename T, size_t N>
+class SmallVector
+{
+    size_t count = 0;
+    size_t capacity = N;
+    T* heap = nullptr;  // the elements, once there are more than N
+    alignas(T) unsigned char local[N * sizeof(T)];
+
+    T* Elements() { return heap ? heap : reinterpret_cast<T*>(local); }
+    const T* Elements() const { return heap ? heap : reinterpret_cast<const T*>(local); }
+
+    void Grow(size_t atLeast)
+    {
+        size_t newCapacity = std::max(atLeast, capacity * 2);
+        T* moved = static_cast<T*>(::operator new(newCapacity * sizeof(T)));
+        for (size_t i = 0; i < count; i++)
+        {
+            new (moved + i) T(std::move(Elements()[i]));
+            Elements()[i].~T();
+        }
+        if (heap) ::operator delete(heap);
+        heap = moved;
+        capacity = newCapacity;
+    }
+
+public:
+    SmallVector() = default;
+    SmallVector(std::initializer_list<T> values)
+    {
+        reserve(values.size());
+        for (const T& v : values) push_back(v);
+    }
+    SmallVector(const SmallVector& other)
+    {
+        reserve(other.count);
+        for (const T& v : other) push_back(v);
+    }
+    // Takes the heap buffer of other if it has one, and otherwise moves its elements one by one.
+    SmallVector(SmallVector&& other) noexcept
+    {
+        if (other.heap)
+        {
+            heap = other.heap; capacity = other.capacity; count = other.count;
+            other.heap = nullptr; other.capacity = N; other.count = 0;
+        }
+        else
+        {
+            for (T& v : other) push_back(std::move(v));
+            other.clear();
+        }
+    }
+    ~SmallVector()
+    {
+        clear();
+        if (heap) ::operator delete(heap);
+    }
+    SmallVector& operator=(const SmallVector& other)
+    {
+        if (this != &other)
+        {
+            SmallVector copy = other;
+            *this = std::move(copy);
+        }
+        return *this;
+    }
+    SmallVector& operator=(SmallVector&& other) noexcept
+    {
+        if (this != &other)
+        {
+            SmallVector moved = std::move(other);  // other may live inside one of the elements, which go away first
+            this->~SmallVector();
+            new (this) SmallVector(std::move(moved));
+        }
+        return *this;
+    }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    T* begin() { return Elements(); }
+    T* end() { return Elements() + count; }
+    const T* begin() const { return Elements(); }
+    const T* end() const { return Elements() + count; }
+
+    T& operator[](size_t i) { return Elements()[i]; }
+    const T& operator[](size_t i) const { return Elements()[i]; }
+    T& front() { return Elements()[0]; }
+    const T& front() const { return Elements()[0]; }
+    T& back() { return Elements()[count - 1]; }
+    const T& back() const { return Elements()[count - 1]; }
+
+    void reserve(size_t n) { if (n > capacity) Grow(n); }
+
+    void push_back(const T& v)
+    {
+        if (count == capacity)  // v may be one of the elements, so it is copied before they move
+        {
+            T copy = v;
+            Grow(count + 1);
+            new (Elements() + count) T(std::move(copy));
+        }
+        else
+        {
+            new (Elements() + count) T(v);
+        }
+        count++;
+    }
+    void push_back(T&& v)
+    {
+        if (count == capacity) { T moved = std::move(v); Grow(count + 1); new (Elements() + count) T(std::move(moved)); }
+        else new (Elements() + count) T(std::move(v));
+        count++;
+    }
+    void pop_back() { Elements()[--count].~T(); }
+
+    T* erase(T* first, T* last)
+    {
+        T* newEnd = std::move(last, end(), first);
+        for (T* i = newEnd; i != end(); i++) i->~T();
+        count = newEnd - begin();
+        return first;
+    }
+    T* erase(T* at) { return erase(at, at + 1); }
+
+    void clear()
+    {
+        for (T& v : *this) v.~T();
+        count = 0;
+    }
+};
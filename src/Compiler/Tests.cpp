@@ -1,6 +1,12 @@
+#include "Bytecode.h"
 #include "Parser.h"
+#include "Incremental.h"
+#include "Module.h"
+#include "ThreadPool.h"
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <algorithm>
 
 std::vector<std::pair<std::string, std::string>> LoadGoldenTests(std::string filename)
 {
@@ -51,16 +57,72 @@ void WriteGoldenTests(std::string filename, std::vector<std::pair<std::string, s
     }
 }
 
-std::string RunTest(std::string in)
+// Adds the errors of the bodies of lazy lambdas that were never called, which parsing them straight away would have reported.
+void AddUncalledLambdaErrors(const Statement& s, std::vector<ErrorOutput>& errors);
+
+void AddUncalledLambdaErrors(const Expression& e, std::vector<ErrorOutput>& errors)
 {
-    std::string ret = "";
+    if (std::holds_alternative<LambdaExpression>(e))
+    {
+        const LambdaExpression& lambda = std::get<LambdaExpression>(e);
+        if (std::holds_alternative<LambdaType>(lambda.type) && std::get<LambdaType>(lambda.type).lazy)
+        {
+            LazyLambda& lazy = *std::get<LambdaType>(lambda.type).lazy;
+            lazy.Parse();
+            if (!lazy.reported) errors.insert(errors.end(), lazy.errors.begin(), lazy.errors.end());
+            lazy.reported = true;
+            if (lazy.body.has_value()) AddUncalledLambdaErrors(lazy.body.value().Get(), errors);
+        }
+        else AddUncalledLambdaErrors(lambda.body.Get(), errors);
+    }
+    else if (std::holds_alternative<MultiExpression>(e))
+    {
+        for (const AstRef<Expression>& i : std::get<MultiExpression>(e).elements) AddUncalledLambdaErrors(i.Get(), errors);
+    }
+    else if (std::holds_alternative<BinaryExpression>(e))
+    {
+        AddUncalledLambdaErrors(std::get<BinaryExpression>(e).a.Get(), errors);
+        AddUncalledLambdaErrors(std::get<BinaryExpression>(e).b.Get(), errors);
+    }
+    else if (std::holds_alternative<UnaryExpression>(e)) AddUncalledLambdaErrors(std::get<UnaryExpression>(e).a.Get(), errors);
+}
 
-    std::vector<Token> tokens = Tokenize(in);
-    for (Token& i : tokens)
+void AddUncalledLambdaErrors(const Statement& s, std::vector<ErrorOutput>& errors)
+{
+    if (std::holds_alternative<SingleStatement>(s)) AddUncalledLambdaErrors(std::get<SingleStatement>(s).expr.Get(), errors);
+    else if (std::holds_alternative<ScopeStatement>(s))
+    {
+        for (const AstRef<Statement>& i : std::get<ScopeStatement>(s).vec) AddUncalledLambdaErrors(i.Get(), errors);
+    }
+    else if (std::holds_alternative<ForStatement>(s))
+    {
+        const ForStatement& f = std::get<ForStatement>(s);
+        AddUncalledLambdaErrors(f.cond1.Get(), errors);
+        AddUncalledLambdaErrors(f.cond2.Get(), errors);
+        AddUncalledLambdaErrors(f.cond3.Get(), errors);
+        AddUncalledLambdaErrors(f.contents.Get(), errors);
+    }
+    else if (std::holds_alternative<WhileStatement>(s))
+    {
+        AddUncalledLambdaErrors(std::get<WhileStatement>(s).condition.Get(), errors);
+        AddUncalledLambdaErrors(std::get<WhileStatement>(s).contents.Get(), errors);
+    }
+    else if (std::holds_alternative<IfStatement>(s))
     {
-         ret += i.value + "\n";
+        AddUncalledLambdaErrors(std::get<IfStatement>(s).condition.Get(), errors);
+        AddUncalledLambdaErrors(std::get<IfStatement>(s).contents.Get(), errors);
     }
-    ParsingContext pc = { { { "func1", LambdaType{ { AtomicType::Integer }, { AtomicType::String } } } } };
+    else AddUncalledLambdaErrors(std::get<ReturnStatement>(s).expr.Get(), errors);
+}
+
+// If allErrors is given, every error is put in it as text, sorted, counting those of lambdas that were never called.
+std::string ParseTokens(const std::string& in, const TokenStream& tokens, SymbolTable& symbols, bool lazyLambdas = false, std::vector<std::string>* allErrors = nullptr)
+{
+    std::string ret = "";
+
+    AstArena arena;
+    ParsingContext pc = { { { symbols.Intern("func1"), LambdaType{ { AtomicType::Integer }, { AtomicType::String } } } } };
+    pc.lazyLambdas = lazyLambdas;
     Statement s = SingleStatement{ { LiteralExpression{ AtomicType::Error, { tokens, 0 } } } }; int n = 0;
     ret += (ParseStatement({tokens, 0}, pc, s, n) ? "Parsing worked!" : "Parsing failed.") + std::string("\n");
     ret += StatementToString(s) + "\n";
@@ -75,11 +137,187 @@ std::string RunTest(std::string in)
         ret += "v\n" + in.substr(pos, in.find('\n', pos) - pos) + "\n\n";
     }
 
+    // Programs the bytecode can express are run as well, to check what they return.
+    InstructionSet code;
+    if (pc.errors.empty() && GenerateBytecode(s, code))
+    {
+        BytecodeResult result = RunBytecode(code);
+        Value v = result.value;
+        Type t = GetStatementType(s).ToType();
+        std::ostringstream out;
+        if (t == AtomicType::Integer) out << v.i;
+        else if (t == AtomicType::Double) out << v.d;
+        else if (t == AtomicType::Boolean) out << (v.i ? "true" : "false");
+        else out << "nothing";
+        ret += result.failed ? "The bytecode failed: " + result.error + ".\n" : "The bytecode returned " + out.str() + ".\n";
+    }
+
+    if (allErrors)
+    {
+        std::vector<ErrorOutput> errors = pc.errors;
+        AddUncalledLambdaErrors(s, errors);
+        for (auto& i : errors) allErrors->push_back(std::to_string(i.pos.line) + "," + std::to_string(i.pos.column) + ": " + i.msg);
+        std::sort(allErrors->begin(), allErrors->end());
+    }
+
+    return ret;
+}
+
+std::string DocumentToString(const Document& doc)
+{
+    std::string ret = doc.Parsed() ? "Parsing worked!\n" : "Parsing failed.\n";
+    for (const AstRef<Statement>& s : doc.Statements()) ret += StatementToString(s.Get()) + "\n";
+    for (auto& i : doc.Errors())
+    {
+        ret += "Error (" + std::to_string(i.pos.line) + "," + std::to_string(i.pos.column) + "): " + i.msg + "\n";
+    }
+    return ret;
+}
+
+std::string ModuleToString(const Module& m)
+{
+    std::string ret = m.parsed ? "Parsing worked!\n" : "Parsing failed.\n";
+    for (const AstRef<Statement>& s : m.statements) ret += StatementToString(s.Get()) + "\n";
+    for (auto& i : m.ctx.errors) ret += "Error (" + std::to_string(i.pos.line) + "," + std::to_string(i.pos.column) + "): " + i.msg + "\n";
+    for (auto& v : m.ctx.varStack) ret += std::string(m.symbols.Name(v.first)) + ": " + TypeToString(v.second) + "\n";
+    return ret;
+}
+
+std::string RunTest(std::string in)
+{
+    std::string ret = "";
+
+    SymbolTable symbols;
+    TokenStream tokens = Tokenize(in, symbols);
+    for (int i = 0; i < tokens.Size(); i++)
+    {
+         ret += std::string(tokens[i].value) + "\n";
+    }
+
+    // The parallel lexer has to produce exactly the same tokens, so split even tiny inputs at every line.
+    SymbolTable parallelSymbols;
+    TokenStream parallel = Tokenize(in, parallelSymbols, std::count(in.begin(), in.end(), '\n') + 1);
+    bool same = parallel.types == tokens.types && parallel.offsets == tokens.offsets && parallel.lengths == tokens.lengths &&
+        parallel.symbols == tokens.symbols && parallel.integers == tokens.integers && parallel.decimals == tokens.decimals &&
+        parallel.lineStarts == tokens.lineStarts && parallelSymbols.names == symbols.names;
+    for (int i = 0; same && i < tokens.Size(); i++) same = tokens[i].value == parallel[i].value;
+    if (!same)
+    {
+        ret += "Parallel lexing differs from serial lexing.\n";
+    }
+
+    std::vector<std::string> errors;
+    std::string parsed = ParseTokens(in, tokens, symbols, false, &errors);
+    ret += parsed;
+
+    // Parsing lambda bodies lazily has to give the same tree once they are all parsed, which printing it does. Errors can come in a
+    // different order, or not at all for lambdas that are never called, so the whole output is only compared for inputs without
+    // any, and otherwise the sorted errors are compared once those of the lambdas never called are added.
+    std::vector<std::string> lazyErrors;
+    std::string lazyParsed = ParseTokens(in, tokens, symbols, true, &lazyErrors);
+    if (parsed.find("There were 0 errors.") != std::string::npos && lazyParsed != parsed)
+    {
+        ret += "Lazy lambda parsing differs from parsing them straight away.\n";
+    }
+    if (lazyErrors != errors)
+    {
+        ret += "Lazy lambda parsing reports different errors from parsing them straight away.\n";
+    }
+
+    // Parsing from a streamed source has to give the same result, even when the input trickles in a few bytes at a time.
+    SymbolTable streamedSymbols;
+    std::istringstream stream(in);
+    TokenStream streamed = TokenizeLazily(stream, streamedSymbols, 1 << 16, 7);
+    if (ParseTokens(in, streamed, streamedSymbols) != parsed)
+    {
+        ret += "Streaming lexing differs from serial lexing.\n";
+    }
+
+    // Editing a document has to leave it as parsing the edited text from scratch would. With a segment size of 1, every statement
+    // is a segment of its own, and breaking the line before each token moves everything after it. Lazy lambdas are checked as
+    // well, as reparsing a call has to report the errors of the body again.
+    for (bool lazyLambdas : { false, true })
+    {
+        AstArena arena;
+        SymbolTable docSymbols;
+        ParsingContext pc = { { { docSymbols.Intern("func1"), LambdaType{ { AtomicType::Integer }, { AtomicType::String } } } } };
+        pc.lazyLambdas = lazyLambdas;
+        Document doc(in, docSymbols, pc, 1);
+        std::string whole = DocumentToString(Document(in, docSymbols, pc, SIZE_MAX));
+        bool sameDoc = DocumentToString(doc) == whole;
+        for (int i = 0; sameDoc && i + 1 < tokens.Size(); i++)
+        {
+            std::string edited = in;
+            edited.insert(tokens.offsets[i], "\n");
+            doc.Edit(tokens.offsets[i], 0, "\n");
+            sameDoc = DocumentToString(doc) == DocumentToString(Document(edited, docSymbols, pc, SIZE_MAX));
+            doc.Edit(tokens.offsets[i], 1, "");
+            sameDoc = sameDoc && DocumentToString(doc) == whole;
+        }
+        if (!sameDoc)
+        {
+            ret += "Incremental parsing differs from parsing from scratch.\n";
+        }
+    }
+
+    // A module loaded from its cache has to print as the one it was written from, errors and all.
+    {
+        AstArena arena;
+        SymbolTable moduleSymbols;
+        ParsingContext pc = { { { moduleSymbols.Intern("func1"), LambdaType{ { AtomicType::Integer }, { AtomicType::String } } } } };
+        std::unique_ptr<Module> parsedModule = ParseModule(in, moduleSymbols, pc);
+        std::optional<uint64_t> key = ModuleKey(in, moduleSymbols, pc);
+        std::unique_ptr<Module> loaded = key.has_value() ? DeserializeModule(SerializeModule(*parsedModule, key.value()), in, key.value()) : nullptr;
+        if (!loaded || ModuleToString(*loaded) != ModuleToString(*parsedModule))
+        {
+            ret += "Cached module differs from parsing.\n";
+        }
+    }
+
+    // Parsing the statements of a module at the same time has to give what parsing them one after the other does, which inputs this
+    // small are only made to do without a threshold. The statements of a scope, taken out of it, make a module of several.
+    {
+        static ThreadPool pool(4);
+        size_t open = in.find_first_not_of(" \t\r\n"), close = in.find_last_not_of(" \t\r\n");
+        std::string statements = open != std::string::npos && in[open] == '{' && in[close] == '}' ? in.substr(open + 1, close - open - 1) : in;
+
+        AstArena arena;
+        SymbolTable moduleSymbols;
+        ParsingContext pc = { { { moduleSymbols.Intern("func1"), LambdaType{ { AtomicType::Integer }, { AtomicType::String } } } } };
+        if (ModuleToString(*ParseModule(statements, moduleSymbols, pc, nullptr, &pool, 0)) != ModuleToString(*ParseModule(statements, moduleSymbols, pc)))
+        {
+            ret += "Parallel parsing differs from serial parsing.\n";
+        }
+    }
+
     return ret;
  }
 
+// What parsing the golden tests cannot reach, as what went wrong, if anything.
+std::string RunContainerTests()
+{
+    std::string ret = "";
+
+    // Assigning a list from the members of one of its own members, which the assignment frees, whether they are inline or not.
+    for (size_t n : { 2, 6 })
+    {
+        TypeList inner;
+        for (size_t i = 0; i < n; i++) inner.push_back({ AtomicType::Integer });
+        TypeList outer = { { AtomicType::Boolean }, { RecordType{ inner } } };
+        outer = std::move(std::get<RecordType>(outer[1].Get()).values);
+        if (outer.size() != n || std::any_of(outer.begin(), outer.end(), [](const HeapAlloc<Type>& t) { return t.Get() != AtomicType::Integer; }))
+        {
+            ret += "Assigning a type list from one of its members loses them.\n";
+        }
+    }
+
+    return ret;
+}
+
 void RunAllTests(std::string filename)
 {
+    std::cout << RunContainerTests();
+
     std::vector<std::pair<std::string, std::string>> tests = LoadGoldenTests(filename);
 
     std::vector<std::pair<int,std::string>> failedTests;
@@ -0,0 +1,80 @@
+#include "ThreadPool.h"
+#include <algorithm>
+
+ThreadPool::ThreadPool(int threads)
+{
+    for (int i = 1; i < threads; i++)  // the thread calling ParallelFor is the other one
+    {
+        workers.emplace_back([this]()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true)
+            {
+                wake.wait(lock, [this]() { return stopping || !jobs.empty(); });
+                if (stopping) return;
+                RunOne(lock);
+            }
+        });
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread& t : workers) t.join();
+}
+
+// Takes a job off the queue and runs it with the lock released. Expects the lock to be held, and holds it again on return.
+bool ThreadPool::RunOne(std::unique_lock<std::mutex>& lock)
+{
+    if (jobs.empty()) return false;
+
+    std::function<void()> job = std::move(jobs.front());
+    jobs.pop_front();
+    lock.unlock();
+    job();
+    lock.lock();
+    return true;
+}
+
+void ThreadPool::ParallelFor(int count, const std::function<void(int)>& task)
+{
+    if (count <= 0) return;
+    if (count == 1 || workers.empty())
+    {
+        for (int i = 0; i < count; i++) task(i);
+        return;
+    }
+
+    int remaining = count;  // guarded by mutex
+    std::condition_variable done;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (int i = 0; i < count; i++)
+        {
+            jobs.push_back([&, i]()
+            {
+                task(i);
+                std::lock_guard<std::mutex> lock(mutex);  // held while notifying, so the waiter cannot return and destroy done first
+                if (--remaining == 0) done.notify_all();
+            });
+        }
+    }
+    wake.notify_all();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while (remaining > 0)
+    {
+        if (!RunOne(lock)) done.wait(lock, [&]() { return remaining == 0 || !jobs.empty(); });
+    }
+}
+
+ThreadPool& ThreadPool::Global()
+{
+    static ThreadPool pool((int)std::max(1u, std::thread::hardware_concurrency()));
+    return pool;
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads that the parallel parts of the compiler hand their work to.
+class ThreadPool
+{
+public:
+    explicit ThreadPool(int threads);
+    ~ThreadPool();
+
+    // Runs task(0) to task(count - 1) and returns once they have all finished. The calling thread works on them too, so this may be nested.
+    void ParallelFor(int count, const std::function<void(int)>& task);
+    inline int Size() const { return (int)workers.size() + 1; }
+
+    static ThreadPool& Global();  // one thread per hardware thread
+
+private:
+    bool RunOne(std::unique_lock<std::mutex>& lock);
+
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> jobs;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+};
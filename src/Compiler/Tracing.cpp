@@ -0,0 +1,143 @@
+#include "Tracing.h"
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace
+{
+    const std::vector<std::string> EXPRESSION_PREC_NAMES = { "VarDef", "MultiVarDef", "Assignment", "Record", "Overload", "Booleans", "Equals", "Less", "Add", "Multiply", "Exponentiate", "Cast", "FunctionCall", "Unary", "Brackets", "Literal", "Lambda", "Variable" };
+
+#ifdef PARSER_TRACING
+    struct TraceEvent
+    {
+        ExpressionParsingPrecedence prec;
+        bool success;
+        int tokensConsumed;
+        int64_t begin;  // nanoseconds since the first trace
+        int64_t duration;
+    };
+
+    // Everything one thread has recorded. Sinks are never freed, so a dump after a thread has exited still sees its events.
+    struct TraceSink
+    {
+        int thread;
+        ParserTraceLevels counters;
+        std::vector<TraceEvent> events;
+    };
+
+    std::mutex sinksMutex;  // guards the list, not the sinks, which only their own thread writes to
+    std::vector<std::unique_ptr<TraceSink>> sinks;
+    const auto traceStart = std::chrono::steady_clock::now();
+
+    TraceSink& CurrentSink()
+    {
+        thread_local TraceSink* sink = nullptr;
+        if (!sink)
+        {
+            std::lock_guard<std::mutex> lock(sinksMutex);
+            sinks.push_back(std::make_unique<TraceSink>());
+            sink = sinks.back().get();
+            sink->thread = (int)sinks.size();
+        }
+        return *sink;
+    }
+
+    int64_t Now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - traceStart).count();
+    }
+#endif
+}
+
+#ifdef PARSER_TRACING
+
+Instrumentation::Instrumentation(ExpressionParsingPrecedence prec, const int& tokensConsumed)
+    : prec(prec), tokensConsumed(tokensConsumed), begin(Now())
+{
+    CurrentSink().counters[(int)prec].entries++;
+}
+
+Instrumentation::~Instrumentation()
+{
+    TraceSink& sink = CurrentSink();
+    ParserTraceCounters& c = sink.counters[(int)prec];
+    if (success)
+    {
+        c.successes++;
+        c.tokensConsumed += tokensConsumed;
+    }
+    else
+    {
+        c.backtracks++;
+    }
+    sink.events.push_back({ prec, success, success ? tokensConsumed : 0, begin, Now() - begin });
+}
+
+ParserTraceLevels GetParserTraceCounters()
+{
+    std::lock_guard<std::mutex> lock(sinksMutex);
+    ParserTraceLevels ret;
+    for (auto& s : sinks)
+    {
+        for (int i = 0; i < EXPRESSION_PRECEDENCE_COUNT; i++)
+        {
+            ret[i].entries += s->counters[i].entries;
+            ret[i].successes += s->counters[i].successes;
+            ret[i].backtracks += s->counters[i].backtracks;
+            ret[i].tokensConsumed += s->counters[i].tokensConsumed;
+        }
+    }
+    return ret;
+}
+
+void ResetParserTrace()
+{
+    std::lock_guard<std::mutex> lock(sinksMutex);
+    for (auto& s : sinks)
+    {
+        s->counters = {};
+        s->events.clear();
+    }
+}
+
+void WriteParserTraceChrome(std::ostream& out)
+{
+    std::lock_guard<std::mutex> lock(sinksMutex);
+    out << "{\"traceEvents\":[";
+    bool first = true;
+    for (auto& s : sinks)
+    {
+        for (TraceEvent& e : s->events)
+        {
+            out << (first ? "\n" : ",\n") << "{\"name\":\"" << EXPRESSION_PREC_NAMES[(int)e.prec] << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << s->thread
+                << ",\"ts\":" << e.begin / 1000.0 << ",\"dur\":" << e.duration / 1000.0
+                << ",\"args\":{\"success\":" << (e.success ? "true" : "false") << ",\"tokens\":" << e.tokensConsumed << "}}";
+            first = false;
+        }
+    }
+    out << "\n],\"displayTimeUnit\":\"ns\"}\n";
+}
+
+#else
+
+ParserTraceLevels GetParserTraceCounters() { return {}; }
+void ResetParserTrace() {}
+void WriteParserTraceChrome(std::ostream& out) { out << "{\"traceEvents\":[]}\n"; }
+
+#endif
+
+void WriteParserTraceJson(std::ostream& out)
+{
+    ParserTraceLevels levels = GetParserTraceCounters();
+    out << "{";
+    for (int i = 0; i < EXPRESSION_PRECEDENCE_COUNT; i++)
+    {
+        const ParserTraceCounters& c = levels[i];
+        out << (i == 0 ? "\n" : ",\n") << "  \"" << EXPRESSION_PREC_NAMES[i] << "\": { \"entries\": " << c.entries << ", \"successes\": " << c.successes
+            << ", \"backtracks\": " << c.backtracks << ", \"tokensConsumed\": " << c.tokensConsumed << " }";
+    }
+    out << "\n}\n";
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include "Parser.h"
+#include <array>
+#include <cstdint>
+#include <iosfwd>
+
+// Structured tracing of the expression parser. Without PARSER_TRACING (build with -trace) Instrumentation is empty and compiles
+// to nothing. With it, every ParseExpression call is counted per precedence level and recorded as an event, per thread.
+
+constexpr int EXPRESSION_PRECEDENCE_COUNT = (int)ExpressionParsingPrecedence::Variable + 1;
+
+struct ParserTraceCounters
+{
+    uint64_t entries = 0;
+    uint64_t successes = 0;
+    uint64_t backtracks = 0;  // calls that failed, so the caller had to try something else
+    uint64_t tokensConsumed = 0;  // by successful calls
+};
+
+typedef std::array<ParserTraceCounters, EXPRESSION_PRECEDENCE_COUNT> ParserTraceLevels;
+
+#ifdef PARSER_TRACING
+
+struct Instrumentation
+{
+    ExpressionParsingPrecedence prec;
+    const int& tokensConsumed;
+    bool success = false;
+    int64_t begin;
+
+    Instrumentation(ExpressionParsingPrecedence prec, const int& tokensConsumed);
+    ~Instrumentation();
+
+    inline bool Succeed() { success = true; return true; }
+    inline bool Result(bool b) { success = b; return b; }
+};
+
+#else
+
+struct Instrumentation
+{
+    inline Instrumentation(ExpressionParsingPrecedence, const int&) {}
+
+    inline bool Succeed() { return true; }
+    inline bool Result(bool b) { return b; }
+};
+
+#endif
+
+// These see what all threads have recorded so far, and do nothing useful without PARSER_TRACING.
+ParserTraceLevels GetParserTraceCounters();
+void ResetParserTrace();
+void WriteParserTraceJson(std::ostream& out);  // the counters, by precedence level name
+void WriteParserTraceChrome(std::ostream& out);  // every call as a complete event, for chrome://tracing or Perfetto
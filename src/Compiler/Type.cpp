@@ -2,6 +2,12 @@
 #include "Lexer.h"
 #include "Assertion.h"
 #include "Parser.h"
+#include <algorithm>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <unordered_map>
+#include <utility>
 #include <variant>
 
 // This language's types fall into five categories
@@ -11,62 +17,51 @@
 // Lambdas, which are functions. Multiple arguments are represented as a sum. Can cast to another lambda where the arguments and return type cast accordingly. Can also curry???
 // Overloads, which are essentially sums, where each type is unique (up to casts) and can cast to any of its constituents. Can cast to a subset overload.
 //
-// We do not allow unions, overloads and records to contain only one item. As it is (probably) impossible to define such a type, we do not provide a nice error, instead asserting that there be more than one value. In the case of unions and overloads, we allow redundant copies of types, but these are not retained after parsing.
+// We do not allow unions, overloads and records to contain only one item. As it is (probably) impossible to define such a type, we do not provide a nice error, instead asserting that there be more than one value. In the case of unions and overloads, we allow redundant copies of types, but these are not retained after parsing, and the rest are kept in a canonical order (see TypeBefore), so the order they are written in does not matter.
 
 // Basically the rules are the following, where sums are <a,b>, unions are <a|b>, lambdas are <a->b> and overloads are <a&b>:
 
-UnionType::UnionType(std::vector<HeapAlloc<Type>> v)
-    : values(v)
+namespace
 {
-    Assert(values.size() > 1, "How did you construct a union with less than two elements?");
-
-    for (int i = 0; i < values.size(); i++)
+    // Sorts the members into their canonical order, which puts equal ones next to each other, and keeps one of each.
+    void Canonicalise(TypeList& values)
     {
-        for (int j = i + 1; j < values.size(); j++)
-        {
-            if (values[i].Get() == values[j].Get())
-            {
-                values.erase(values.begin() + j);
-                j--;
-            }
-        }
+        std::sort(values.begin(), values.end(), [](const HeapAlloc<Type>& a, const HeapAlloc<Type>& b) { return TypeBefore(a.Get(), b.Get()); });
+        values.erase(std::unique(values.begin(), values.end(), [](const HeapAlloc<Type>& a, const HeapAlloc<Type>& b) { return a.Get() == b.Get(); }), values.end());
     }
 }
 
-OverloadType::OverloadType(std::vector<HeapAlloc<Type>> v)
-    : values(v)
+UnionType::UnionType(TypeList v)
+    : values(std::move(v))
 {
-    Assert(values.size() > 1, "How did you construct an overload with less than two elements?");
+    Assert(values.size() > 1, "How did you construct a union with less than two elements?");
+    Canonicalise(values);
+}
 
-    for (int i = 0; i < values.size(); i++)
-    {
-        for (int j = i + 1; j < values.size(); j++)
-        {
-            if (values[i].Get() == values[j].Get())
-            {
-                values.erase(values.begin() + j);
-                j--;
-            }
-        }
-    }
+OverloadType::OverloadType(TypeList v)
+    : values(std::move(v))
+{
+    Assert(values.size() > 1, "How did you construct an overload with less than two elements?");
+    Canonicalise(values);
 }
 
-RecordType::RecordType(std::vector<HeapAlloc<Type>> v)
-    : values(v)
+RecordType::RecordType(TypeList v)
+    : values(std::move(v))
 {
     Assert(values.size() > 1, "How did you construct a record with less than two elements?");
 }
 
-LambdaType::LambdaType(HeapAlloc<Type> a, HeapAlloc<Type> r) : arg(a), ret(r)
+LambdaType::LambdaType(HeapAlloc<Type> a, HeapAlloc<Type> r) : arg(std::move(a)), ret(std::move(r))
 {
     bool isTemplate = false;
-    if (a.Get() == AtomicType::Template)
+    const Type& argType = std::as_const(arg).Get();
+    if (argType == AtomicType::Template)
     {
         isTemplate = true;
     }
-    else if (std::holds_alternative<OverloadType>(a.Get()))
+    else if (std::holds_alternative<OverloadType>(argType))
     {
-        for (HeapAlloc<Type>& t : std::get<OverloadType>(a.Get()).values)
+        for (const HeapAlloc<Type>& t : std::get<OverloadType>(argType).values)
         {
             if (t.Get() == AtomicType::Template)
             {
@@ -84,6 +79,13 @@ LambdaType::LambdaType(HeapAlloc<Type> a, HeapAlloc<Type> r) : arg(a), ret(r)
 }
 
 
+const Type& LambdaType::Ret() const
+{
+    if (!lazy) return ret.Get();
+    lazy->Parse();
+    return lazy->ret;
+}
+
 void LambdaType::ShareTemplates(Type& other, ParsingContext& pc)
 {
     if (!temp.has_value()) return;
@@ -93,65 +95,94 @@ void LambdaType::ShareTemplates(Type& other, ParsingContext& pc)
 }
 
 
-void TemplateLambda::CheckArgDef(int instArg, int definition, std::vector<ErrorOutput>& errors)
+namespace
 {
-    VectorView<Token>& vec = definitions[definition].first;
-    Type& a = instantiatedArgs[instArg].Get();
-
-    Assert(vec[0].type == TokenType::Symbol && vec[0].value == "(", "Checking arg def but the first token is not (.");
-    Expression expr = LiteralExpression{ AtomicType::Error, vec };
-    int consumed = 0;
-    ParsingContext pc = definitions[definition].second.Get();
-    if (!ParseExpression<ExpressionParsingPrecedence::MultiVarDef>(vec.SubView(1), pc, expr, consumed)) Assert(false, "Failed to parse lambda arguments while checking a template argument.");
-    Assert(vec[1+consumed].type == TokenType::Symbol && vec[1+consumed].value == ")", "Checking arg def but the arguments are not enclosed by ).");
-
-    if (std::holds_alternative<VariableExpression>(expr))
-    {
-        Assert(GetExpressionType(expr) == AtomicType::Template, "Checking arg def but the lambda is not templated.");
-        pc.varStack[std::get<VariableExpression>(expr).stackIndex].second = a;
-    }
-    else
+    TemplateInstance Instantiate(const VectorView<Token>& vec, const ParsingContext& context, const Type& a)
     {
-        Assert(std::holds_alternative<MultiExpression>(expr), "Checking arg def but somehow parsed out a non-multiexpression.");
-        Assert(std::holds_alternative<RecordType>(a) && std::get<RecordType>(a).values.size() == std::get<MultiExpression>(expr).elements.size(), "Parsed multiexpression does not have record type or record does not match in length.");
+        Assert(vec[0].type == TokenType::Symbol && vec[0].value == "(", "Checking arg def but the first token is not (.");
+        Expression expr = LiteralExpression{ AtomicType::Error, vec };
+        int consumed = 0;
+        ParsingContext pc = context.Fork();  // without the errors from before the definition, which were reported then
+        if (!ParseExpression<ExpressionParsingPrecedence::MultiVarDef>(vec.SubView(1), pc, expr, consumed)) Assert(false, "Failed to parse lambda arguments while checking a template argument.");
+        Assert(vec[1+consumed].type == TokenType::Symbol && vec[1+consumed].value == ")", "Checking arg def but the arguments are not enclosed by ).");
 
-        for (int i = 0; i < std::get<MultiExpression>(expr).elements.size(); i++)
+        if (std::holds_alternative<VariableExpression>(expr))
+        {
+            Assert(GetExpressionType(expr) == AtomicType::Template, "Checking arg def but the lambda is not templated.");
+            pc.varStack.Edit(std::get<VariableExpression>(expr).stackIndex).second = a;
+        }
+        else
         {
-            if (GetExpressionType(std::get<MultiExpression>(expr).elements[i].Get()) == AtomicType::Template)
+            Assert(std::holds_alternative<MultiExpression>(expr), "Checking arg def but somehow parsed out a non-multiexpression.");
+            Assert(std::holds_alternative<RecordType>(a) && std::get<RecordType>(a).values.size() == std::get<MultiExpression>(expr).elements.size(), "Parsed multiexpression does not have record type or record does not match in length.");
+
+            for (int i = 0; i < std::get<MultiExpression>(expr).elements.size(); i++)
             {
-                pc.varStack[std::get<VariableExpression>(std::get<MultiExpression>(expr).elements[i].Get()).stackIndex].second = std::get<RecordType>(a).values[i].Get();
+                if (GetExpressionType(std::get<MultiExpression>(expr).elements[i].Get()) == AtomicType::Template)
+                {
+                    pc.varStack.Edit(std::get<VariableExpression>(std::get<MultiExpression>(expr).elements[i].Get()).stackIndex).second = std::get<RecordType>(a).values[i].Get();
+                }
             }
         }
+
+        // Parsing context is ready, time to parse
+        Statement oStat = SingleStatement{ { LiteralExpression{ AtomicType::Error, vec } } };
+        if (!ParseStatement(vec.SubView(consumed + 2), pc, oStat, consumed)) Assert(false, "Failed to parse lambda, should already be parsed by the template instantiation phase.");  // this should be true, because the statement should have already been checked, if not type checked. The important part here is that we add the relevant errors to the parsing context.
+        return { { GetStatementType(oStat) }, std::move(pc.errors) };
     }
+}
+
+void TemplateLambda::CheckArgDef(int instArg, int definition, std::vector<ErrorOutput>& errors)
+{
+    const Type& a = std::as_const(instantiatedArgs[instArg]).Get();
+    while (instances.size() <= definition) instances.push_back(std::make_shared<TemplateInstances>());
+    TemplateInstances& known = *instances[definition];
+
+    // Template lambdas with the same id can give different instances, so arguments holding them are always parsed.
+    std::optional<TemplateInstance> uncached;
+    bool cacheable = !HasTemplateLambda(a);
+    TypeId arg = cacheable ? GetTypeId(a) : 0;
 
-    // Parsing context is ready, time to parse
-    Statement oStat = SingleStatement{ { LiteralExpression{ AtomicType::Error, vec } } };
-    if (!ParseStatement(vec.SubView(consumed + 2), pc, oStat, consumed)) Assert(false, "Failed to parse lambda, should already be parsed by the template instantiation phase.");  // this should be true, because the statement should have already been checked, if not type checked. The important part here is that we add the relevant errors to the parsing context.
-    for (ErrorOutput& err : pc.errors)
+    const TemplateInstance* inst = nullptr;
+    if (!cacheable)
+    {
+        uncached = Instantiate(definitions[definition].first, std::as_const(definitions[definition].second).Get(), a);
+        inst = &uncached.value();
+    }
+    else
+    {
+        std::lock_guard<std::mutex> lock(known.mutex);
+        auto found = known.byArg.find(arg);
+        if (found != known.byArg.end()) inst = &found->second;
+    }
+    if (!inst)  // parsed without the lock, as the body can instantiate other template lambdas
     {
-        errors.push_back(err);
+        TemplateInstance parsed = Instantiate(definitions[definition].first, std::as_const(definitions[definition].second).Get(), a);
+        std::lock_guard<std::mutex> lock(known.mutex);
+        inst = &known.byArg.emplace(arg, std::move(parsed)).first->second;
     }
+    errors.insert(errors.end(), inst->errors.begin(), inst->errors.end());
 
     while (returnTypes.size() <= instArg) returnTypes.push_back({ ReturnTypeSet{ {}, false } });
-    for (Type& t : GetStatementType(oStat).types)
+    for (const Type& t : inst->returnTypes.Get().types)
     {
         bool isRepeated = false;
 
         // TODO: fix the bug this introduces, where the correct returned template lambda instance may not be generated (is this true???)
-        for (Type& s : returnTypes[instArg].Get().types) { if (t == s) { isRepeated = true; break; } }
+        for (const Type& s : std::as_const(returnTypes[instArg]).Get().types) { if (t == s) { isRepeated = true; break; } }
         if (isRepeated) continue;
 
         returnTypes[instArg].Get().types.push_back(t);
     };
-    if (GetStatementType(oStat).isOptional)
+    if (inst->returnTypes.Get().isOptional)
     {
         returnTypes[instArg].Get().isOptional = true;
     }
 }
 
-void TemplateLambda::AddInstArgs(Type a, ParsingContext& pc)
+void TemplateLambda::AddInstArgs(const Type& a, ParsingContext& pc)
 {
-    for (HeapAlloc<Type>& i : instantiatedArgs)
+    for (const HeapAlloc<Type>& i : instantiatedArgs)
     {
         if (i.Get() == a) return;  // don't check existing types
     }
@@ -163,9 +194,9 @@ void TemplateLambda::AddInstArgs(Type a, ParsingContext& pc)
     }
 }
 
-bool TemplateLambda::CheckAddInstArgs(Type a)
+bool TemplateLambda::CheckAddInstArgs(const Type& a)
 {
-    for (HeapAlloc<Type>& i : instantiatedArgs)
+    for (const HeapAlloc<Type>& i : instantiatedArgs)
     {
         if (i.Get() == a) return true;  // don't check existing types
     }
@@ -188,26 +219,35 @@ bool TemplateLambda::CheckAddInstArgs(Type a)
 }
 
 void TemplateLambda::AddDefinition(VectorView<Token> tokens, ParsingContext& pc)
+{
+    AddDefinition(tokens, { pc.Fork() }, std::make_shared<TemplateInstances>(), pc.errors);
+}
+
+// Takes the context the definition was made in as it is, so that definitions moved between template lambdas share it, and the
+// instances already known for it.
+void TemplateLambda::AddDefinition(VectorView<Token> tokens, HeapAlloc<ParsingContext> context, std::shared_ptr<TemplateInstances> known, std::vector<ErrorOutput>& errors)
 {
     for (std::pair<VectorView<Token>, HeapAlloc<ParsingContext>>& i : definitions)
     {
         if (i.first == tokens) return;  // don't check existing functions
     }
-    definitions.push_back({ tokens, { pc } });
+    while (instances.size() < definitions.size()) instances.push_back(std::make_shared<TemplateInstances>());
+    definitions.push_back({ tokens, std::move(context) });
+    instances.push_back(std::move(known));
 
     for (int i = 0; i < instantiatedArgs.size(); i++)
     {
-        CheckArgDef(i, definitions.size() - 1, pc.errors);
+        CheckArgDef(i, definitions.size() - 1, errors);
     }
 }
 
-Type TemplateLambda::GetReturnType(Type a)
+Type TemplateLambda::GetReturnType(const Type& a)
 {
     for (int i = 0; i < instantiatedArgs.size(); i++)
     {
-        if (a == instantiatedArgs[i].Get())
+        if (a == std::as_const(instantiatedArgs[i]).Get())
         {
-            return returnTypes[i].Get().ToType();
+            return std::as_const(returnTypes[i]).Get().ToType();
         }
     }
 
@@ -221,55 +261,202 @@ TemplateLambda TemplateLambda::AddTL(const TemplateLambda& a, const TemplateLamb
     {
         ret.AddInstArgs(i.Get(), pc);
     }
-    for (auto& i : b.definitions)
+    for (int i = 0; i < b.definitions.size(); i++)
     {
-        ParsingContext npc = i.second.Get();
-        npc.errors = pc.errors;
-        ret.AddDefinition(i.first, npc);
-        pc.errors = npc.errors;
+        std::shared_ptr<TemplateInstances> known = i < b.instances.size() ? b.instances[i] : std::make_shared<TemplateInstances>();
+        ret.AddDefinition(b.definitions[i].first, b.definitions[i].second, std::move(known), pc.errors);
     }
     return ret;
 }
 
 
-bool operator==(const Type& a, const Type& b)
+namespace
 {
-    if (std::holds_alternative<AtomicType>(a) && std::holds_alternative<AtomicType>(b))
+    // The ids of the atomic types are their values plus one, and the interned ones come after those.
+    constexpr TypeId ATOMIC_TYPE_IDS = (TypeId)AtomicType::Boolean + 2;
+
+    struct TypeKeyHash
     {
-        return std::get<AtomicType>(a) == std::get<AtomicType>(b);
+        size_t operator()(const std::vector<TypeId>& key) const
+        {
+            uint64_t h = 0xcbf29ce484222325;
+            for (TypeId t : key) h = (h ^ t) * 0x100000001b3;
+            return (size_t)(h ^ (h >> 32));
+        }
+    };
+
+    // Each interned type by its kind and the ids of its parts. Ids are never given back, so the table only grows, and it is shared
+    // between threads because types are made on the threads of the parallel parser and then moved into one context.
+    class TypeTable
+    {
+        std::shared_mutex mutex;
+        std::unordered_map<std::vector<TypeId>, TypeId, TypeKeyHash> ids;
+
+    public:
+        TypeId Intern(const std::vector<TypeId>& key)
+        {
+            {
+                std::shared_lock<std::shared_mutex> lock(mutex);
+                auto found = ids.find(key);
+                if (found != ids.end()) return found->second;
+            }
+            std::unique_lock<std::shared_mutex> lock(mutex);
+            return ids.insert({ key, ATOMIC_TYPE_IDS + (TypeId)ids.size() }).first->second;
+        }
+
+        static TypeTable& Global()
+        {
+            static TypeTable table;
+            return table;
+        }
+    };
+
+    // Whether a type can be cast to another, by the ids of both. Types are finite trees, so working out a cast only ever asks
+    // about smaller pairs and never waits on itself, and only finished answers go in.
+    class CastCache
+    {
+        std::shared_mutex mutex;
+        std::unordered_map<uint64_t, bool> castable;
+
+    public:
+        std::atomic<uint64_t> hits = 0;
+        std::atomic<uint64_t> misses = 0;
+
+        std::optional<bool> Find(uint64_t key)
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            auto found = castable.find(key);
+            if (found == castable.end()) return std::nullopt;
+            return found->second;
+        }
+
+        void Insert(uint64_t key, bool value)
+        {
+            std::unique_lock<std::shared_mutex> lock(mutex);
+            castable.insert({ key, value });
+        }
+
+        static CastCache& Global()
+        {
+            static CastCache cache;
+            return cache;
+        }
+    };
+
+    // Set when a cast had to instantiate a template lambda, whose answer depends on its definitions rather than its type alone.
+    thread_local bool castUsedTemplate = false;
+
+    uint64_t HashCombine(uint64_t h, uint64_t v)
+    {
+        h ^= v + 0x9e3779b97f4a7c15 + (h << 6) + (h >> 2);
+        h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9;
+        return h ^ (h >> 31);
     }
-    else if (std::holds_alternative<UnionType>(a) && std::holds_alternative<UnionType>(b))
+
+    const InternedId& IdOf(const Type& t)
     {
-        auto av = std::get<UnionType>(a).values;
-        auto bv = std::get<UnionType>(b).values;
-        if (av.size() != bv.size()) return false;
-        for (int i = 0; i < av.size(); i++) if (av[i].Get() != bv[i].Get()) return false;
-        return true;
+        if (std::holds_alternative<UnionType>(t)) return std::get<UnionType>(t).id;
+        if (std::holds_alternative<OverloadType>(t)) return std::get<OverloadType>(t).id;
+        if (std::holds_alternative<RecordType>(t)) return std::get<RecordType>(t).id;
+        return std::get<LambdaType>(t).id;
     }
-    else if (std::holds_alternative<OverloadType>(a) && std::holds_alternative<OverloadType>(b))
+
+    // The parts are worked out before the table is locked, as the return type of a lazy lambda may have to be parsed first.
+    TypeId Intern(size_t kind, const TypeList& values, const InternedId& id)
     {
-        auto av = std::get<OverloadType>(a).values;
-        auto bv = std::get<OverloadType>(b).values;
-        if (av.size() != bv.size()) return false;
-        for (int i = 0; i < av.size(); i++) if (av[i].Get() != bv[i].Get()) return false;
-        return true;
+        if (TypeId known = id.Get()) return known;
+
+        std::vector<TypeId> key = { (TypeId)kind };
+        key.reserve(values.size() + 1);
+        uint64_t hash = HashCombine(0, kind);
+        for (const HeapAlloc<Type>& v : values)
+        {
+            key.push_back(GetTypeId(v.Get()));
+            hash = HashCombine(hash, GetTypeHash(v.Get()));
+        }
+        id.Set(TypeTable::Global().Intern(key), hash);
+        return id.Get();
+    }
+
+    // Whether a type is a member of a union or overload, by binary search.
+    bool IsMember(const Type& t, const TypeList& values)
+    {
+        auto found = std::lower_bound(values.begin(), values.end(), t, [](const HeapAlloc<Type>& v, const Type& t) { return TypeBefore(v.Get(), t); });
+        return found != values.end() && found->Get() == t;
     }
-    else if (std::holds_alternative<RecordType>(a) && std::holds_alternative<RecordType>(b))
+
+    // Whether every member of one union or overload is a member of another, walking both in order at once.
+    bool IsSubset(const TypeList& sub, const TypeList& values)
     {
-        auto av = std::get<RecordType>(a).values;
-        auto bv = std::get<RecordType>(b).values;
-        if (av.size() != bv.size()) return false;
-        for (int i = 0; i < av.size(); i++) if (av[i].Get() != bv[i].Get()) return false;
+        size_t j = 0;
+        for (const HeapAlloc<Type>& i : sub)
+        {
+            while (j < values.size() && TypeBefore(values[j].Get(), i.Get())) j++;
+            if (j == values.size() || values[j].Get() != i.Get()) return false;
+        }
         return true;
     }
-    else if (std::holds_alternative<LambdaType>(a) && std::holds_alternative<LambdaType>(b))
+}
+
+TypeId GetTypeId(const Type& t)
+{
+    if (std::holds_alternative<AtomicType>(t))
+    {
+        return (TypeId)std::get<AtomicType>(t) + 1;
+    }
+    else if (std::holds_alternative<UnionType>(t))
     {
-        return std::get<LambdaType>(a).arg.Get() == std::get<LambdaType>(b).arg.Get() && std::get<LambdaType>(a).ret.Get() == std::get<LambdaType>(b).ret.Get();
+        return Intern(t.index(), std::get<UnionType>(t).values, std::get<UnionType>(t).id);
+    }
+    else if (std::holds_alternative<OverloadType>(t))
+    {
+        return Intern(t.index(), std::get<OverloadType>(t).values, std::get<OverloadType>(t).id);
+    }
+    else if (std::holds_alternative<RecordType>(t))
+    {
+        return Intern(t.index(), std::get<RecordType>(t).values, std::get<RecordType>(t).id);
     }
     else
     {
-        return false;
+        const LambdaType& l = std::get<LambdaType>(t);
+        if (!l.id.Get())
+        {
+            TypeId arg = GetTypeId(l.arg.Get());
+            TypeId ret = GetTypeId(l.Ret());
+            uint64_t hash = HashCombine(HashCombine(HashCombine(0, t.index()), GetTypeHash(l.arg.Get())), GetTypeHash(l.Ret()));
+            l.id.Set(TypeTable::Global().Intern({ (TypeId)t.index(), arg, ret }), hash);
+        }
+        return l.id.Get();
+    }
+}
+
+uint64_t GetTypeHash(const Type& t)
+{
+    if (std::holds_alternative<AtomicType>(t)) return HashCombine(0, GetTypeId(t));
+    GetTypeId(t);
+    return IdOf(t).Hash();
+}
+
+bool TypeBefore(const Type& a, const Type& b)
+{
+    if (a.index() != b.index()) return a.index() < b.index();
+    if (std::holds_alternative<AtomicType>(a)) return std::get<AtomicType>(a) < std::get<AtomicType>(b);
+    uint64_t ha = GetTypeHash(a), hb = GetTypeHash(b);
+    if (ha != hb) return ha < hb;
+    return GetTypeId(a) < GetTypeId(b);  // only for different types with the same hash, which is next to never
+}
+
+bool operator==(const Type& a, const Type& b)
+{
+    if (a.index() != b.index()) return false;
+    if (std::holds_alternative<AtomicType>(a)) return std::get<AtomicType>(a) == std::get<AtomicType>(b);
+    if (std::holds_alternative<LambdaType>(a))  // arguments first, so that the body of a lazy lambda is only parsed if they match
+    {
+        const LambdaType& la = std::get<LambdaType>(a);
+        const LambdaType& lb = std::get<LambdaType>(b);
+        if ((!la.id.Get() || !lb.id.Get()) && GetTypeId(la.arg.Get()) != GetTypeId(lb.arg.Get())) return false;
     }
+    return GetTypeId(a) == GetTypeId(b);
 }
 
 bool operator!=(const Type& a, const Type& b)
@@ -278,34 +465,49 @@ bool operator!=(const Type& a, const Type& b)
 }
 
 
-// Remember, Unions cast up, Overloads cast down.
-bool CheckCast(Type from, Type to)
+bool CheckCastUncached(const Type& from, const Type& to);
+
+// Casts between lambdas are not cached, as the answer can depend on a template lambda, and ids would parse lazy bodies.
+bool CheckCast(const Type& from, const Type& to)
 {
     if (from == to) return true;
+    if (std::holds_alternative<LambdaType>(from) || std::holds_alternative<LambdaType>(to)) return CheckCastUncached(from, to);
+
+    CastCache& cache = CastCache::Global();
+    uint64_t key = (uint64_t)GetTypeId(from) << 32 | GetTypeId(to);
+    if (std::optional<bool> found = cache.Find(key))
+    {
+        cache.hits++;
+        return found.value();
+    }
+    cache.misses++;
 
+    bool outerUsedTemplate = castUsedTemplate;
+    castUsedTemplate = false;
+    bool castable = CheckCastUncached(from, to);
+    if (!castUsedTemplate) cache.Insert(key, castable);
+    castUsedTemplate = castUsedTemplate || outerUsedTemplate;
+    return castable;
+}
+
+CastCacheStats GetCastCacheStats()
+{
+    return { CastCache::Global().hits.load(), CastCache::Global().misses.load() };
+}
+
+// Remember, Unions cast up, Overloads cast down.
+bool CheckCastUncached(const Type& from, const Type& to)
+{
     if (std::holds_alternative<OverloadType>(from))  // overload from case
     {
-        for (HeapAlloc<Type>& i : std::get<OverloadType>(from).values)
+        for (const HeapAlloc<Type>& i : std::get<OverloadType>(from).values)
         {
             if (CheckCast(i.Get(), to)) return true;  // can cast an overload to one of its elements
         }
 
         if (std::holds_alternative<OverloadType>(to))  // casting an overload down
         {
-            for (HeapAlloc<Type>& i : std::get<OverloadType>(to).values)
-            {
-                bool didMatch = false;
-                for (HeapAlloc<Type>& j : std::get<OverloadType>(from).values)
-                {
-                    if (i.Get() == j.Get())
-                    {
-                        didMatch = true;
-                        break;
-                    }
-                }
-                if (!didMatch) return false;  // new overload had a type that was not in the old overload
-            }
-            return true;  // new overload is a subset of the old overload
+            return IsSubset(std::get<OverloadType>(to).values, std::get<OverloadType>(from).values);  // new overload is a subset of the old overload
         }
         else
         {
@@ -315,27 +517,15 @@ bool CheckCast(Type from, Type to)
 
     if (std::holds_alternative<UnionType>(to))  // to union case
     {
-        for (HeapAlloc<Type>& i : std::get<UnionType>(to).values)
+        if (IsMember(from, std::get<UnionType>(to).values)) return true;
+        for (const HeapAlloc<Type>& i : std::get<UnionType>(to).values)
         {
             if (CheckCast(from, i.Get())) return true;  // can cast to a union containing you
         }
 
         if (std::holds_alternative<UnionType>(from))  // casting a union up
         {
-            for (HeapAlloc<Type>& i : std::get<UnionType>(from).values)
-            {
-                bool didMatch = false;
-                for (HeapAlloc<Type>& j : std::get<UnionType>(to).values)
-                {
-                    if (i.Get() == j.Get())
-                    {
-                        didMatch = true;
-                        break;
-                    }
-                }
-                if (!didMatch) return false;  // old union had a type that was not in the new overload
-            }
-            return true;  // old union is a subset of the new union
+            return IsSubset(std::get<UnionType>(from).values, std::get<UnionType>(to).values);  // old union is a subset of the new union
         }
         else
         {
@@ -383,7 +573,9 @@ bool CheckCast(Type from, Type to)
     {
         if (std::get<LambdaType>(from).temp.has_value() && !std::get<LambdaType>(to).temp.has_value())
         {
-            if (std::get<LambdaType>(from).temp.value().CheckAddInstArgs(std::get<LambdaType>(to).arg.Get()))
+            castUsedTemplate = true;
+            TemplateLambda temp = std::get<LambdaType>(from).temp.value();  // checking instantiates, but only a copy, as from is left as it is
+            if (temp.CheckAddInstArgs(std::get<LambdaType>(to).arg.Get()))
             {
                 return true;
             }
@@ -393,7 +585,7 @@ bool CheckCast(Type from, Type to)
     return false;
 }
 
-bool IsTemplateType(Type type)
+bool IsTemplateType(const Type& type)
 {
     if (std::holds_alternative<AtomicType>(type))
     {
@@ -401,21 +593,21 @@ bool IsTemplateType(Type type)
     }
     else if (std::holds_alternative<UnionType>(type))
     {
-        for (auto t : std::get<UnionType>(type).values)
+        for (const HeapAlloc<Type>& t : std::get<UnionType>(type).values)
         {
             if (IsTemplateType(t.Get())) return true;
         }
     }
     else if (std::holds_alternative<OverloadType>(type))
     {
-        for (auto t : std::get<OverloadType>(type).values)
+        for (const HeapAlloc<Type>& t : std::get<OverloadType>(type).values)
         {
             if (IsTemplateType(t.Get())) return true;
         }
     }
     else if (std::holds_alternative<RecordType>(type))
     {
-        for (auto t : std::get<RecordType>(type).values)
+        for (const HeapAlloc<Type>& t : std::get<RecordType>(type).values)
         {
             if (IsTemplateType(t.Get())) return true;
         }
@@ -427,7 +619,7 @@ bool IsTemplateType(Type type)
         if (!std::get<LambdaType>(type).temp.has_value())
         {
             if (IsTemplateType(std::get<LambdaType>(type).arg.Get())) return true;
-            if (IsTemplateType(std::get<LambdaType>(type).ret.Get())) return true;
+            if (IsTemplateType(std::get<LambdaType>(type).Ret())) return true;
         }
     }
 
@@ -435,21 +627,127 @@ bool IsTemplateType(Type type)
 }
 
 
+ParsingCheckpoint ParsingContext::Checkpoint()
+{
+    openCheckpoints++;
+    return { varStack.size(), errors.size(), varStackUndo.size(), reportedUndo.size(), openCheckpoints };
+}
+
+void ParsingContext::Rollback(const ParsingCheckpoint& cp, bool keepErrors)
+{
+    Restore(cp, keepErrors);
+    Commit(cp);
+}
+
+void ParsingContext::Restore(const ParsingCheckpoint& cp, bool keepErrors)
+{
+    for (size_t i = varStackUndo.size(); i > cp.undoSize; i--)
+    {
+        std::pair<int, Type>& undo = varStackUndo[i - 1];
+        if (undo.first < varStack.size()) varStack.Edit(undo.first).second = std::move(undo.second);
+    }
+    varStackUndo.erase(varStackUndo.begin() + cp.undoSize, varStackUndo.end());
+    PopVariables(cp.varStackSize);
+    if (keepErrors) return;
+    errors.erase(errors.begin() + cp.errorCount, errors.end());
+    for (size_t i = cp.reportedCount; i < reportedUndo.size(); i++) reportedUndo[i]->reported = false;
+    reportedUndo.erase(reportedUndo.begin() + cp.reportedCount, reportedUndo.end());
+}
+
+void ParsingContext::Commit(const ParsingCheckpoint& cp)
+{
+    Assert(openCheckpoints > 0, "Closed a parsing checkpoint twice.");
+    Assert(cp.depth == openCheckpoints && cp.undoSize <= varStackUndo.size() && cp.varStackSize <= varStack.size(), "Closed a parsing checkpoint that is not the innermost open one.");
+    if (--openCheckpoints == 0)  // nothing left that could be rolled back
+    {
+        varStackUndo.clear();
+        reportedUndo.clear();
+    }
+}
+
+void ParsingContext::SetVariableType(int stackIndex, Type t)
+{
+    if (openCheckpoints > 0) varStackUndo.push_back({ stackIndex, std::move(varStack.Edit(stackIndex).second) });
+    varStack.Edit(stackIndex).second = std::move(t);
+}
+
+void ParsingContext::ReportLazyErrors(const std::shared_ptr<LazyLambda>& lazy)
+{
+    if (lazy->reported) return;
+    lazy->Parse();
+    errors.insert(errors.end(), lazy->errors.begin(), lazy->errors.end());
+    lazy->reported = true;
+    if (openCheckpoints > 0) reportedUndo.push_back(lazy);
+}
+
+void ParsingContext::IndexVariables()
+{
+    for (int i = shadowed.size(); i < varStack.size(); i++)
+    {
+        SymbolId name = varStack[i].first;
+        if (name >= innermost.size()) innermost.resize(name + 1, -1);
+        shadowed.push_back(innermost[name]);
+        innermost.Edit(name) = i;
+    }
+}
+
+int ParsingContext::FindVariable(SymbolId name)
+{
+    IndexVariables();
+    return name < innermost.size() ? innermost[name] : -1;
+}
+
+int ParsingContext::AddVariable(SymbolId name, Type t)
+{
+    varStack.push_back({ name, std::move(t) });
+    IndexVariables();
+    return varStack.size() - 1;
+}
+
+void ParsingContext::PopVariables(size_t stackSize)
+{
+    for (size_t i = shadowed.size(); i > stackSize; i--)
+    {
+        innermost.Edit(varStack[i - 1].first) = shadowed[i - 1];
+    }
+    if (shadowed.size() > stackSize) shadowed.resize(stackSize);
+    if (varStack.size() > stackSize) varStack.resize(stackSize);
+}
+
+ParsingContext ParsingContext::Fork() const
+{
+    ParsingContext fork;
+    fork.varStack = varStack;
+    fork.typedefs = typedefs;
+    fork.lazyLambdas = lazyLambdas;
+    fork.innermost = innermost;
+    fork.shadowed = shadowed;
+    return fork;
+}
+
+SharedTypedefs DefaultTypedefs()
+{
+    static const SharedTypedefs builtIn = std::make_shared<const std::map<SymbolId, Type>>(std::map<SymbolId, Type>{ { (SymbolId)Keyword::Int, AtomicType::Integer }, { (SymbolId)Keyword::Double, AtomicType::Double }, { (SymbolId)Keyword::String, AtomicType::String }, { (SymbolId)Keyword::Bool, AtomicType::Boolean } });
+    return builtIn;
+}
+
+
 bool ParseType(VectorView<Token> tokens, ParsingContext& ctx, Type& outType, int& tokensConsumed, TypeParsingPrecedence tp)
 {
     if (tp == TypeParsingPrecedence::Atomic)
     {
         if (tokens[0].type == TokenType::Text)
         {
-            if (ctx.typedefs.count(tokens[0].value))
+            auto found = ctx.typedefs->find(tokens[0].symbol);
+            if (found != ctx.typedefs->end())
             {
-                outType = ctx.typedefs[tokens[0].value];
+                outType = found->second;
                 tokensConsumed = 1;
                 return true;
             }
             else
             {
-                ctx.errors.push_back({ "Unknown atomic type: " + tokens[0].value + ".", tokens[0].pos });
+                ctx.errors.push_back({ "Unknown atomic type: " + std::string(tokens[0].value) + ".", tokens.Pos(0) });
                 outType = AtomicType::Error;
                 tokensConsumed = 1;
                 return true;
@@ -465,7 +763,7 @@ bool ParseType(VectorView<Token> tokens, ParsingContext& ctx, Type& outType, int
         if (!ParseType(tokens.SubView(1), ctx, outType, tokensConsumed, TypeParsingPrecedence::Record)) return false;
         if (tokens[tokensConsumed + 1].type != TokenType::Symbol || tokens[tokensConsumed + 1].value != ")")
         {
-            ctx.errors.push_back({ "No closing bracket.", tokens[0].pos });
+            ctx.errors.push_back({ "No closing bracket.", tokens.Pos(0) });
             return false;
         }
         else
@@ -481,7 +779,7 @@ bool ParseType(VectorView<Token> tokens, ParsingContext& ctx, Type& outType, int
     {
         if (tokens[tokensConsumed].type == TokenType::Symbol && tokens[tokensConsumed].value == ",")
         {
-            std::vector<HeapAlloc<Type>> recordVec = { { outType } };
+            TypeList recordVec = { { outType } };
             while (tokens[tokensConsumed].type == TokenType::Symbol && tokens[tokensConsumed].value == ",")
             {
                 tokensConsumed += 1;
@@ -508,7 +806,7 @@ bool ParseType(VectorView<Token> tokens, ParsingContext& ctx, Type& outType, int
     {
         if (tokens[tokensConsumed].type == TokenType::Symbol && tokens[tokensConsumed].value == "|")
         {
-            std::vector<HeapAlloc<Type>> unionVec = { { outType } };
+            TypeList unionVec = { { outType } };
             while (tokens[tokensConsumed].type == TokenType::Symbol && tokens[tokensConsumed].value == "|")
             {
                 tokensConsumed += 1;
@@ -535,7 +833,7 @@ bool ParseType(VectorView<Token> tokens, ParsingContext& ctx, Type& outType, int
     {
         if (tokens[tokensConsumed].type == TokenType::Symbol && tokens[tokensConsumed].value == "&")
         {
-            std::vector<HeapAlloc<Type>> overloadVec = { { outType } };
+            TypeList overloadVec = { { outType } };
             while (tokens[tokensConsumed].type == TokenType::Symbol && tokens[tokensConsumed].value == "&")
             {
                 tokensConsumed += 1;
@@ -586,4 +884,19 @@ bool ParseType(VectorView<Token> tokens, ParsingContext& ctx, Type& outType, int
     }
 }
 
-
+bool HasTemplateLambda(const Type& type)
+{
+    auto any = [](const TypeList& values)
+    {
+        return std::any_of(values.begin(), values.end(), [](const HeapAlloc<Type>& v) { return HasTemplateLambda(v.Get()); });
+    };
+    if (std::holds_alternative<UnionType>(type)) return any(std::get<UnionType>(type).values);
+    if (std::holds_alternative<OverloadType>(type)) return any(std::get<OverloadType>(type).values);
+    if (std::holds_alternative<RecordType>(type)) return any(std::get<RecordType>(type).values);
+    if (std::holds_alternative<LambdaType>(type))
+    {
+        const LambdaType& l = std::get<LambdaType>(type);
+        return l.temp.has_value() || HasTemplateLambda(l.arg.Get()) || HasTemplateLambda(l.ret.Get());
+    }
+    return false;
+}
@@ -1,8 +1,16 @@
 #pragma once
 #include "Assertion.h"
 #include "Lexer.h"
+#include "SmallVector.h"
+#include <atomic>
+#include <initializer_list>
+#include <cstdint>
 #include <variant>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 #include <map>
 
@@ -19,41 +27,116 @@
 template<typename T>
 struct VectorView
 {
-    std::vector<T>& vec;
+    const std::vector<T>* vec;
     int begin;
 
-    inline const T& operator[](int i) { return vec[begin + i]; }
-    inline VectorView SubView(int nb) { return { vec, begin + nb }; }
+    inline const T& operator[](int i) const { return (*vec)[begin + i]; }
+    inline VectorView SubView(int nb) const { return { *vec, begin + nb }; }
 
-    inline VectorView(std::vector<T>& v, int b) : vec(v), begin(b) {}
-    inline VectorView(const VectorView<T>& other) : vec(other.vec), begin(other.begin) {}
-    inline VectorView<T>& operator=(const VectorView<T>& other) { vec = other.vec; begin = other.begin; return *this; }
+    inline VectorView(const std::vector<T>& v, int b) : vec(&v), begin(b) {}
 
-    inline bool operator==(VectorView<T> other) { return begin == other.begin && &vec == &other.vec; }
+    inline bool operator==(VectorView<T> other) const { return begin == other.begin && vec == other.vec; }
 };
 
+// Tokens are read out of the parallel arrays of a TokenStream, so a view of them is just a cursor into the stream.
+template<>
+struct VectorView<Token>
+{
+    const TokenStream* stream;
+    int begin;
+
+    inline Token operator[](int i) const { return (*stream)[begin + i]; }
+    inline TextPosition Pos(int i) const { return stream->GetPosition(begin + i); }
+    inline int Integer(int i) const { return stream->Integer(begin + i); }
+    inline double Decimal(int i) const { return stream->Decimal(begin + i); }
+    inline VectorView SubView(int nb) const { return { *stream, begin + nb }; }
+
+    inline VectorView(const TokenStream& s, int b) : stream(&s), begin(b) {}
+
+    inline bool operator==(VectorView<Token> other) const { return begin == other.begin && stream == other.stream; }
+};
+
+// A value on the heap that copies share until one of them is changed, so copying a tree of them only copies its top. Changing
+// goes through the non-const Get, which first makes a copy of the value if anything else still shares it; a reference it returns
+// stays safe to change through only until this HeapAlloc is next copied.
 template<typename T>
 class HeapAlloc
 {
-    T* val;
+    std::shared_ptr<T> val;
 public:
-    T& Get() { return *val; }
+    T& Get()
+    {
+        if (val.use_count() > 1) val = std::make_shared<T>(*val);
+        else std::atomic_thread_fence(std::memory_order_acquire);  // after whoever let go of the value last, on another thread
+        return *val;
+    }
     const T& Get() const { return *val; }
 
-    HeapAlloc(const T& v)
+    HeapAlloc(const T& v) : val(std::make_shared<T>(v)) {}
+    HeapAlloc(T&& v) : val(std::make_shared<T>(std::move(v))) {}
+    // Both assignments are safe when other lives inside *this, as in x = x.Get().child, as the old value is freed last.
+    HeapAlloc(const HeapAlloc<T>& other) = default;
+    HeapAlloc(HeapAlloc<T>&& other) noexcept = default;
+    HeapAlloc& operator=(const HeapAlloc& other) = default;
+    HeapAlloc& operator=(HeapAlloc&& other) noexcept = default;
+};
+
+// A vector that copies share the elements of, so that copying one costs a pointer per 32 elements plus at most 32 elements. Full
+// chunks of 32 are shared, and only the last, partial one belongs to each copy. Changing an element of a shared chunk through Edit
+// copies that chunk first, the way HeapAlloc does; appending and removing from the end never touch the shared chunks.
+template<typename T>
+class PersistentVector
+{
+    static constexpr size_t CHUNK = 32;
+    std::vector<HeapAlloc<std::vector<T>>> chunks;
+    std::vector<T> tail;
+
+public:
+    class const_iterator
     {
-        val = new T{v};
-    }
-    HeapAlloc(const HeapAlloc<T>& other)
+        const PersistentVector* vec;
+        size_t i;
+    public:
+        const_iterator(const PersistentVector* v, size_t index) : vec(v), i(index) {}
+        const T& operator*() const { return (*vec)[i]; }
+        const T* operator->() const { return &(*vec)[i]; }
+        const_iterator& operator++() { i++; return *this; }
+        bool operator==(const const_iterator& other) const { return i == other.i; }
+        bool operator!=(const const_iterator& other) const { return i != other.i; }
+    };
+
+    PersistentVector() = default;
+    PersistentVector(std::initializer_list<T> values) { for (const T& v : values) push_back(v); }
+
+    size_t size() const { return chunks.size() * CHUNK + tail.size(); }
+    bool empty() const { return size() == 0; }
+
+    const T& operator[](size_t i) const { return i < chunks.size() * CHUNK ? chunks[i / CHUNK].Get()[i % CHUNK] : tail[i - chunks.size() * CHUNK]; }
+    T& Edit(size_t i) { return i < chunks.size() * CHUNK ? chunks[i / CHUNK].Get()[i % CHUNK] : tail[i - chunks.size() * CHUNK]; }
+
+    const_iterator begin() const { return { this, 0 }; }
+    const_iterator end() const { return { this, size() }; }
+
+    void push_back(T v)
     {
-        val = new T{other.Get()};
+        if (tail.empty()) tail.reserve(CHUNK);
+        tail.push_back(std::move(v));
+        if (tail.size() == CHUNK)
+        {
+            chunks.push_back(HeapAlloc<std::vector<T>>(std::move(tail)));
+            tail = std::vector<T>();
+        }
     }
-    ~HeapAlloc() { delete val; }
-    HeapAlloc& operator=(const HeapAlloc& other)
+
+    void resize(size_t n, const T& fill = T())
     {
-        delete val;
-        val = new T{other.Get()};
-        return *this;
+        while (size() > n && tail.size() < size() - n)
+        {
+            if (!tail.empty()) tail.clear();
+            else { tail = std::as_const(chunks.back()).Get(); chunks.pop_back(); }  // cut down to the part that stays below
+        }
+        if (size() > n) tail.resize(tail.size() - (size() - n));
+        while (size() < n) push_back(fill);
     }
 };
 
@@ -68,44 +151,87 @@ enum class AtomicType
     Error, Void, Template,
     Integer, Double, String, Boolean,
 };
+constexpr int ATOMIC_TYPE_COUNT = (int)AtomicType::Boolean + 1;
 
 struct UnionType; struct OverloadType; struct RecordType; struct LambdaType;
 typedef std::variant<AtomicType, UnionType, OverloadType, RecordType, LambdaType> Type;
+typedef SmallVector<HeapAlloc<Type>, 4> TypeList;  // the members of a record, union or overload
+
+// Every structurally distinct type has an id of its own, so that two types are equal exactly when their ids are. Atomic types
+// are their own ids, and the others are interned into a table shared by every thread the first time their id is needed.
+typedef uint32_t TypeId;
+
+// Where a type keeps its id once it is known, or 0 before, and its hash. Copies keep the id of the type they were made from, so
+// each type is interned at most once however often it is copied. A type must not be changed after its id is taken; make a new one
+// instead.
+class InternedId
+{
+    mutable std::atomic<uint64_t> hash = 0;
+    mutable std::atomic<TypeId> id = 0;
+public:
+    InternedId() = default;
+    InternedId(const InternedId& other) { Set(other.Get(), other.Hash()); }
+    InternedId& operator=(const InternedId& other) { Set(other.Get(), other.Hash()); return *this; }
+
+    TypeId Get() const { return id.load(std::memory_order_acquire); }
+    uint64_t Hash() const { return hash.load(std::memory_order_relaxed); }  // only once Get is not 0
+    void Set(TypeId t, uint64_t h = 0) const { hash.store(h, std::memory_order_relaxed); id.store(t, std::memory_order_release); }
+};
 
 struct UnionType
 {
-    std::vector<HeapAlloc<Type>> values;
+    TypeList values;
+    InternedId id;
 
-    UnionType(std::vector<HeapAlloc<Type>> v);
+    UnionType(TypeList v);
 };
 
 struct OverloadType
 {
-    std::vector<HeapAlloc<Type>> values;
+    TypeList values;
+    InternedId id;
 
-    OverloadType(std::vector<HeapAlloc<Type>> v);
+    OverloadType(TypeList v);
 };
 
 struct RecordType
 {
-    std::vector<HeapAlloc<Type>> values;
+    TypeList values;
+    InternedId id;
 
-    RecordType(std::vector<HeapAlloc<Type>> v);
+    RecordType(TypeList v);
 };
 
-struct ParsingContext; struct ReturnTypeSet;
+struct ParsingContext; struct ReturnTypeSet; struct LazyLambda;
+
+// What parsing one definition of a template lambda with one argument type gave.
+struct TemplateInstance
+{
+    HeapAlloc<ReturnTypeSet> returnTypes;
+    std::vector<ErrorOutput> errors;
+};
+
+// The instances of one definition by the id of their argument type, so that the body is parsed once for each, however many
+// copies of the template lambda ask. Shared by those copies, which can be in the contexts of different threads.
+struct TemplateInstances
+{
+    std::mutex mutex;
+    std::unordered_map<TypeId, TemplateInstance> byArg;
+};
 
 struct TemplateLambda
 {
-    std::vector<HeapAlloc<Type>> instantiatedArgs;
+    TypeList instantiatedArgs;
     std::vector<std::pair<VectorView<Token>, HeapAlloc<ParsingContext>>> definitions;
     std::vector<HeapAlloc<ReturnTypeSet>> returnTypes;
+    std::vector<std::shared_ptr<TemplateInstances>> instances;  // of each definition, made when first needed
 
     void CheckArgDef(int instArg, int definition, std::vector<ErrorOutput>& errors);
-    void AddInstArgs(Type a, ParsingContext& pc);
-    bool CheckAddInstArgs(Type a);
+    void AddInstArgs(const Type& a, ParsingContext& pc);
+    bool CheckAddInstArgs(const Type& a);
     void AddDefinition(VectorView<Token> tokens, ParsingContext& pc);
-    Type GetReturnType(Type a);
+    void AddDefinition(VectorView<Token> tokens, HeapAlloc<ParsingContext> context, std::shared_ptr<TemplateInstances> known, std::vector<ErrorOutput>& errors);
+    Type GetReturnType(const Type& a);
 
     static TemplateLambda AddTL(const TemplateLambda& a, const TemplateLambda& b, ParsingContext& pc);
 };
@@ -115,24 +241,98 @@ struct LambdaType
     HeapAlloc<Type> arg;
     HeapAlloc<Type> ret;
     std::optional<TemplateLambda> temp;
+    std::shared_ptr<LazyLambda> lazy;  // set if the body was skimmed in lazy mode, in which case ret is unused
+    InternedId id;  // of the argument and return types only, as those are all that equality looks at
 
     LambdaType(HeapAlloc<Type> a, HeapAlloc<Type> r);
 
+    const Type& Ret() const;  // the return type, which parses the body of a lazy lambda the first time
+
     void ShareTemplates(Type& other, ParsingContext& pc);
 };
 
+TypeId GetTypeId(const Type& t);  // parses the body of a lazy lambda, as its return type is part of its id
+
+// Unlike ids, which depend on the order types were first interned in, the hash only depends on the structure of a type, so it
+// is the same in every run of the compiler, as the order of members written to a module cache has to be.
+uint64_t GetTypeHash(const Type& t);
+
+// The order unions and overloads keep their members in, so that equal ones end up with the same members in the same order. Types
+// come by kind, atomic types by value, and others by hash.
+bool TypeBefore(const Type& a, const Type& b);
+
 bool operator==(const Type& a, const Type& b);
 bool operator!=(const Type& a, const Type& b);
 
-bool CheckCast(Type from, Type to);
+bool CheckCast(const Type& from, const Type& to);  // remembers the answer for each pair of types, unless it used a template lambda
+
+struct CastCacheStats
+{
+    uint64_t hits;
+    uint64_t misses;
+};
+
+CastCacheStats GetCastCacheStats();  // since the program started, over every thread
 
-bool IsTemplateType(Type type);  // Does not count template lambdas, only template arguments and their compositions.
+bool IsTemplateType(const Type& type);  // Does not count template lambdas, only template arguments and their compositions.
+bool HasTemplateLambda(const Type& type);  // Anywhere inside, which the id of a type does not tell apart.
+
+// A point in parsing to backtrack to, without copying the context. Variables and errors are only ever appended, so their counts
+// are enough to undo those, and variables retyped since then are put back from the context's undo log.
+struct ParsingCheckpoint
+{
+    size_t varStackSize;
+    size_t errorCount;
+    size_t undoSize;
+    size_t reportedCount;
+    int depth;  // how many checkpoints were open once it was taken, itself included
+};
+
+// Typedefs are only read while parsing, never added to, so every context made from another shares the same map.
+typedef std::shared_ptr<const std::map<SymbolId, Type>> SharedTypedefs;
+SharedTypedefs DefaultTypedefs();  // the built in types, by their keywords
 
 struct ParsingContext
 {
-    std::vector<std::pair<std::string, Type>> varStack;
-    std::map<std::string, Type> typedefs = { { "int", AtomicType::Integer }, { "double", AtomicType::Double }, { "string", AtomicType::String }, { "bool", AtomicType::Boolean } };
+    PersistentVector<std::pair<SymbolId, Type>> varStack;
+    SharedTypedefs typedefs = DefaultTypedefs();
     std::vector<ErrorOutput> errors;
+    bool lazyLambdas = false;  // only skim lambda bodies in braces, to be parsed when they are first called (see LazyLambda)
+
+    // The stack index of the innermost variable of each name, by symbol id, or -1, and for each variable the index of the one it
+    // shadows. Variables put straight into varStack, as when making a context, are indexed on the next lookup.
+    PersistentVector<int> innermost;
+    PersistentVector<int> shadowed;
+
+    std::vector<std::pair<int, Type>> varStackUndo;  // the old types of variables retyped while a checkpoint is open, oldest first
+    std::vector<std::shared_ptr<LazyLambda>> reportedUndo;  // lazy lambdas whose errors were added while a checkpoint is open
+    int openCheckpoints = 0;
+
+    // Every checkpoint must be closed by exactly one of Rollback or Commit, innermost first.
+    ParsingCheckpoint Checkpoint();
+    void Rollback(const ParsingCheckpoint& cp, bool keepErrors = false);
+    void Commit(const ParsingCheckpoint& cp);
+
+    // Undoes everything since cp like Rollback, but leaves it open. A checkpoint that has already been closed can be restored as
+    // well, as long as one taken before it is still open.
+    void Restore(const ParsingCheckpoint& cp, bool keepErrors = false);
+
+    void SetVariableType(int stackIndex, Type t);  // use this, not varStack directly, so that rolling back can undo it
+
+    // Parses the body of lazy if it has not been yet, and adds its errors to these if they have not been added to any context
+    // before. Rolling back past the call adds them again at the next one, unless it keeps the errors.
+    void ReportLazyErrors(const std::shared_ptr<LazyLambda>& lazy);
+
+    int FindVariable(SymbolId name);  // the stack index of the innermost variable called name, or -1 if there is none
+    int AddVariable(SymbolId name, Type t);
+    void PopVariables(size_t stackSize);  // removes every variable from stackSize on, as at the end of a scope
+
+    // A copy to parse something else in, as the body of a template lambda, which shares the variables and typedefs of this one
+    // until either changes them. It starts with no errors and no open checkpoints.
+    ParsingContext Fork() const;
+
+private:
+    void IndexVariables();
 };
 
 enum class TypeParsingPrecedence